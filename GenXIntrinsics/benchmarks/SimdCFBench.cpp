@@ -0,0 +1,302 @@
+/*===================== begin_copyright_notice ==================================
+
+ Copyright (c) 2020, Intel Corporation
+
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+======================= end_copyright_notice ==================================*/
+
+//===----------------------------------------------------------------------===//
+//
+/// genx-simdcf-bench
+/// -----------------
+///
+/// Synthetic benchmark for the CM SIMD CF lowering pass. It generates CM
+/// style IR with SIMD_IF/SIMD_ELSE/SIMD_DO_WHILE control flow of configurable
+/// shape, runs CMSimdCFLowering on it and reports the wall time, peak RSS and
+/// growth in instruction count.
+///
+/// The generated module has a kernel and layers of subroutines, each function
+/// calling random subroutines of the next layer from inside its SIMD control
+/// flow, so the subroutines are predicated. With the default layer width of 1
+/// this is a chain; wide layers and small functions give a large call graph. Each function is a sequence of regions. A region is a block, a
+/// SIMD if (with optional else) or a SIMD do..while loop, and the bodies of ifs
+/// and loops are nested sequences of regions, down to the nesting depth.
+///
+//===----------------------------------------------------------------------===//
+
+#include "llvm/GenXIntrinsics/GenXIntrinsics.h"
+#include "llvm/GenXIntrinsics/GenXIntrOpts.h"
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <random>
+
+#ifdef LLVM_ON_UNIX
+#include <sys/resource.h>
+#endif
+
+#include "llvmVCWrapper/IR/DerivedTypes.h"
+
+using namespace llvm;
+
+static cl::opt<unsigned> NumBlocks("blocks", cl::init(1000),
+                                   cl::desc("Basic blocks per function"));
+static cl::opt<unsigned> Depth("depth", cl::init(4),
+                               cl::desc("Maximum SIMD CF nesting depth"));
+static cl::opt<unsigned> SimdWidth("width", cl::init(16),
+                                   cl::desc("SIMD width (2 to 64; above 32 needs "
+                                            "-cmsimdcf-max-width=64)"));
+static cl::opt<unsigned>
+    LoopPercent("loops", cl::init(25),
+                cl::desc("Percentage of SIMD regions that are loops"));
+static cl::opt<unsigned>
+    CallDepth("call-depth", cl::init(0),
+              cl::desc("Number of layers of predicated subroutines"));
+static cl::opt<unsigned>
+    CallWidth("call-width", cl::init(1),
+              cl::desc("Number of subroutines in each layer"));
+static cl::opt<unsigned>
+    StoresPerBlock("stores", cl::init(2),
+                   cl::desc("Maximum vector stores per basic block"));
+static cl::opt<unsigned> Seed("seed", cl::init(1),
+                              cl::desc("Random seed for the generator"));
+static cl::opt<unsigned> Repeat("repeat", cl::init(1),
+                                cl::desc("Number of timed runs"));
+static cl::opt<bool> Verify("verify", cl::init(false),
+                            cl::desc("Verify the module after lowering"));
+static cl::opt<bool> PrintIR("print-ir", cl::init(false),
+                             cl::desc("Print the module after lowering"));
+
+namespace {
+
+// Generator for one function of the synthetic module.
+class SimdCFGenerator {
+  Function *F;
+  IRBuilder<> Builder;
+  std::mt19937 &Rng;
+  Value *Vec;
+  Value *Addr;
+  Function *SimdCFAny;
+  ArrayRef<Function *> Callees;
+  unsigned Budget;
+  unsigned NumConds = 0;
+
+public:
+  SimdCFGenerator(Function *F, ArrayRef<Function *> Callees, std::mt19937 &Rng)
+      : F(F), Builder(F->getContext()), Rng(Rng), Callees(Callees),
+        Budget(NumBlocks) {}
+  void generate();
+
+private:
+  unsigned random(unsigned N) { return Rng() % N; }
+  BasicBlock *createBlock();
+  Value *createSimdCond();
+  BasicBlock *generateRegions(BasicBlock *BB, unsigned Level);
+};
+
+} // namespace
+
+BasicBlock *SimdCFGenerator::createBlock() {
+  if (Budget)
+    --Budget;
+  auto BB = BasicBlock::Create(F->getContext(), "bb", F);
+  Builder.SetInsertPoint(BB);
+  for (unsigned i = 0, e = StoresPerBlock ? random(StoresPerBlock + 1) : 0;
+       i != e; ++i) {
+    auto Val = Builder.CreateAdd(
+        Vec, Builder.CreateVectorSplat(SimdWidth, Builder.getInt32(i)));
+    Builder.CreateStore(Val, Addr);
+  }
+  return BB;
+}
+
+// createSimdCond : create llvm.genx.simdcf.any on a varying predicate at the
+// current insert point.
+Value *SimdCFGenerator::createSimdCond() {
+  auto Pred = Builder.CreateICmpSGT(
+      Vec, Builder.CreateVectorSplat(SimdWidth, Builder.getInt32(++NumConds)));
+  return Builder.CreateCall(SimdCFAny, Pred, "any");
+}
+
+// generateRegions : generate a sequence of regions starting in BB
+//
+// Return: the unterminated block at the end of the sequence
+BasicBlock *SimdCFGenerator::generateRegions(BasicBlock *BB, unsigned Level) {
+  for (unsigned i = 0, e = 1 + random(3); i != e && Budget; ++i) {
+    if (Level == 0 || random(3) == 0) {
+      // Straight line code, sometimes with a call to a subroutine in the
+      // next layer.
+      Builder.SetInsertPoint(BB);
+      if (!Callees.empty() && Level != Depth && random(4) == 0)
+        Builder.CreateCall(Callees[random(Callees.size())], {Vec, Addr});
+      auto Next = createBlock();
+      BranchInst::Create(Next, BB);
+      BB = Next;
+    } else if (random(100) < LoopPercent) {
+      // SIMD do..while loop.
+      auto Header = createBlock();
+      BranchInst::Create(Header, BB);
+      auto Latch = generateRegions(Header, Level - 1);
+      Builder.SetInsertPoint(Latch);
+      auto Cond = createSimdCond();
+      auto Exit = createBlock();
+      BranchInst::Create(Header, Exit, Cond, Latch);
+      BB = Exit;
+    } else {
+      // SIMD if, with else half of the time.
+      Builder.SetInsertPoint(BB);
+      auto Cond = createSimdCond();
+      auto Then = createBlock();
+      auto ThenEnd = generateRegions(Then, Level - 1);
+      BasicBlock *Else = nullptr, *ElseEnd = nullptr;
+      if (random(2)) {
+        Else = createBlock();
+        ElseEnd = generateRegions(Else, Level - 1);
+      }
+      auto Join = createBlock();
+      BranchInst::Create(Then, Else ? Else : Join, Cond, BB);
+      BranchInst::Create(Join, ThenEnd);
+      if (ElseEnd)
+        BranchInst::Create(Join, ElseEnd);
+      BB = Join;
+    }
+  }
+  return BB;
+}
+
+void SimdCFGenerator::generate() {
+  auto Args = F->arg_begin();
+  Vec = &*Args++;
+  Addr = &*Args;
+  Type *Tys[] = {VCINTR::getVectorType(Builder.getInt1Ty(), SimdWidth)};
+  SimdCFAny = GenXIntrinsic::getGenXDeclaration(
+      F->getParent(), GenXIntrinsic::genx_simdcf_any, Tys);
+  auto BB = createBlock();
+  while (Budget)
+    BB = generateRegions(BB, Depth);
+  ReturnInst::Create(F->getContext(), BB);
+}
+
+// generateModule : generate the kernel and its layers of subroutines
+static std::unique_ptr<Module> generateModule(LLVMContext &Ctx) {
+  std::unique_ptr<Module> M(new Module("simdcf-bench", Ctx));
+  std::mt19937 Rng(Seed);
+  auto VecTy = VCINTR::getVectorType(Type::getInt32Ty(Ctx), SimdWidth);
+  auto FTy = FunctionType::get(Type::getVoidTy(Ctx),
+                               {VecTy, PointerType::get(VecTy, 0)}, false);
+  // Create the functions first, layer by layer, then generate the bodies.
+  // Funcs[0] is the kernel and layer i is Funcs[1 + (i - 1) * CallWidth] on.
+  unsigned Width = std::max(1U, unsigned(CallWidth));
+  std::vector<Function *> Funcs;
+  auto Kernel = Function::Create(FTy, GlobalValue::ExternalLinkage, "kernel",
+                                 M.get());
+  Kernel->addFnAttr("CMGenxMain");
+  Funcs.push_back(Kernel);
+  for (unsigned i = 0, e = CallDepth * Width; i != e; ++i)
+    Funcs.push_back(Function::Create(FTy, GlobalValue::InternalLinkage,
+                                     "subroutine", M.get()));
+  ArrayRef<Function *> AllFuncs = Funcs;
+  for (unsigned i = 0, e = Funcs.size(); i != e; ++i) {
+    unsigned Layer = i ? 1 + (i - 1) / Width : 0;
+    ArrayRef<Function *> Callees;
+    if (Layer != CallDepth)
+      Callees = AllFuncs.slice(1 + Layer * Width, Width);
+    SimdCFGenerator(Funcs[i], Callees, Rng).generate();
+  }
+  return M;
+}
+
+static size_t countInstructions(const Module &M) {
+  size_t Count = 0;
+  for (auto &F : M)
+    for (auto &BB : F)
+      Count += BB.size();
+  return Count;
+}
+
+static size_t countBlocks(const Module &M) {
+  size_t Count = 0;
+  for (auto &F : M)
+    Count += F.size();
+  return Count;
+}
+
+// getPeakRSS : peak resident set size of the process in KB, or 0 if unknown
+static long getPeakRSS() {
+#ifdef LLVM_ON_UNIX
+  struct rusage Usage;
+  if (!getrusage(RUSAGE_SELF, &Usage))
+    return Usage.ru_maxrss;
+#endif
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "CM SIMD CF lowering benchmark\n");
+  if (SimdWidth < 2 || SimdWidth > 64 || (SimdWidth & (SimdWidth - 1))) {
+    errs() << "simd width must be a power of 2 from 2 to 64\n";
+    return 1;
+  }
+
+  double MinTime = 0;
+  size_t InstsBefore = 0, InstsAfter = 0, BlocksBefore = 0, BlocksAfter = 0;
+  for (unsigned Run = 0; Run != std::max(1U, unsigned(Repeat)); ++Run) {
+    LLVMContext Ctx;
+    auto M = generateModule(Ctx);
+    InstsBefore = countInstructions(*M);
+    BlocksBefore = countBlocks(*M);
+
+    legacy::PassManager PM;
+    PM.add(createCMSimdCFLoweringPass());
+    auto Start = std::chrono::steady_clock::now();
+    PM.run(*M);
+    std::chrono::duration<double, std::milli> Time =
+        std::chrono::steady_clock::now() - Start;
+    if (!Run || Time.count() < MinTime)
+      MinTime = Time.count();
+
+    InstsAfter = countInstructions(*M);
+    BlocksAfter = countBlocks(*M);
+    if (Verify && verifyModule(*M, &errs()))
+      return 1;
+    if (PrintIR && !Run)
+      M->print(outs(), nullptr);
+  }
+
+  outs() << "functions:    "
+         << 1 + CallDepth * std::max(1U, unsigned(CallWidth)) << "\n"
+         << "blocks:       " << BlocksBefore << " -> " << BlocksAfter << "\n"
+         << "instructions: " << InstsBefore << " -> " << InstsAfter << " (x"
+         << format("%.2f", double(InstsAfter) / InstsBefore) << ")\n"
+         << "time (ms):    " << format("%.3f", MinTime) << "\n"
+         << "peak RSS (KB): " << getPeakRSS() << "\n";
+  return 0;
+}
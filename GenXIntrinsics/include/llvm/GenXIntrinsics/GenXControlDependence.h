@@ -0,0 +1,130 @@
+/*===================== begin_copyright_notice ==================================
+
+ Copyright (c) 2020, Intel Corporation
+
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+======================= end_copyright_notice ==================================*/
+
+//===----------------------------------------------------------------------===//
+//
+/// GenXControlDependence
+/// ---------------------
+///
+/// Control dependence of basic blocks, with queries for the SIMD branches
+/// (branches on ``llvm.genx.simdcf.any``) that control a block.
+///
+/// A block B is control dependent on a block Y if Y's terminator decides
+/// whether B executes: B post-dominates a successor of Y but does not strictly
+/// post-dominate Y. This is computed in linear time as the reverse dominance
+/// frontiers on the post-dominator tree (Cytron et al.).
+///
+/// The analysis is available as the legacy GenXControlDependenceWrapperPass
+/// and as the new pass manager GenXControlDependenceAnalysis.
+///
+//===----------------------------------------------------------------------===//
+
+#ifndef GENX_CONTROL_DEPENDENCE_H
+#define GENX_CONTROL_DEPENDENCE_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Pass.h"
+
+namespace llvm {
+class BasicBlock;
+class Function;
+class PostDominatorTree;
+class raw_ostream;
+
+// The control dependence of the blocks of one function.
+class GenXControlDependence {
+  // For each block, the blocks it is control dependent on.
+  DenseMap<const BasicBlock *, SmallVector<BasicBlock *, 2>> Controllers;
+  // For each block, the blocks control dependent on it. They are ordered by
+  // successor, then in post-dominator tree order going up from the successor.
+  DenseMap<const BasicBlock *, SmallVector<BasicBlock *, 4>> Dependents;
+
+public:
+  void compute(Function &F, const PostDominatorTree &PDT);
+  void releaseMemory();
+
+  // The blocks whose terminators control whether BB executes.
+  ArrayRef<BasicBlock *> getControllingBlocks(const BasicBlock *BB) const;
+  // The blocks whose execution is controlled by BB's terminator.
+  ArrayRef<BasicBlock *> getDependentBlocks(const BasicBlock *BB) const;
+  // The controlling blocks of BB that end in a SIMD branch.
+  SmallVector<BasicBlock *, 2>
+  getControllingSimdBranches(const BasicBlock *BB) const;
+  // The SIMD width BB executes with: the width of its first controlling SIMD
+  // branch, or 0 if it is not controlled by a SIMD branch.
+  unsigned getSimdWidth(const BasicBlock *BB) const;
+  // The width of the SIMD branch that ends BB, or 0 if it is not one.
+  static unsigned getSimdBranchWidth(const BasicBlock *BB);
+
+  void print(raw_ostream &OS, const Function &F) const;
+};
+
+// Legacy pass manager wrapper.
+class GenXControlDependenceWrapperPass : public FunctionPass {
+  GenXControlDependence CD;
+  const Function *F = nullptr;
+
+public:
+  static char ID;
+  GenXControlDependenceWrapperPass();
+  StringRef getPassName() const override { return "GenX control dependence"; }
+  void getAnalysisUsage(AnalysisUsage &AU) const override;
+  bool runOnFunction(Function &F) override;
+  void releaseMemory() override { CD.releaseMemory(); }
+  void print(raw_ostream &OS, const Module *M = nullptr) const override;
+
+  GenXControlDependence &getControlDependence() { return CD; }
+  const GenXControlDependence &getControlDependence() const { return CD; }
+};
+
+void initializeGenXControlDependenceWrapperPassPass(PassRegistry &);
+FunctionPass *createGenXControlDependenceWrapperPass();
+
+// New pass manager analysis.
+class GenXControlDependenceAnalysis
+    : public AnalysisInfoMixin<GenXControlDependenceAnalysis> {
+  friend AnalysisInfoMixin<GenXControlDependenceAnalysis>;
+  static AnalysisKey Key;
+
+public:
+  using Result = GenXControlDependence;
+  Result run(Function &F, FunctionAnalysisManager &AM);
+};
+
+// New pass manager printer.
+class GenXControlDependencePrinterPass
+    : public PassInfoMixin<GenXControlDependencePrinterPass> {
+  raw_ostream &OS;
+
+public:
+  explicit GenXControlDependencePrinterPass(raw_ostream &OS) : OS(OS) {}
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM);
+};
+
+} // namespace llvm
+
+#endif
@@ -15,11 +15,14 @@
 #ifndef LLVM_GENX_INTR_OPTS_H
 #define LLVM_GENX_INTR_OPTS_H
 
+#include <string>
+
 namespace llvm {
 
 class FunctionPass;
 class ModulePass;
 class Pass;
+class PassRegistry;
 
 //===----------------------------------------------------------------------===//
 //
@@ -27,6 +30,11 @@ class Pass;
 //
 Pass *createCMSimdCFLoweringPass();
 Pass *createISPCSimdCFLoweringPass();
+// Lower ISPC SIMD control flow only in the named function and the
+// subroutines it makes predicated, for a JIT recompiling one function.
+Pass *createISPCSimdCFLoweringPass(const std::string &FunctionName);
+void initializeCMSimdCFLoweringPass(PassRegistry &);
+void initializeISPCSimdCFLoweringPass(PassRegistry &);
 
 //===----------------------------------------------------------------------===//
 //
@@ -34,6 +42,14 @@ Pass *createISPCSimdCFLoweringPass();
 //
 Pass *createGenXRestoreIntrAttrPass();
 
+//===----------------------------------------------------------------------===//
+//
+// GenXMaskSimplify - Fold and canonicalize mask operations. Intended to run
+// right after CMSimdCFLowering / ISPCSimdCFLowering.
+//
+Pass *createGenXMaskSimplifyPass();
+void initializeGenXMaskSimplifyPass(PassRegistry &);
+
 } // End llvm namespace
 
 #endif
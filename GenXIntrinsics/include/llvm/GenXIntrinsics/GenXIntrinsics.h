@@ -243,6 +243,11 @@ bool isOverloadedArg(unsigned IntrinID, unsigned ArgNum);
 /// in intrinsic is overloaded
 bool isOverloadedRet(unsigned IntrinID);
 
+/// GenXIntrinsic::getPredicateOperandNum(ID) - Return the number of the
+/// predicate operand as given in the intrinsic's description, or -1 if it
+/// has none
+int getPredicateOperandNum(unsigned IntrinID);
+
 /// GenXIntrinsic::getAnyDeclaration(M, ID) - Create or insert a LLVM
 /// Function declaration for an intrinsic, and return it.
 ///
@@ -46,6 +46,11 @@ const static char CMFloatControl[] = "CMFloatControl";
 const static char CMGenxSIMT[] = "CMGenxSIMT";
 const static char OCLRuntime[] = "oclrt";
 const static char ReferencedIndirectly[] = "referenced-indirectly";
+// Marks the execution mask variable created by SIMD CF lowering.
+const static char GenXSimdCFEM[] = "genx.simdcf.em";
+// The call mask width a subroutine was lowered with by per-function SIMD
+// CF lowering.
+const static char GenXSimdCFCallMask[] = "genx.simdcf.callmask";
 } // namespace FunctionMD
 
 namespace VCModuleMD {
@@ -35,15 +35,58 @@
 #ifndef CMSIMDCF_LOWER_H
 #define CMSIMDCF_LOWER_H
 
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/ValueHandle.h"
 #include <algorithm>
 #include <set>
+#include <string>
+#include <vector>
 
 namespace llvm {
 
+class OptimizationRemarkEmitter;
+
+// The result of the read-only analysis phase of SIMD CF lowering for one
+// function. Computing it does not modify the IR, so functions that do not
+// call each other can be analyzed concurrently.
+struct CMSimdCFAnalysis {
+  Function *F = nullptr;
+  // Call mask width if F is a predicated subroutine, else 0.
+  unsigned CMWidth = 0;
+  // The widest simd CF allowed, which is the width of EM.
+  unsigned MaxWidth = 0;
+  // Whether F itself contains any simd branch.
+  bool FoundSIMD = false;
+  // The basic blocks ending with a simd branch, and the simd width of each one.
+  MapVector<BasicBlock *, unsigned> SimdBranches;
+  // The basic blocks ending with a simd branch on a uniform condition, which
+  // are left out of SimdBranches so they can stay scalar.
+  SmallVector<BasicBlock *, 4> UniformBranches;
+  // The basic blocks to be predicated, and the simd width of each one.
+  MapVector<BasicBlock *, unsigned> PredicatedBlocks;
+  // Errors found by the analysis. They are emitted when the result is
+  // applied, so their order does not depend on thread scheduling.
+  std::vector<std::pair<Instruction *, std::string>> Errors;
+  // Whether optimization remarks are wanted for F, and if so the blocks
+  // control dependent on each simd branch, keyed by its terminator.
+  bool WantRemarks = false;
+  MapVector<Instruction *, SmallVector<BasicBlock *, 4>> ControlledBlocks;
+};
+
+// The profile of one simd branch: the number of executions in which all
+// enabled channels took the true leg, all took the false leg, and the
+// channels diverged.
+struct SimdBranchProfile {
+  uint64_t AllTrue = 0;
+  uint64_t AllFalse = 0;
+  uint64_t Divergent = 0;
+  uint64_t getTotal() const { return AllTrue + AllFalse + Divergent; }
+};
+
 // The worker class for lowering CM SIMD CF
 class CMSimdCFLower {
   Function *F;
@@ -59,47 +102,114 @@ class CMSimdCFLower {
   std::map<BasicBlock *, BasicBlock *> JIPs;
   // Subroutines that are predicated, mapping to the simd width.
   std::map<Function *, unsigned> PredicatedSubroutines;
+  // Calls that have been predicated. Any other direct call to a predicated
+  // subroutine runs with all channels enabled.
+  std::set<CallInst *> PredicatedCalls;
   // Execution mask variable.
   GlobalVariable *EMVar;
+  // Width of EM, the widest simd CF allowed.
+  unsigned MaxWidth;
   // Resume mask for each join point.
   std::map<BasicBlock *, AllocaInst *> RMAddrs;
   // Set of intrinsic calls (other than wrregion) that have been predicated.
   std::set<AssertingVH<Value>> AlreadyPredicated;
   // Mask for shufflevector to extract part of EM.
   SmallVector<Constant *, 32> ShuffleMask;
+  // The EM values (and slices of EM) loaded so far in the block being
+  // predicated, keyed by simd width and number of channels. They can be
+  // reused by any instruction up to the next one that may change EM.
+  SmallDenseMap<std::pair<unsigned, unsigned>, Instruction *, 4> EMCache;
+  // The instruction being predicated, which is where a cached EM is valid.
+  Instruction *EMCacheInst = nullptr;
+  // Whether EM is known to be all ones at the start of each block, and at
+  // the instruction being predicated. Predication is skipped where it is.
+  DenseMap<BasicBlock *, bool> EMAllOnesAtEntry;
+  bool EMAllOnes = false;
+  // The llvm.genx.unmask.end calls in each function, built on first use from
+  // the declaration's use list.
+  std::map<Function *, SmallVector<CallInst *, 4>> UnmaskEnds;
+  bool UnmaskEndsIndexed = false;
+  // While optimization remarks are wanted, the number of instructions and
+  // of stores predicated in each block, and the block that the code of
+  // each join point was split out to.
+  bool CountPredication = false;
+  DenseMap<BasicBlock *, std::pair<unsigned, unsigned>> PredicationCounts;
+  DenseMap<BasicBlock *, BasicBlock *> SplitJoins;
+  // The divergence profile of the simd branches, keyed by the
+  // "file:line:column" of each branch's debug location.
+  StringMap<SimdBranchProfile> Profile;
 public:
+  // The default width of EM. A wider EM variable allows wider simd CF, up
+  // to MAX_SIMD_CF_WIDTH_LIMIT.
   static const unsigned MAX_SIMD_CF_WIDTH = 32;
+  static const unsigned MAX_SIMD_CF_WIDTH_LIMIT = 64;
 
-  CMSimdCFLower(GlobalVariable *EMask) : EMVar(EMask) {}
+  CMSimdCFLower(GlobalVariable *EMask)
+      : EMVar(EMask),
+        MaxWidth(cast<VectorType>(EMask->getValueType())->getNumElements()) {}
 
   static CallInst *isSimdCFAny(Value *V);
   static Use *getSimdConditionUse(Value *Cond);
 
+  // Analysis phase: only reads the IR, safe to run concurrently.
+  static void analyzeFunction(CMSimdCFAnalysis *A);
+  // Mutation phase: must be run serially, in visit order.
+  void applyAnalysis(CMSimdCFAnalysis *A);
+  unsigned getCallMaskWidth(Function *F) const;
+  void shareCallMaskWidth(ArrayRef<Function *> SCC);
+  unsigned getMaxWidth() const { return MaxWidth; }
+  Function *cloneForFullMask(Function *F, unsigned *Budget);
+
   void processFunction(Function *F);
+  void loadProfile(StringRef FileName);
 
 private:
-  bool findSimdBranches(unsigned CMWidth);
-  void determinePredicatedBlocks();
-  void markPredicatedBranches();
+  static void findSimdBranches(CMSimdCFAnalysis *A);
+  static void determinePredicatedBlocks(CMSimdCFAnalysis *A);
+  static void markPredicatedBranches(CMSimdCFAnalysis *A);
+  static bool isUniformCondition(Value *V,
+      SmallDenseMap<Value *, bool, 8> *Known, unsigned Depth);
+  void scalarizeUniformBranches(CMSimdCFAnalysis *A);
+  void ifConvert(CMSimdCFAnalysis *A);
+  bool ifConvertBranch(BasicBlock *BB, CMSimdCFAnalysis *A,
+      OptimizationRemarkEmitter *ORE);
+  const SimdBranchProfile *getProfile(Instruction *Br) const;
+  bool isRarelyDivergent(Instruction *Br) const;
+  bool isOftenDivergent(Instruction *Br) const;
+  void layoutBlocks();
   void fixSimdBranches();
   void findAndSplitJoinPoints();
   void determineJIPs();
   void determineJIP(BasicBlock *BB, std::map<BasicBlock *, unsigned> *Numbers, bool IsJoin);
+  void removeUnneededJIPs(std::map<BasicBlock *, unsigned> *Numbers,
+      const std::vector<BasicBlock *> &Layout);
 
   // Methods to add predication to the code
   void predicateCode(unsigned CMWidth);
+  void computeAllOnesEM(unsigned CMWidth);
+  static bool updateAllOnesEM(Instruction *Inst, bool AllOnes);
   void predicateBlock(BasicBlock *BB, unsigned SimdWidth);
   void predicateInst(Instruction *Inst, unsigned SimdWidth);
   void rewritePredication(CallInst *CI, unsigned SimdWidth);
   void predicateStore(Instruction *SI, unsigned SimdWidth);
+  bool predicateStoreByMask(Instruction *SI, unsigned SimdWidth,
+      unsigned NumChannels);
   void predicateSend(CallInst *CI, unsigned IntrinsicID, unsigned SimdWidth);
   void predicateScatterGather(CallInst *CI, unsigned SimdWidth, unsigned PredOperandNum);
   CallInst *predicateWrRegion(CallInst *WrR, unsigned SimdWidth);
   void predicateCall(CallInst *CI, unsigned SimdWidth);
+  void countPredication(Instruction *Inst, bool IsStore);
+  void emitRemarks(CMSimdCFAnalysis *A,
+      ArrayRef<std::pair<Instruction *, unsigned>> Branches);
 
   void lowerSimdCF();
+  void shareRMSlots();
   void lowerUnmaskOps();
+  void promoteMasks();
+  void indexUnmaskEnds(Module *M);
+  Value *getAvailableEM(Instruction *Load);
   Instruction *loadExecutionMask(Instruction *InsertBefore, unsigned SimdWidth, unsigned NumChannels = 1);
+  static bool mayChangeEM(Instruction *Inst);
   Value *getRMAddr(BasicBlock *JP, unsigned SimdWidth);
 };
 
@@ -193,6 +193,19 @@ Imported_Intrinsics = \
 ###
     "vstore" : ["void",["anyvector","anyptr"],"None"],
 
+### ``llvm.genx.vstore.masked.<vector type>.<ptr type>.<predicate type>`` : store the enabled elements of a vector value into memory
+### ^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^
+###
+### This intrinsic is like vstore, except that only the elements whose
+### predicate bit is set are written. The other elements in memory keep
+### their old value.
+###
+### * arg0: the vector to write (overloaded)
+### * arg1: the memory to be accessed (overloaded)
+### * arg2: vXi1 predicate, same vector width as arg0 (overloaded)
+###
+    "vstore_masked" : ["void",["anyvector","anyptr","anyvector"],"None"],
+
 ### ``llvm.genx.vload.<return type>.<ptr type>`` : load a vector value from memory
 ### ^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^
 ###
@@ -118,6 +118,42 @@ for i in range(len(parse)):
 # Output file is always last
 outputFile = parse[-1]
 
+# The predicate operand of an intrinsic is only given in its description, as
+# a "### * argN: vXi1 predicate" line in the comment block above it.
+predicate_re = re.compile(r'^###\s*\*?\s*arg(\d+)\s*:?\s*(?:i1/)?v\S*i1 predicate')
+definition_re = re.compile(r'^\s*"(\w+)"\s*:\s*\[')
+
+def findPredicateOperands(fileName):
+    """
+    Scans the comment blocks of an intrinsic definitions file and returns
+    a dictionary from intrinsic name to predicate operand number
+    """
+    predicates = dict()
+    pred = None
+    inDefinitions = False
+    with open(fileName) as f:
+        for line in f:
+            if line.startswith("###"):
+                if inDefinitions:
+                    # A new comment block.
+                    pred = None
+                    inDefinitions = False
+                match = predicate_re.match(line)
+                if match:
+                    pred = int(match.group(1))
+                continue
+            match = definition_re.match(line)
+            if match:
+                inDefinitions = True
+                if pred is not None:
+                    predicates[match.group(1)] = pred
+    return predicates
+
+PredicateOperands = dict()
+for i in range(1, len(parse)):
+    if (".py" in parse[i]):
+        PredicateOperands.update(findPredicateOperands(parse[i]))
+
 
 def ik_compare(ikl, ikr):
   ikl = ikl.replace("_",".")
@@ -346,6 +382,22 @@ def createOverloadRetTable():
     f.write("#endif\n\n")
     f.close()
 
+def createPredicateOperandTable():
+    f = open(outputFile,"a")
+    f.write("// Predicate operand number\n"
+            "#ifdef GET_INTRINSIC_PREDICATE_OPERAND_TABLE\n"
+            "switch(IntrinID) {\n"
+            "default:\n"
+            "  return -1;\n")
+    for pred in sorted(set(PredicateOperands.values())):
+        for i in range(len(ID_array)):
+            if PredicateOperands.get(ID_array[i]) == pred:
+                f.write("case GenXIntrinsic::genx_" + ID_array[i] + ":\n")
+        f.write("  return " + str(pred) + ";\n")
+    f.write("}\n")
+    f.write("#endif\n\n")
+    f.close()
+
 def createOverloadArgsTable():
     f = open(outputFile,"a")
     f.write("// Is arg overloaded\n"
@@ -566,6 +618,7 @@ generateIDArray()
 createOverloadTable()
 createOverloadArgsTable()
 createOverloadRetTable()
+createPredicateOperandTable()
 sortedIntrinsicsOnLenth()
 createTypeTable()
 createAttributeTable()
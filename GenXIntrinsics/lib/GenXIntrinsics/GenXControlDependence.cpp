@@ -0,0 +1,239 @@
+/*===================== begin_copyright_notice ==================================
+
+ Copyright (c) 2020, Intel Corporation
+
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+======================= end_copyright_notice ==================================*/
+
+//===----------------------------------------------------------------------===//
+//
+/// GenXControlDependence
+/// ---------------------
+///
+/// See GenXControlDependence.h.
+///
+//===----------------------------------------------------------------------===//
+
+#include "llvm/GenXIntrinsics/GenXControlDependence.h"
+#include "llvm/GenXIntrinsics/GenXSimdCFLowering.h"
+
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Function.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+
+#include "llvmVCWrapper/IR/DerivedTypes.h"
+
+using namespace llvm;
+
+/***********************************************************************
+ * compute : compute the control dependence of the blocks of F
+ *
+ * The blocks that X is control dependent on are the reverse dominance
+ * frontier of X, computed bottom up over the post-dominator tree:
+ *
+ * * a predecessor Y of X is in RDF(X) if X does not immediately
+ *   post-dominate Y;
+ *
+ * * for each child Z of X in the post-dominator tree, a block Y in RDF(Z) is
+ *   in RDF(X) if X does not immediately post-dominate Y.
+ */
+void GenXControlDependence::compute(Function &F, const PostDominatorTree &PDT)
+{
+  releaseMemory();
+  auto getIPDom = [&PDT](BasicBlock *BB) -> BasicBlock * {
+    if (auto Node = PDT.getNode(BB))
+      if (auto IDom = Node->getIDom())
+        return IDom->getBlock();
+    return nullptr;
+  };
+  for (auto Node : post_order(PDT.getRootNode())) {
+    BasicBlock *X = Node->getBlock();
+    if (!X)
+      continue; // virtual root
+    SmallVector<BasicBlock *, 2> RDF;
+    SmallPtrSet<BasicBlock *, 4> Seen;
+    for (auto pi = pred_begin(X), pe = pred_end(X); pi != pe; ++pi) {
+      BasicBlock *Y = *pi;
+      if (getIPDom(Y) != X && Seen.insert(Y).second)
+        RDF.push_back(Y);
+    }
+    for (auto ci = Node->begin(), ce = Node->end(); ci != ce; ++ci) {
+      auto ChildRDF = Controllers.find((*ci)->getBlock());
+      if (ChildRDF == Controllers.end())
+        continue;
+      for (auto Y : ChildRDF->second)
+        if (getIPDom(Y) != X && Seen.insert(Y).second)
+          RDF.push_back(Y);
+    }
+    if (!RDF.empty())
+      Controllers[X] = std::move(RDF);
+  }
+
+  // Invert to get the dependents of each block, in layout order of the
+  // dependent blocks to start with.
+  for (auto fi = F.begin(), fe = F.end(); fi != fe; ++fi) {
+    auto It = Controllers.find(&*fi);
+    if (It == Controllers.end())
+      continue;
+    for (auto Y : It->second)
+      Dependents[Y].push_back(&*fi);
+  }
+  // Order the dependents of Y by the successor of Y that they post-dominate,
+  // then going up the post-dominator tree from that successor.
+  for (auto &Entry : Dependents) {
+    auto Term = Entry.first->getTerminator();
+    auto getKey = [&](BasicBlock *BB) {
+      unsigned si = 0, se = Term->getNumSuccessors();
+      for (; si != se; ++si)
+        if (PDT.dominates(BB, Term->getSuccessor(si)))
+          break;
+      return std::make_pair(si, ~PDT.getNode(BB)->getLevel());
+    };
+    std::stable_sort(Entry.second.begin(), Entry.second.end(),
+                     [&](BasicBlock *BB1, BasicBlock *BB2) {
+                       return getKey(BB1) < getKey(BB2);
+                     });
+  }
+}
+
+void GenXControlDependence::releaseMemory()
+{
+  Controllers.clear();
+  Dependents.clear();
+}
+
+ArrayRef<BasicBlock *>
+GenXControlDependence::getControllingBlocks(const BasicBlock *BB) const
+{
+  auto It = Controllers.find(BB);
+  if (It == Controllers.end())
+    return None;
+  return It->second;
+}
+
+ArrayRef<BasicBlock *>
+GenXControlDependence::getDependentBlocks(const BasicBlock *BB) const
+{
+  auto It = Dependents.find(BB);
+  if (It == Dependents.end())
+    return None;
+  return It->second;
+}
+
+SmallVector<BasicBlock *, 2>
+GenXControlDependence::getControllingSimdBranches(const BasicBlock *BB) const
+{
+  SmallVector<BasicBlock *, 2> SimdBranches;
+  for (auto Y : getControllingBlocks(BB))
+    if (getSimdBranchWidth(Y))
+      SimdBranches.push_back(Y);
+  return SimdBranches;
+}
+
+unsigned GenXControlDependence::getSimdWidth(const BasicBlock *BB) const
+{
+  for (auto Y : getControllingBlocks(BB))
+    if (unsigned Width = getSimdBranchWidth(Y))
+      return Width;
+  return 0;
+}
+
+unsigned GenXControlDependence::getSimdBranchWidth(const BasicBlock *BB)
+{
+  auto Br = dyn_cast<BranchInst>(BB->getTerminator());
+  if (!Br || !Br->isConditional())
+    return 0;
+  if (auto U = CMSimdCFLower::getSimdConditionUse(Br->getCondition()))
+    return cast<VectorType>((*U)->getType())->getNumElements();
+  return 0;
+}
+
+void GenXControlDependence::print(raw_ostream &OS, const Function &F) const
+{
+  OS << "GenX control dependence for function '" << F.getName() << "':\n";
+  for (auto fi = F.begin(), fe = F.end(); fi != fe; ++fi) {
+    auto Controlling = getControllingBlocks(&*fi);
+    if (Controlling.empty())
+      continue;
+    OS << "  " << fi->getName() << ":";
+    for (auto Y : Controlling) {
+      OS << " " << Y->getName();
+      if (unsigned Width = getSimdBranchWidth(Y))
+        OS << "(simd" << Width << ")";
+    }
+    OS << "\n";
+  }
+}
+
+char GenXControlDependenceWrapperPass::ID = 0;
+INITIALIZE_PASS_BEGIN(GenXControlDependenceWrapperPass, "GenXControlDependence",
+                      "GenX control dependence", true, true)
+INITIALIZE_PASS_DEPENDENCY(PostDominatorTreeWrapperPass)
+INITIALIZE_PASS_END(GenXControlDependenceWrapperPass, "GenXControlDependence",
+                    "GenX control dependence", true, true)
+
+FunctionPass *llvm::createGenXControlDependenceWrapperPass() {
+  return new GenXControlDependenceWrapperPass();
+}
+
+GenXControlDependenceWrapperPass::GenXControlDependenceWrapperPass()
+    : FunctionPass(ID) {
+  initializeGenXControlDependenceWrapperPassPass(
+      *PassRegistry::getPassRegistry());
+}
+
+void GenXControlDependenceWrapperPass::getAnalysisUsage(
+    AnalysisUsage &AU) const {
+  AU.addRequired<PostDominatorTreeWrapperPass>();
+  AU.setPreservesAll();
+}
+
+bool GenXControlDependenceWrapperPass::runOnFunction(Function &Fn) {
+  F = &Fn;
+  CD.compute(Fn, getAnalysis<PostDominatorTreeWrapperPass>().getPostDomTree());
+  return false;
+}
+
+void GenXControlDependenceWrapperPass::print(raw_ostream &OS,
+                                             const Module *) const {
+  if (F)
+    CD.print(OS, *F);
+}
+
+AnalysisKey GenXControlDependenceAnalysis::Key;
+
+GenXControlDependence
+GenXControlDependenceAnalysis::run(Function &F, FunctionAnalysisManager &AM) {
+  GenXControlDependence CD;
+  CD.compute(F, AM.getResult<PostDominatorTreeAnalysis>(F));
+  return CD;
+}
+
+PreservedAnalyses
+GenXControlDependencePrinterPass::run(Function &F,
+                                      FunctionAnalysisManager &AM) {
+  AM.getResult<GenXControlDependenceAnalysis>(F).print(OS, F);
+  return PreservedAnalyses::all();
+}
@@ -497,6 +497,12 @@ bool GenXIntrinsic::isOverloadedRet(unsigned IntrinID) {
 #undef GET_INTRINSIC_OVERLOAD_RET_TABLE
 }
 
+int GenXIntrinsic::getPredicateOperandNum(unsigned IntrinID) {
+#define GET_INTRINSIC_PREDICATE_OPERAND_TABLE
+#include "llvm/GenXIntrinsics/GenXIntrinsicDescription.gen"
+#undef GET_INTRINSIC_PREDICATE_OPERAND_TABLE
+}
+
 /// Find the segment of \c IntrinsicNameTable for intrinsics with the same
 /// target as \c Name, or the generic table if \c Name is not target specific.
 ///
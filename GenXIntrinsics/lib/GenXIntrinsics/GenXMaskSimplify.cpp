@@ -0,0 +1,510 @@
+/*===================== begin_copyright_notice ==================================
+
+ Copyright (c) 2020, Intel Corporation
+
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+======================= end_copyright_notice ==================================*/
+
+//===-- GenXMaskSimplify.cpp - GenX mask simplification pass --------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+/// GenXMaskSimplify
+/// ----------------
+///
+/// This is a function pass that folds and canonicalizes operations on
+/// predicates (vectors of i1) left behind by SIMD CF lowering and by the
+/// front end:
+///
+/// * ``genx.any`` and ``genx.all`` of a constant are folded. Of a negated
+///   value, they become the negation of ``genx.all`` and ``genx.any``
+///   respectively, so the vector xor can go away.
+///
+/// * ``genx.rdpredregion`` of a constant is folded. Of a
+///   ``genx.wrpredregion`` it reads the written value back if the regions
+///   match, or reads the old value if they do not overlap. Of another
+///   ``genx.rdpredregion`` it reads the original value directly.
+///
+/// * ``genx.wrpredregion`` of the whole value is just the new value, and a
+///   write of what was just read from the same region is the old value.
+///
+/// * ``genx.wrpredpredregion`` whose predicate is constant over the region
+///   becomes the old value or a plain ``genx.wrpredregion``.
+///
+/// * ``genx.simdcf.get.em`` of a constant is folded, and an unused one is
+///   removed.
+///
+/// * and, or and xor on predicates are folded with constants, with
+///   themselves and with their negation. The negation of a compare with no
+///   other use becomes the inverse compare, which removes the negation that
+///   SIMD CF lowering builds for a goto condition.
+///
+/// Mask computation that is left dead is removed.
+///
+//===----------------------------------------------------------------------===//
+
+#define DEBUG_TYPE "GENX_MASKSIMPLIFY"
+
+#include "llvm/GenXIntrinsics/GenXIntrOpts.h"
+#include "llvm/GenXIntrinsics/GenXIntrinsics.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/ConstantFolding.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/ValueHandle.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+using namespace llvm;
+
+STATISTIC(NumMaskOpsSimplified, "Number of mask operations simplified");
+
+namespace {
+
+// GenXMaskSimplify : fold and canonicalize mask operations
+class GenXMaskSimplify : public FunctionPass {
+public:
+  GenXMaskSimplify();
+
+  StringRef getPassName() const override {
+    return "GenX Mask Simplification";
+  }
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.setPreservesCFG();
+  }
+
+  bool runOnFunction(Function &F) override;
+
+private:
+  Value *simplify(Instruction *Inst);
+  Value *simplifyAnyAll(CallInst *CI, bool IsAll);
+  Value *simplifyRdPredRegion(CallInst *CI);
+  Value *simplifyWrPredRegion(CallInst *CI);
+  Value *simplifyWrPredPredRegion(CallInst *CI);
+  Value *simplifyBinaryOp(BinaryOperator *BO);
+
+public:
+  static char ID;
+};
+} // namespace
+
+INITIALIZE_PASS_BEGIN(GenXMaskSimplify, "GenXMaskSimplify",
+                      "GenXMaskSimplify", false, false)
+INITIALIZE_PASS_END(GenXMaskSimplify, "GenXMaskSimplify",
+                    "GenXMaskSimplify", false, false)
+
+char GenXMaskSimplify::ID = 0;
+
+Pass *llvm::createGenXMaskSimplifyPass() {
+  return new GenXMaskSimplify;
+}
+
+GenXMaskSimplify::GenXMaskSimplify() : FunctionPass(ID) {
+  initializeGenXMaskSimplifyPass(*PassRegistry::getPassRegistry());
+}
+
+// isMask : check whether a type is i1 or a vector of i1
+static bool isMask(Type *Ty) {
+  return Ty->getScalarType()->isIntegerTy(1);
+}
+
+// getMaskElements : get the elements of a constant mask
+// Returns false if any element is not known, e.g. undef.
+static bool getMaskElements(Constant *C, SmallVectorImpl<bool> &Elts) {
+  unsigned Width = 1;
+  if (auto VT = dyn_cast<VectorType>(C->getType()))
+    Width = VT->getNumElements();
+  for (unsigned i = 0; i != Width; ++i) {
+    auto Elt = dyn_cast_or_null<ConstantInt>(
+        C->getType()->isVectorTy() ? C->getAggregateElement(i) : C);
+    if (!Elt)
+      return false;
+    Elts.push_back(Elt->isOne());
+  }
+  return true;
+}
+
+// getMaskConstant : build a constant mask from its elements
+static Constant *getMaskConstant(LLVMContext &Ctx, ArrayRef<bool> Elts) {
+  SmallVector<Constant *, 32> Vals;
+  for (bool Elt : Elts)
+    Vals.push_back(ConstantInt::get(Type::getInt1Ty(Ctx), Elt));
+  return ConstantVector::get(Vals);
+}
+
+// getNegated : if V is a negation (xor with all ones), get what it negates
+static Value *getNegated(Value *V) {
+  auto BO = dyn_cast<BinaryOperator>(V);
+  if (!BO || BO->getOpcode() != Instruction::Xor)
+    return nullptr;
+  for (unsigned i = 0; i != 2; ++i)
+    if (auto C = dyn_cast<Constant>(BO->getOperand(i)))
+      if (C->isAllOnesValue())
+        return BO->getOperand(1 - i);
+  return nullptr;
+}
+
+// getConstantOffset : get a constant region offset, or -1 if not constant
+static int64_t getConstantOffset(Value *V) {
+  if (auto CI = dyn_cast<ConstantInt>(V))
+    return CI->getZExtValue();
+  return -1;
+}
+
+// isDead : check whether an instruction is unused and can be removed
+// A GenX intrinsic that does not access memory can be removed even if it is
+// not marked as returning, and so is not trivially dead. simdcf.get.em has
+// side effects only to stop it being moved.
+static bool isDead(Instruction *Inst) {
+  if (!Inst->use_empty())
+    return false;
+  if (isInstructionTriviallyDead(Inst))
+    return true;
+  if (GenXIntrinsic::getGenXIntrinsicID(Inst) ==
+      GenXIntrinsic::genx_simdcf_get_em)
+    return true;
+  return GenXIntrinsic::isGenXIntrinsic(Inst) &&
+         cast<CallInst>(Inst)->doesNotAccessMemory();
+}
+
+static unsigned getNumElements(Value *V) {
+  return cast<VectorType>(V->getType())->getNumElements();
+}
+
+/***********************************************************************
+ * runOnFunction : simplify mask operations until nothing changes
+ */
+bool GenXMaskSimplify::runOnFunction(Function &F)
+{
+  bool Modified = false;
+  for (bool Changed = true; Changed;) {
+    Changed = false;
+    // Instructions left unused are removed after each sweep, so that the
+    // iteration never sees an erased instruction.
+    SmallVector<WeakTrackingVH, 16> MaybeDead;
+    for (auto fi = F.begin(), fe = F.end(); fi != fe; ++fi) {
+      for (auto bi = fi->begin(), be = fi->end(); bi != be; ++bi) {
+        Instruction *Inst = &*bi;
+        if (Inst->use_empty()) {
+          if (GenXIntrinsic::getGenXIntrinsicID(Inst) ==
+              GenXIntrinsic::genx_simdcf_get_em)
+            MaybeDead.push_back(Inst);
+          continue;
+        }
+        Value *V = simplify(Inst);
+        if (!V)
+          continue;
+        LLVM_DEBUG(dbgs() << "simplified " << *Inst << "\n  to " << *V
+                          << "\n");
+        Inst->replaceAllUsesWith(V);
+        if (isa<Instruction>(V) && !V->hasName())
+          V->takeName(Inst);
+        MaybeDead.push_back(Inst);
+        ++NumMaskOpsSimplified;
+        Changed = true;
+      }
+    }
+    while (!MaybeDead.empty()) {
+      auto Inst = dyn_cast_or_null<Instruction>(MaybeDead.pop_back_val());
+      if (!Inst || !isDead(Inst))
+        continue;
+      for (Use &U : Inst->operands())
+        if (isa<Instruction>(U.get()))
+          MaybeDead.push_back(U.get());
+      Inst->eraseFromParent();
+      Changed = true;
+    }
+    Modified |= Changed;
+  }
+  return Modified;
+}
+
+/***********************************************************************
+ * simplify : simplify one instruction
+ *
+ * Return:  value to replace the instruction with, or nullptr if none
+ *
+ * New instructions needed for the replacement are inserted before Inst.
+ */
+Value *GenXMaskSimplify::simplify(Instruction *Inst)
+{
+  if (auto BO = dyn_cast<BinaryOperator>(Inst))
+    return simplifyBinaryOp(BO);
+  auto CI = dyn_cast<CallInst>(Inst);
+  if (!CI)
+    return nullptr;
+  switch (GenXIntrinsic::getGenXIntrinsicID(CI)) {
+  case GenXIntrinsic::genx_any:
+    return simplifyAnyAll(CI, /*IsAll=*/false);
+  case GenXIntrinsic::genx_all:
+    return simplifyAnyAll(CI, /*IsAll=*/true);
+  case GenXIntrinsic::genx_rdpredregion:
+    return simplifyRdPredRegion(CI);
+  case GenXIntrinsic::genx_wrpredregion:
+    return simplifyWrPredRegion(CI);
+  case GenXIntrinsic::genx_wrpredpredregion:
+    return simplifyWrPredPredRegion(CI);
+  case GenXIntrinsic::genx_simdcf_get_em:
+    if (isa<Constant>(CI->getArgOperand(0)))
+      return CI->getArgOperand(0);
+    break;
+  default:
+    break;
+  }
+  return nullptr;
+}
+
+/***********************************************************************
+ * simplifyAnyAll : simplify genx.any or genx.all
+ *
+ * any(C) and all(C) fold to a constant. any(~x) is ~all(x), and all(~x)
+ * is ~any(x); that is done only if nothing else uses ~x, so the vector
+ * negation is replaced by a scalar one.
+ */
+Value *GenXMaskSimplify::simplifyAnyAll(CallInst *CI, bool IsAll)
+{
+  Value *In = CI->getArgOperand(0);
+  if (auto C = dyn_cast<Constant>(In)) {
+    SmallVector<bool, 32> Elts;
+    if (!getMaskElements(C, Elts))
+      return nullptr;
+    bool Res = IsAll;
+    for (bool Elt : Elts)
+      if (Elt != IsAll)
+        Res = !IsAll;
+    return ConstantInt::get(CI->getType(), Res);
+  }
+  Value *Negated = getNegated(In);
+  if (!Negated || !In->hasOneUse())
+    return nullptr;
+  auto Decl = GenXIntrinsic::getGenXDeclaration(CI->getModule(),
+      IsAll ? GenXIntrinsic::genx_any : GenXIntrinsic::genx_all,
+      Negated->getType());
+  auto NewCI = CallInst::Create(Decl, Negated, CI->getName() + ".inv", CI);
+  NewCI->setDebugLoc(CI->getDebugLoc());
+  auto Not = BinaryOperator::CreateNot(NewCI, "", CI);
+  Not->setDebugLoc(CI->getDebugLoc());
+  return Not;
+}
+
+// createRdPredRegion : create a genx.rdpredregion like CI from another input
+static Value *createRdPredRegion(Value *In, int64_t Offset, CallInst *CI) {
+  Value *Args[] = { In,
+                    ConstantInt::get(CI->getArgOperand(1)->getType(), Offset) };
+  Type *Tys[] = { CI->getType(), In->getType() };
+  auto Decl = GenXIntrinsic::getGenXDeclaration(CI->getModule(),
+      GenXIntrinsic::genx_rdpredregion, Tys);
+  auto NewCI = CallInst::Create(Decl, Args, "", CI);
+  NewCI->setDebugLoc(CI->getDebugLoc());
+  return NewCI;
+}
+
+/***********************************************************************
+ * simplifyRdPredRegion : simplify genx.rdpredregion
+ */
+Value *GenXMaskSimplify::simplifyRdPredRegion(CallInst *CI)
+{
+  Value *In = CI->getArgOperand(0);
+  int64_t Offset = getConstantOffset(CI->getArgOperand(1));
+  if (Offset < 0)
+    return nullptr;
+  unsigned Width = getNumElements(CI);
+  // Reading the whole value.
+  if (Offset == 0 && Width == getNumElements(In))
+    return In;
+  if (auto C = dyn_cast<Constant>(In)) {
+    SmallVector<bool, 32> Elts;
+    if (!getMaskElements(C, Elts) || (uint64_t)Offset + Width > Elts.size())
+      return nullptr;
+    return getMaskConstant(CI->getContext(),
+                           makeArrayRef(Elts).slice(Offset, Width));
+  }
+  auto InCI = dyn_cast<CallInst>(In);
+  if (!InCI)
+    return nullptr;
+  switch (GenXIntrinsic::getGenXIntrinsicID(InCI)) {
+  case GenXIntrinsic::genx_rdpredregion: {
+    // Read the region of the region directly.
+    int64_t InOffset = getConstantOffset(InCI->getArgOperand(1));
+    if (InOffset < 0)
+      return nullptr;
+    return createRdPredRegion(InCI->getArgOperand(0), InOffset + Offset, CI);
+  }
+  case GenXIntrinsic::genx_wrpredregion: {
+    Value *NewVal = InCI->getArgOperand(1);
+    int64_t WrOffset = getConstantOffset(InCI->getArgOperand(2));
+    if (WrOffset < 0)
+      return nullptr;
+    unsigned WrWidth = getNumElements(NewVal);
+    // Reading back exactly what was written.
+    if (WrOffset == Offset && WrWidth == Width)
+      return NewVal;
+    // Reading a region that the write does not touch.
+    if ((uint64_t)WrOffset + WrWidth <= (uint64_t)Offset ||
+        (uint64_t)Offset + Width <= (uint64_t)WrOffset)
+      return createRdPredRegion(InCI->getArgOperand(0), Offset, CI);
+    break;
+  }
+  default:
+    break;
+  }
+  return nullptr;
+}
+
+/***********************************************************************
+ * simplifyWrPredRegion : simplify genx.wrpredregion
+ */
+Value *GenXMaskSimplify::simplifyWrPredRegion(CallInst *CI)
+{
+  Value *OldVal = CI->getArgOperand(0);
+  Value *NewVal = CI->getArgOperand(1);
+  int64_t Offset = getConstantOffset(CI->getArgOperand(2));
+  if (Offset < 0)
+    return nullptr;
+  // Writing the whole value.
+  if (Offset == 0 && getNumElements(NewVal) == getNumElements(OldVal))
+    return NewVal;
+  // Writing back what was read from the same region.
+  if (GenXIntrinsic::getGenXIntrinsicID(NewVal) ==
+          GenXIntrinsic::genx_rdpredregion &&
+      cast<CallInst>(NewVal)->getArgOperand(0) == OldVal &&
+      getConstantOffset(cast<CallInst>(NewVal)->getArgOperand(1)) == Offset)
+    return OldVal;
+  // Writing a constant into a constant.
+  auto OldC = dyn_cast<Constant>(OldVal);
+  auto NewC = dyn_cast<Constant>(NewVal);
+  SmallVector<bool, 32> OldElts, NewElts;
+  if (!OldC || !NewC || !getMaskElements(OldC, OldElts) ||
+      !getMaskElements(NewC, NewElts) ||
+      (uint64_t)Offset + NewElts.size() > OldElts.size())
+    return nullptr;
+  std::copy(NewElts.begin(), NewElts.end(), OldElts.begin() + Offset);
+  return getMaskConstant(CI->getContext(), OldElts);
+}
+
+/***********************************************************************
+ * simplifyWrPredPredRegion : simplify genx.wrpredpredregion
+ *
+ * The offset indexes the predicate as well as the old value, so only the
+ * region of the predicate matters. If that is all false, nothing is
+ * written; if it is all true, this is an unpredicated genx.wrpredregion.
+ */
+Value *GenXMaskSimplify::simplifyWrPredPredRegion(CallInst *CI)
+{
+  auto Pred = dyn_cast<Constant>(CI->getArgOperand(3));
+  int64_t Offset = getConstantOffset(CI->getArgOperand(2));
+  SmallVector<bool, 32> PredElts;
+  if (!Pred || Offset < 0 || !getMaskElements(Pred, PredElts))
+    return nullptr;
+  unsigned Width = getNumElements(CI->getArgOperand(1));
+  if ((uint64_t)Offset + Width > PredElts.size())
+    return nullptr;
+  auto Region = makeArrayRef(PredElts).slice(Offset, Width);
+  if (std::none_of(Region.begin(), Region.end(), [](bool B) { return B; }))
+    return CI->getArgOperand(0);
+  if (!std::all_of(Region.begin(), Region.end(), [](bool B) { return B; }))
+    return nullptr;
+  Value *Args[] = { CI->getArgOperand(0), CI->getArgOperand(1),
+                    CI->getArgOperand(2) };
+  Type *Tys[] = { CI->getType(), Args[1]->getType() };
+  auto Decl = GenXIntrinsic::getGenXDeclaration(CI->getModule(),
+      GenXIntrinsic::genx_wrpredregion, Tys);
+  auto NewCI = CallInst::Create(Decl, Args, "", CI);
+  NewCI->setDebugLoc(CI->getDebugLoc());
+  return NewCI;
+}
+
+/***********************************************************************
+ * simplifyBinaryOp : simplify and, or or xor of masks
+ */
+Value *GenXMaskSimplify::simplifyBinaryOp(BinaryOperator *BO)
+{
+  if (!isMask(BO->getType()))
+    return nullptr;
+  unsigned Opcode = BO->getOpcode();
+  if (Opcode != Instruction::And && Opcode != Instruction::Or &&
+      Opcode != Instruction::Xor)
+    return nullptr;
+  Value *LHS = BO->getOperand(0);
+  Value *RHS = BO->getOperand(1);
+  if (isa<Constant>(LHS))
+    std::swap(LHS, RHS);
+  auto C = dyn_cast<Constant>(RHS);
+  if (C && isa<Constant>(LHS))
+    return ConstantFoldBinaryOpOperands(Opcode, cast<Constant>(LHS), C,
+        BO->getModule()->getDataLayout());
+  Constant *Zero = Constant::getNullValue(BO->getType());
+  Constant *Ones = Constant::getAllOnesValue(BO->getType());
+  bool Complement = getNegated(LHS) == RHS || getNegated(RHS) == LHS;
+  switch (Opcode) {
+  case Instruction::And:
+    if (C && C->isNullValue())
+      return Zero;
+    if ((C && C->isAllOnesValue()) || LHS == RHS)
+      return LHS;
+    if (Complement)
+      return Zero;
+    break;
+  case Instruction::Or:
+    if (C && C->isAllOnesValue())
+      return Ones;
+    if ((C && C->isNullValue()) || LHS == RHS)
+      return LHS;
+    if (Complement)
+      return Ones;
+    break;
+  case Instruction::Xor:
+    if (C && C->isNullValue())
+      return LHS;
+    if (LHS == RHS)
+      return Zero;
+    if (Complement)
+      return Ones;
+    if (!C || !C->isAllOnesValue())
+      break;
+    // Negation of a negation.
+    if (Value *Negated = getNegated(LHS))
+      return Negated;
+    // Negation of a compare with no other use: invert the compare.
+    if (auto Cmp = dyn_cast<CmpInst>(LHS)) {
+      if (!Cmp->hasOneUse())
+        break;
+      auto NewCmp = CmpInst::Create(Cmp->getOpcode(),
+          Cmp->getInversePredicate(), Cmp->getOperand(0), Cmp->getOperand(1),
+          "", Cmp);
+      NewCmp->setDebugLoc(Cmp->getDebugLoc());
+      return NewCmp;
+    }
+    break;
+  default:
+    break;
+  }
+  return nullptr;
+}
@@ -69,7 +69,8 @@
 /// The algorithm that this pass uses allows more general semantics than is
 /// currently defined to work in the CM language. The SIMD control flow can be
 /// arbitrarily unstructured, and it can be mixed with scalar control flow in
-/// an arbitrarily unstructured way. It also allows up to 32 channels.
+/// an arbitrarily unstructured way. It also allows up to 32 channels, or 64
+/// with -cmsimdcf-max-width=64.
 ///
 /// Algorithm
 /// ^^^^^^^^^
@@ -85,6 +86,12 @@
 ///    post-dominance tree from l to n except l itself are control dependent on
 ///    m.
 ///
+///    For a SIMD branch in structured code (a single-entry single-exit
+///    region laid out in order, or the latch of a single-latch loop), the
+///    control dependent blocks are found by a sweep through the blocks in
+///    layout order instead, without building the post-dominance tree. See
+///    StructuredSimdCF.
+///
 ///    This step also issues an error if any block is found to be control
 ///    dependent on multiple SIMD branches that have different SIMD widths.
 ///
@@ -143,9 +150,10 @@
 ///       predicate, which acts as the *call mask*.
 ///
 ///    e. There is a single 32 bit EM (execution mask) global variable created
-///       for the whole function, statically initialized to all ones. In
+///       for the whole function, statically initialized to all ones. (It is 64
+///       bit with -cmsimdcf-max-width=64.) In
 ///       implementing predication in the items above, the EM value is loaded from
-///       the variable. If a narrower-than-32-bit EM value is required, it is
+///       the variable. If a narrower EM value is required, it is
 ///       sliced using a ``shufflevector``.
 /// 
 ///       Like any other global variable, the EM global variable is transformed by
@@ -168,15 +176,30 @@
 #define DEBUG_TYPE "cmsimdcflowering"
 
 #include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallSet.h"
+#include "llvm/ADT/SparseBitVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Analysis/Loads.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
 #include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/GenXIntrinsics/GenXControlDependence.h"
 #include "llvm/GenXIntrinsics/GenXIntrinsics.h"
 #include "llvm/GenXIntrinsics/GenXMetadata.h"
 #include "llvm/GenXIntrinsics/GenXIntrOpts.h"
 #include "llvm/GenXIntrinsics/GenXSimdCFLowering.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DebugInfo.h"
 #include "llvm/IR/DiagnosticInfo.h"
 #include "llvm/IR/DiagnosticPrinter.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/IRBuilder.h"
@@ -184,8 +207,16 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/ValueHandle.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/LineIterator.h"
 #include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
 #include <algorithm>
 #include <set>
 
@@ -199,9 +230,119 @@
 
 using namespace llvm;
 
-namespace llvm {
-void initializeCMSimdCFLoweringPass(PassRegistry &);
-}
+STATISTIC(NumSimdBranches, "Number of simd branches found");
+STATISTIC(NumPredicatedBlocks, "Number of basic blocks predicated");
+STATISTIC(NumUnsimdedBranches,
+          "Number of simd branches converted back to scalar branches");
+STATISTIC(NumJoinsWithJIP, "Number of joins with a JIP");
+STATISTIC(NumJoinsWithoutJIP, "Number of joins without a JIP");
+STATISTIC(NumJoinJIPsRemoved,
+          "Number of join JIPs removed by the region analysis");
+STATISTIC(NumStoresPredicatedByWrRegion,
+          "Number of stores predicated by predicating a wrregion");
+STATISTIC(NumStoresPredicatedBySelect,
+          "Number of stores predicated by load, select, store");
+STATISTIC(NumStoresPredicatedByMask,
+          "Number of predicated stores changed to a masked store");
+STATISTIC(NumEMLoads, "Number of execution mask loads for predication");
+STATISTIC(NumEMReuses,
+          "Number of predications that reused an execution mask value");
+STATISTIC(NumEMShuffles,
+          "Number of execution mask slices for predication");
+STATISTIC(NumRMAllocas, "Number of resume mask variables created");
+STATISTIC(NumRMAllocasShared,
+          "Number of resume mask variables removed by sharing");
+STATISTIC(NumUnmaskPairs, "Number of unmask begin/end pairs lowered");
+STATISTIC(NumPredicatedSubroutines, "Number of predicated subroutines");
+STATISTIC(NumFullMaskClones,
+          "Number of unpredicated clones of predicated subroutines");
+STATISTIC(NumAllOnesSkipped,
+          "Number of predications skipped because EM is all ones");
+STATISTIC(NumInversionsFolded,
+          "Number of goto conditions that folded an inverted simd condition");
+STATISTIC(NumIfConverted,
+          "Number of simd branches flattened into predicated code");
+STATISTIC(NumUniformBranches,
+          "Number of simd branches on a uniform condition kept scalar");
+
+static cl::opt<unsigned> SimdCFAnalysisThreads(
+    "cmsimdcf-analysis-threads", cl::init(0), cl::Hidden,
+    cl::desc("Number of threads for the SIMD CF analysis phase "
+             "(0 = hardware concurrency, 1 = serial)"));
+
+static cl::opt<bool> SSAMasks(
+    "cmsimdcf-ssa-masks", cl::init(false), cl::Hidden,
+    cl::desc("Keep EM and RM in SSA values within each function, only "
+             "going through the EM global at calls and returns"));
+
+static cl::opt<unsigned> SimdCFMaxWidth(
+    "cmsimdcf-max-width",
+    cl::init(unsigned(CMSimdCFLower::MAX_SIMD_CF_WIDTH)), cl::Hidden,
+    cl::desc("Width of the execution mask, the widest SIMD CF allowed "
+             "(32 or 64; unmask needs 32)"));
+
+static cl::opt<unsigned> CloneBudget(
+    "cmsimdcf-clone-budget", cl::init(0), cl::Hidden,
+    cl::desc("Number of instructions that may be cloned to give calls with "
+             "all channels enabled an unpredicated copy of a predicated "
+             "subroutine (0 = no cloning)"));
+
+static cl::opt<bool> MaskedStores(
+    "cmsimdcf-masked-stores", cl::init(false), cl::Hidden,
+    cl::desc("Predicate a store to an alloca, or a vstore, with a masked "
+             "store instead of a load, select and store"));
+
+static cl::opt<bool> UniformBranches(
+    "cmsimdcf-uniform-branches", cl::init(true), cl::Hidden,
+    cl::desc("Keep simd branches whose condition is the same in every "
+             "channel as scalar branches"));
+
+static cl::opt<bool> PreciseJoinJIPs(
+    "cmsimdcf-precise-join-jips", cl::init(true), cl::Hidden,
+    cl::desc("Remove the JIP from a join that ends a single entry region, "
+             "where it is always reached with a channel enabled"));
+
+static cl::opt<std::string> ISPCFunction(
+    "ispcsimdcf-function", cl::init(""), cl::Hidden,
+    cl::desc("Lower ISPC SIMD control flow only in this function and the "
+             "subroutines it makes predicated"));
+
+static cl::opt<bool> LayoutSimdCF(
+    "cmsimdcf-layout", cl::init(false), cl::Hidden,
+    cl::desc("Reorder the blocks of a function with SIMD CF so that false "
+             "legs fall through and join points follow their regions"));
+
+static cl::opt<std::string> SimdCFProfile(
+    "cmsimdcf-profile", cl::init(""), cl::Hidden,
+    cl::desc("Divergence profile of the simd branches, with a line "
+             "\"file:line:column all-true all-false divergent\" of execution "
+             "counts per branch. Giving one turns on -cmsimdcf-layout"));
+
+static cl::opt<unsigned> RarelyDivergentPercent(
+    "cmsimdcf-rarely-divergent", cl::init(10), cl::Hidden,
+    cl::desc("Percentage of its executions below which a profiled simd "
+             "branch diverges rarely enough to be laid out for one leg"));
+
+static cl::opt<unsigned> OftenDivergentPercent(
+    "cmsimdcf-often-divergent", cl::init(50), cl::Hidden,
+    cl::desc("Percentage of its executions from which a profiled simd "
+             "branch diverges often enough to be flattened at up to twice "
+             "-cmsimdcf-ifconvert-threshold"));
+
+static cl::opt<unsigned> IfConvertThreshold(
+    "cmsimdcf-ifconvert-threshold", cl::init(0), cl::Hidden,
+    cl::desc("Flatten a simd if or if/else region into predicated code if "
+             "it costs at most this many instructions (0 to disable)"));
+
+static cl::opt<bool> ShareRMs(
+    "cmsimdcf-share-rm", cl::init(true), cl::Hidden,
+    cl::desc("Let join points whose resume masks do not interfere share "
+             "one resume mask variable"));
+
+static cl::opt<bool> EnableStructuredSimdCF(
+    "cmsimdcf-structured", cl::init(true), cl::Hidden,
+    cl::desc("Find blocks controlled by structured SIMD branches without "
+             "building the post-dominator tree"));
 
 namespace {
 
@@ -239,6 +380,45 @@ public:
   }
 };
 
+// StructuredSimdCF : utility class to find the blocks control dependent on
+// a simd branch in structured code without using the post-dominator tree.
+//
+// Blocks are numbered in layout order. For a forward simd branch at M, we
+// sweep forwards from M through the blocks reachable from M, which must only
+// have forward edges. A reachable block P such that no edge from a reachable
+// block in [M,P) jumps past it post-dominates M, and the first such block X
+// after M is M's immediate post-dominator. Then for each
+// successor N of M, the blocks control dependent on M through the edge M->N
+// are the blocks in [N,X) found by the same sweep from N. These are the
+// blocks on the post-dominator tree path from N up to X, in the same order.
+//
+// For a backward simd branch at M (the latch of a do..while loop with header
+// H), the loop body [H,M] must only have forward edges that stay inside it,
+// other than the back edge itself. Then the exit successor post-dominates M,
+// and the blocks control dependent on M through the back edge are the blocks
+// in [H,M] that every path from H through the body passes.
+//
+// Anything else (including code that does not reach the function exit, where
+// the post-dominator tree has extra roots) is left to the general algorithm.
+class StructuredSimdCF {
+  std::vector<BasicBlock *> Blocks;
+  DenseMap<BasicBlock *, unsigned> Numbers;
+  // Blocks that can reach a block with no successors, computed on demand.
+  std::vector<bool> ReachesExit;
+  static const unsigned NoEnd = ~0U;
+public:
+  StructuredSimdCF(Function *F) {
+    for (auto fi = F->begin(), fe = F->end(); fi != fe; ++fi) {
+      Numbers[&*fi] = Blocks.size();
+      Blocks.push_back(&*fi);
+    }
+  }
+  bool getControlDependents(BranchInst *Br, SmallVectorImpl<BasicBlock *> *Deps);
+private:
+  bool reachesExit(unsigned Num);
+  bool sweep(unsigned Start, unsigned End, SmallVectorImpl<unsigned> *Cuts);
+};
+
 // Diagnostic information for error/warning relating to SIMD control flow.
 class DiagnosticInfoSimdCF : public DiagnosticInfoOptimizationBase {
 private:
@@ -265,22 +445,46 @@ int DiagnosticInfoSimdCF::KindID = 0;
 
 // Call graph node
 struct CGNode {
-  Function *F;
-  std::set<CGNode *> UnvisitedCallers;
-  std::set<CGNode *> Callees;
+  // The function, or nullptr for the root and the indirect call node.
+  Function *F = nullptr;
+  // Length of the longest call chain from a root to this function.
+  unsigned Level = 0;
+  // Index of the SCC containing the node, in visit order.
+  unsigned SCC = 0;
+  SmallVector<CGNode *, 4> Callees;
 };
 
+} // namespace
+
+namespace llvm {
+template <> struct GraphTraits<CGNode *> {
+  using NodeRef = CGNode *;
+  using ChildIteratorType = SmallVectorImpl<CGNode *>::iterator;
+  static NodeRef getEntryNode(CGNode *N) { return N; }
+  static ChildIteratorType child_begin(NodeRef N) { return N->Callees.begin(); }
+  static ChildIteratorType child_end(NodeRef N) { return N->Callees.end(); }
+};
+} // namespace llvm
+
+namespace {
+
 // The ISPC SIMD CF lowering pass (a module pass)
 class ISPCSimdCFLowering : public ModulePass {
+  // If set, only this function and the subroutines it makes predicated are
+  // lowered.
+  std::string FunctionName;
 public:
   static char ID;
 
-  ISPCSimdCFLowering() : ModulePass(ID) {}
+  ISPCSimdCFLowering(StringRef FunctionName = "")
+      : ModulePass(ID), FunctionName(FunctionName) {}
   void getAnalysisUsage(AnalysisUsage &AU) const {
     ModulePass::getAnalysisUsage(AU);
   }
 
   bool runOnModule(Module &M);
+private:
+  bool lowerFunction(Function *F);
 };
 
 // The CM SIMD CF lowering pass (a function pass)
@@ -298,7 +502,9 @@ public:
   virtual bool doInitialization(Module &M);
   virtual bool runOnFunction(Function &F) { return false; }
 private:
-  void calculateVisitOrder(Module *M, std::vector<Function *> *VisitOrder);
+  void calculateVisitOrder(Module *M, std::vector<Function *> *VisitOrder,
+                           std::vector<unsigned> *Levels,
+                           std::vector<std::vector<Function *>> *RecursiveSCCs);
 };
 
 } // namespace
@@ -310,9 +516,6 @@ INITIALIZE_PASS_END(CMSimdCFLowering, "cmsimdcflowering", "Lower CM SIMD control
 Pass *llvm::createCMSimdCFLoweringPass() { return new CMSimdCFLowering(); }
 
 char ISPCSimdCFLowering::ID = 0;
-namespace llvm {
-void initializeISPCSimdCFLoweringPass(PassRegistry&);
-}
 INITIALIZE_PASS_BEGIN(ISPCSimdCFLowering, "ispcsimdcflowering", "Lower ISPC SIMD control flow", false, false)
 INITIALIZE_PASS_END(ISPCSimdCFLowering, "ispcsimdcflowering", "Lower ISPC SIMD control flow", false, false)
 
@@ -321,8 +524,202 @@ Pass *llvm::createISPCSimdCFLoweringPass() {
     return new ISPCSimdCFLowering();
 }
 
+Pass *llvm::createISPCSimdCFLoweringPass(const std::string &FunctionName) {
+    initializeISPCSimdCFLoweringPass(*PassRegistry::getPassRegistry());
+    return new ISPCSimdCFLowering(FunctionName);
+}
+
 bool ISPCSimdCFLowering::runOnModule(Module &M) {
-    return CMSimdCFLowering().doInitialization(M);
+    StringRef Name = FunctionName.empty() ? StringRef(ISPCFunction)
+                                          : StringRef(FunctionName);
+    if (Name.empty())
+      return CMSimdCFLowering().doInitialization(M);
+    Function *F = M.getFunction(Name);
+    if (!F || F->empty())
+      return false;
+    return lowerFunction(F);
+}
+
+/***********************************************************************
+ * getEMWidth : get the width of the EM variable from -cmsimdcf-max-width
+ */
+static unsigned getEMWidth()
+{
+  unsigned MaxWidth = SimdCFMaxWidth;
+  if (MaxWidth < CMSimdCFLower::MAX_SIMD_CF_WIDTH ||
+      MaxWidth > CMSimdCFLower::MAX_SIMD_CF_WIDTH_LIMIT ||
+      !isPowerOf2_32(MaxWidth))
+    report_fatal_error("CMSimdCFLowering: unsupported -cmsimdcf-max-width");
+  return MaxWidth;
+}
+
+/***********************************************************************
+ * createEMVar : create the global variable for the execution mask
+ *
+ * The variable is marked with genx.simdcf.em metadata, so that a later
+ * per-function lowering can find it without relying on its name.
+ */
+static GlobalVariable *createEMVar(Module &M, unsigned MaxWidth)
+{
+  auto EMTy = VCINTR::getVectorType(Type::getInt1Ty(M.getContext()),
+                                    MaxWidth);
+  auto EMVar = new GlobalVariable(M, EMTy, false/*isConstant*/,
+      GlobalValue::InternalLinkage, Constant::getAllOnesValue(EMTy), "EM");
+  EMVar->setMetadata(genx::FunctionMD::GenXSimdCFEM,
+                     MDNode::get(M.getContext(), {}));
+  return EMVar;
+}
+
+/***********************************************************************
+ * findEMVar : find the execution mask variable left by an earlier lowering
+ *
+ * Return:  the variable marked with genx.simdcf.em metadata, or nullptr
+ */
+static GlobalVariable *findEMVar(Module &M)
+{
+  for (auto &GV : M.globals())
+    if (GV.getMetadata(genx::FunctionMD::GenXSimdCFEM))
+      return &GV;
+  return nullptr;
+}
+
+/***********************************************************************
+ * getLoweredCallMaskWidth : get the call mask width that a subroutine was
+ *    lowered with by an earlier per-function lowering
+ *
+ * Return:  the width from the genx.simdcf.callmask metadata, or 0 if the
+ *          function was not lowered as a predicated subroutine
+ */
+static unsigned getLoweredCallMaskWidth(Function *F)
+{
+  MDNode *MD = F->getMetadata(genx::FunctionMD::GenXSimdCFCallMask);
+  if (!MD || MD->getNumOperands() != 1)
+    return 0;
+  return mdconst::extract<ConstantInt>(MD->getOperand(0))->getZExtValue();
+}
+
+/***********************************************************************
+ * lowerFunction : lower the SIMD CF in one function, for a JIT that
+ *    recompiles a function at a time
+ *
+ * Enter:   F = the function to lower
+ *
+ * Return:  whether anything was changed
+ *
+ * This does not do the module wide work of the whole module lowering: the
+ * volatile globals are not scanned, and the only other functions processed
+ * are the subroutines that F makes predicated, directly or through other
+ * such subroutines. An EM variable left by an earlier run is reused, and a
+ * function that already uses it has been lowered, so is left alone.
+ *
+ * A subroutine lowered as predicated records its call mask width in
+ * genx.simdcf.callmask metadata. A subroutine lowered by an earlier run
+ * cannot be lowered again, so a predicated call to one that was lowered
+ * with a different call mask, or none, is diagnosed.
+ */
+bool ISPCSimdCFLowering::lowerFunction(Function *F)
+{
+  bool HasSimdCF = false;
+  for (auto &Inst : instructions(F))
+    if (CMSimdCFLower::isSimdCFAny(&Inst)) {
+      HasSimdCF = true;
+      break;
+    }
+  if (!HasSimdCF)
+    return false;
+  Module &M = *F->getParent();
+  GlobalVariable *EMVar = findEMVar(M);
+  if (EMVar && (!EMVar->hasInternalLinkage() ||
+                !EMVar->getValueType()->isVectorTy() ||
+                !EMVar->getValueType()->getScalarType()->isIntegerTy(1)))
+    report_fatal_error("CMSimdCFLowering: EM is not an execution mask");
+  // The functions that use EM have been lowered already.
+  SmallPtrSet<Function *, 8> Lowered;
+  if (EMVar) {
+    for (auto *U : EMVar->users())
+      if (auto Inst = dyn_cast<Instruction>(U))
+        Lowered.insert(Inst->getFunction());
+    if (Lowered.count(F))
+      return false;
+  } else
+    EMVar = createEMVar(M, getEMWidth());
+  // Order F and the functions it may call so that each comes before its
+  // callees, by reverse post order of a depth first walk from F. Only a
+  // recursive call can go back, and that is not predicated anyway.
+  std::vector<Function *> Order;
+  SmallPtrSet<Function *, 8> Seen;
+  SmallVector<std::pair<Function *, inst_iterator>, 8> Stack;
+  Seen.insert(F);
+  Stack.push_back(std::make_pair(F, inst_begin(F)));
+  while (!Stack.empty()) {
+    Function *Fn = Stack.back().first;
+    inst_iterator &It = Stack.back().second;
+    Function *Callee = nullptr;
+    for (; It != inst_end(Fn) && !Callee; ++It) {
+      auto CI = dyn_cast<CallInst>(&*It);
+      if (!CI)
+        continue;
+      Function *Called = CI->getCalledFunction();
+      if (Called && !Called->empty() && !Lowered.count(Called) &&
+          Seen.insert(Called).second)
+        Callee = Called;
+    }
+    if (Callee) {
+      Stack.push_back(std::make_pair(Callee, inst_begin(Callee)));
+      continue;
+    }
+    Order.push_back(Fn);
+    Stack.pop_back();
+  }
+  std::reverse(Order.begin(), Order.end());
+  // Lower F, then each callee that has been made predicated by the time all
+  // its callers in the walk have been done.
+  CMSimdCFLower CFL(EMVar);
+  if (!SimdCFProfile.empty())
+    CFL.loadProfile(SimdCFProfile);
+  SmallVector<Function *, 8> Processed;
+  for (Function *Fn : Order) {
+    unsigned CMWidth = CFL.getCallMaskWidth(Fn);
+    if (Fn != F && !CMWidth)
+      continue;
+    if (Fn->hasFnAttribute("CMGenxNoSIMDPred"))
+      continue;
+    CFL.processFunction(Fn);
+    Processed.push_back(Fn);
+    if (CMWidth) {
+      LLVMContext &Ctx = M.getContext();
+      Fn->setMetadata(genx::FunctionMD::GenXSimdCFCallMask,
+          MDNode::get(Ctx, ConstantAsMetadata::get(ConstantInt::get(
+                               Type::getInt32Ty(Ctx), CMWidth))));
+    }
+  }
+  for (Function *Callee : Lowered) {
+    unsigned CMWidth = CFL.getCallMaskWidth(Callee);
+    if (!CMWidth || CMWidth == getLoweredCallMaskWidth(Callee))
+      continue;
+    for (auto *U : Callee->users()) {
+      auto CI = dyn_cast<CallInst>(U);
+      if (CI && is_contained(Processed, CI->getFunction())) {
+        DiagnosticInfoSimdCF::emit(CI,
+            "subroutine called under SIMD control flow was already lowered "
+            "without this call mask");
+        break;
+      }
+    }
+  }
+  // Any predication calls which remain in those functions are not in SIMD CF
+  // regions, so can be deleted.
+  for (Function *Fn : Processed) {
+    for (auto ii = inst_begin(Fn), ie = inst_end(Fn); ii != ie;) {
+      auto CI = dyn_cast<CallInst>(&*ii++);
+      if (!CI || GenXIntrinsic::getGenXIntrinsicID(CI) !=
+                     GenXIntrinsic::genx_simdcf_predicate)
+        continue;
+      CI->replaceAllUsesWith(CI->getArgOperand(0));
+      CI->eraseFromParent();
+    }
+  }
+  return true;
 }
 
 /***********************************************************************
@@ -417,10 +814,12 @@ bool CMSimdCFLowering::doInitialization(Module &M)
     }
   }
 
+  unsigned MaxWidth = getEMWidth();
+
   // See if simd CF is used anywhere in this module.
   // We have to try each overload of llvm.genx.simdcf.any separately.
   bool HasSimdCF = false;
-  for (unsigned Width = 2; Width <= CMSimdCFLower::MAX_SIMD_CF_WIDTH; Width <<= 1) {
+  for (unsigned Width = 2; Width <= MaxWidth; Width <<= 1) {
     auto VT = VCINTR::getVectorType(Type::getInt1Ty(M.getContext()), Width);
     Function *SimdCFAny = GenXIntrinsic::getGenXDeclaration(
         &M, GenXIntrinsic::genx_simdcf_any, VT);
@@ -432,21 +831,88 @@ bool CMSimdCFLowering::doInitialization(Module &M)
 
   if (HasSimdCF) {
     // Create the global variable for the execution mask.
-    auto EMTy = VCINTR::getVectorType(Type::getInt1Ty(M.getContext()),
-      CMSimdCFLower::MAX_SIMD_CF_WIDTH);
-    auto EMVar = new GlobalVariable(M, EMTy, false/*isConstant*/,
-        GlobalValue::InternalLinkage, Constant::getAllOnesValue(EMTy), "EM");
+    auto EMVar = createEMVar(M, MaxWidth);
     // Derive an order to process functions such that a function is visited
-    // after anything that calls it.
+    // after anything that calls it. The order is grouped into call graph
+    // levels; no function calls another function in the same level.
     std::vector<Function *> VisitOrder;
-    calculateVisitOrder(&M, &VisitOrder);
-    // Process functions in that order.
+    std::vector<unsigned> Levels;
+    std::vector<std::vector<Function *>> RecursiveSCCs;
+    calculateVisitOrder(&M, &VisitOrder, &Levels, &RecursiveSCCs);
+    DenseMap<Function *, unsigned> SCCOf;
+    for (unsigned i = 0; i != RecursiveSCCs.size(); ++i)
+      for (Function *Fn : RecursiveSCCs[i])
+        SCCOf[Fn] = i;
+    // Debug output from the analysis phase is not thread safe.
+    unsigned NumThreads = SimdCFAnalysisThreads;
+    LLVM_DEBUG(NumThreads = 1);
+    std::unique_ptr<ThreadPool> Pool;
+    // Process functions in that order, one level at a time. The call mask
+    // width of a function is only known once all its callers have been
+    // processed, which is guaranteed for the whole level once the previous
+    // levels are done. Then the analysis phase for the level can run
+    // concurrently, and the results are applied serially in visit order so
+    // that the output is the same as from a serial run.
     CMSimdCFLower CFL(EMVar);
-    for (auto i = VisitOrder.begin(), e = VisitOrder.end(); i != e; ++i) {
-      Function *Fn = *i;
-      if (Fn->hasFnAttribute("CMGenxNoSIMDPred"))
-        continue;
-      CFL.processFunction(Fn);
+    if (!SimdCFProfile.empty())
+      CFL.loadProfile(SimdCFProfile);
+    unsigned Budget = CloneBudget;
+    for (unsigned LevelBegin = 0, e = VisitOrder.size(); LevelBegin != e;) {
+      unsigned LevelEnd = LevelBegin;
+      while (LevelEnd != e && Levels[LevelEnd] == Levels[LevelBegin])
+        ++LevelEnd;
+      std::vector<CMSimdCFAnalysis> Analyses;
+      std::vector<Function *> Clones;
+      for (unsigned i = LevelBegin; i != LevelEnd; ++i) {
+        Function *Fn = VisitOrder[i];
+        // On reaching a recursive SCC, all calls into it from outside have
+        // been processed.
+        auto SCCIt = SCCOf.find(Fn);
+        if (SCCIt != SCCOf.end()) {
+          CFL.shareCallMaskWidth(RecursiveSCCs[SCCIt->second]);
+          for (Function *Member : RecursiveSCCs[SCCIt->second])
+            SCCOf.erase(Member);
+        }
+        if (Fn->hasFnAttribute("CMGenxNoSIMDPred"))
+          continue;
+        Analyses.emplace_back();
+        Analyses.back().F = Fn;
+        Analyses.back().CMWidth = CFL.getCallMaskWidth(Fn);
+        Analyses.back().MaxWidth = MaxWidth;
+        if (Analyses.back().CMWidth && Budget)
+          if (Function *Clone = CFL.cloneForFullMask(Fn, &Budget))
+            Clones.push_back(Clone);
+      }
+      // An unpredicated clone calls the same functions as the original, so
+      // it goes in the same level.
+      for (Function *Clone : Clones) {
+        Analyses.emplace_back();
+        Analyses.back().F = Clone;
+        Analyses.back().MaxWidth = MaxWidth;
+      }
+      LevelBegin = LevelEnd;
+      if (NumThreads != 1 && Analyses.size() > 1) {
+        if (!Pool) {
+#if VC_INTR_LLVM_VERSION_MAJOR >= 11
+          Pool.reset(new ThreadPool(
+              NumThreads ? hardware_concurrency(NumThreads)
+                         : hardware_concurrency()));
+#else
+          Pool.reset(NumThreads ? new ThreadPool(NumThreads)
+                                : new ThreadPool());
+#endif
+        }
+        for (auto &A : Analyses) {
+          CMSimdCFAnalysis *AP = &A;
+          Pool->async([AP] { CMSimdCFLower::analyzeFunction(AP); });
+        }
+        Pool->wait();
+      } else {
+        for (auto &A : Analyses)
+          CMSimdCFLower::analyzeFunction(&A);
+      }
+      for (auto &A : Analyses)
+        CFL.applyAnalysis(&A);
     }
   }
 
@@ -471,63 +937,317 @@ bool CMSimdCFLowering::doInitialization(Module &M)
 /***********************************************************************
  * calculateVisitOrder : calculate the order we want to visit functions,
  *    such that a function is not visited until all its callers have been
+ *
+ * Enter:   M = the module
+ *          VisitOrder = vector to fill in with the visit order
+ *          Levels = vector to fill in with the call graph level of each
+ *              function in VisitOrder
+ *          RecursiveSCCs = vector to fill in with the functions of each
+ *              SCC of more than one function
+ *
+ * The visit order is sorted by level, where the level of a function is the
+ * length of the longest call chain reaching it. A function only calls
+ * functions at a greater level.
+ *
+ * The functions of a recursive SCC (which must be CMStackCall functions) are
+ * visited as a unit: they get consecutive levels in SCC order, and anything
+ * they call outside the SCC gets a greater level than all of them.
  */
 void CMSimdCFLowering::calculateVisitOrder(Module *M,
-    std::vector<Function *> *VisitOrder)
+    std::vector<Function *> *VisitOrder, std::vector<unsigned> *Levels,
+    std::vector<std::vector<Function *>> *RecursiveSCCs)
 {
   // First build the call graph.
-  // We roll our own call graph here, because it is simpler than the general
-  // case supported by LLVM's call graph analysis (CM does not support
-  // recursion or function pointers), and we want to modify it (using the
-  // UnvisitedCallers set) when we traverse it.
-  std::map<Function *, CGNode> CallGraph;
+  // We roll our own dense call graph here, rather than using LLVM's call
+  // graph analysis, because we want all defined functions to be reachable
+  // from a single root, and indirect calls to reach the functions that may be
+  // called indirectly. Node 0 is the root, which calls every function. Node 1
+  // stands for an indirect call; it is called by every function that makes an
+  // indirect call, and calls every function that is referenced indirectly or
+  // has its address taken.
+  unsigned NumFuncs = 0;
+  for (auto mi = M->begin(), me = M->end(); mi != me; ++mi)
+    NumFuncs += !mi->empty();
+  std::vector<CGNode> Nodes(NumFuncs + 2);
+  CGNode *Root = &Nodes[0];
+  CGNode *Indirect = &Nodes[1];
+  DenseMap<Function *, CGNode *> NodeMap;
+  CGNode *CGN = Indirect;
   for (auto mi = M->begin(), me = M->end(); mi != me; ++mi) {
     Function *F = &*mi;
     if (F->empty())
       continue;
-    // For each defined function: for each use (a call), add it to our
-    // UnvisitedCallers set, and add us to its Callees set.
-    // We are ignoring an illegal non-call use of a function; someone
-    // else can spot and diagnose that later.
-    // If the function has no callers, then add it straight in to VisitOrder.
-    CGNode *CGN = &CallGraph[F];
-    CGN->F = F;
-    if (F->use_empty()) {
-      VisitOrder->push_back(F);
-      continue;
-    }
+    (++CGN)->F = F;
+    NodeMap[F] = CGN;
+    Root->Callees.push_back(CGN);
+  }
+  bool HasIndirectCallees = false;
+  for (unsigned i = 2; i != Nodes.size(); ++i) {
+    CGN = &Nodes[i];
+    Function *F = CGN->F;
+    // For each use (a call), add us to the caller's Callees. Any other use
+    // means that F may be called indirectly.
+    bool IsIndirectCallee =
+        F->hasFnAttribute(genx::FunctionMD::ReferencedIndirectly);
     for (auto ui = F->use_begin(), ue = F->use_end(); ui != ue; ++ui) {
-      if (auto I = dyn_cast<Instruction>(ui->getUser())) {
-        Function *Caller = I->getFunction();
-        // do not add a recursive call edge to the UnvisitedCallers
-        if (Caller == F) {
-          if (F->hasFnAttribute(genx::FunctionMD::CMStackCall))
-            DiagnosticInfoSimdCF::emit(I, "SIMD recursive call", DS_Warning);
-          else
-            DiagnosticInfoSimdCF::emit(
-                I, "Recursive function doesn't have CMStackCall attribute");
-        } else {
-          CGNode *CallerNode = &CallGraph[Caller];
-          CallerNode->F = Caller;
-          CGN->UnvisitedCallers.insert(CallerNode);
-          CallerNode->Callees.insert(CGN);
+      auto CI = dyn_cast<CallInst>(ui->getUser());
+      if (!CI || CI->getCalledFunction() != F) {
+        IsIndirectCallee = true;
+        continue;
+      }
+      Function *Caller = CI->getFunction();
+      // do not add a recursive call edge
+      if (Caller == F) {
+        if (F->hasFnAttribute(genx::FunctionMD::CMStackCall))
+          DiagnosticInfoSimdCF::emit(CI, "SIMD recursive call", DS_Warning);
+        else
+          DiagnosticInfoSimdCF::emit(
+              CI, "Recursive function doesn't have CMStackCall attribute");
+      } else
+        NodeMap[Caller]->Callees.push_back(CGN);
+    }
+    if (IsIndirectCallee) {
+      Indirect->Callees.push_back(CGN);
+      HasIndirectCallees = true;
+    }
+  }
+  // Only look for indirect calls if there is something they could call.
+  if (HasIndirectCallees) {
+    for (unsigned i = 2; i != Nodes.size(); ++i) {
+      CGN = &Nodes[i];
+      for (auto &Inst : instructions(CGN->F)) {
+        auto CI = dyn_cast<CallInst>(&Inst);
+        if (CI && !CI->getCalledFunction() && !CI->isInlineAsm()) {
+          CGN->Callees.push_back(Indirect);
+          break;
         }
       }
     }
   }
-  // Run through the visit order. For each function, remove it from each
-  // callee's UnvisitedCallers set, and, if now empty, add the callee to
-  // the end of the visit order.
-  for (unsigned i = 0; i != VisitOrder->size(); ++i) {
-    CGNode *CGN = &CallGraph[(*VisitOrder)[i]];
-    for (auto ci = CGN->Callees.begin(), ce = CGN->Callees.end(); ci != ce;
-         ++ci) {
-      CGNode *Callee = *ci;
-      Callee->UnvisitedCallers.erase(CGN);
-      if (Callee->UnvisitedCallers.empty())
-        VisitOrder->push_back(Callee->F);
+  // Remove duplicate edges from multiple calls. The nodes are in a single
+  // vector, so sorting by address gives a deterministic order.
+  for (auto &N : Nodes) {
+    std::sort(N.Callees.begin(), N.Callees.end());
+    N.Callees.erase(std::unique(N.Callees.begin(), N.Callees.end()),
+                    N.Callees.end());
+  }
+
+  // Get the SCCs in post order (callees first) from the root, then run
+  // through them in reverse, giving each function a level after all its
+  // callers. The root itself is the last SCC.
+  std::vector<std::vector<CGNode *>> SCCs;
+  for (auto I = scc_begin(Root); !I.isAtEnd(); ++I)
+    SCCs.push_back(*I);
+  SCCs.pop_back();
+  std::vector<CGNode *> Order;
+  for (unsigned i = SCCs.size(); i--;) {
+    auto &SCC = SCCs[i];
+    unsigned Level = 0;
+    for (CGNode *N : SCC) {
+      Level = std::max(Level, N->Level);
+      N->SCC = i;
+    }
+    // The indirect call node does not take a level of its own.
+    std::vector<Function *> Funcs;
+    for (CGNode *N : SCC) {
+      if (!N->F)
+        continue;
+      N->Level = Level++;
+      Order.push_back(N);
+      Funcs.push_back(N->F);
+    }
+    if (Funcs.size() > 1)
+      RecursiveSCCs->push_back(std::move(Funcs));
+    for (CGNode *N : SCC)
+      for (CGNode *Callee : N->Callees)
+        if (Callee->SCC != i)
+          Callee->Level = std::max(Callee->Level, Level);
+  }
+  // Diagnose calls between different functions in a recursive SCC. An SCC
+  // that is only formed through the indirect call node does not make its
+  // direct calls recursive, so find the SCCs again without that node's
+  // edges.
+  DenseMap<CGNode *, unsigned> DirectSCCs;
+  SmallVector<CGNode *, 4> IndirectCallees;
+  std::swap(IndirectCallees, Indirect->Callees);
+  unsigned NumDirectSCCs = 0;
+  for (auto I = scc_begin(Root); !I.isAtEnd(); ++I, ++NumDirectSCCs)
+    if (I->size() > 1)
+      for (CGNode *N : *I)
+        DirectSCCs[N] = NumDirectSCCs;
+  std::swap(IndirectCallees, Indirect->Callees);
+  for (unsigned i = 2; i != Nodes.size(); ++i) {
+    CGN = &Nodes[i];
+    Function *F = CGN->F;
+    auto SCCIt = DirectSCCs.find(CGN);
+    if (SCCIt == DirectSCCs.end())
+      continue;
+    for (auto ui = F->use_begin(), ue = F->use_end(); ui != ue; ++ui) {
+      auto CI = dyn_cast<CallInst>(ui->getUser());
+      if (!CI || CI->getCalledFunction() != F)
+        continue;
+      Function *Caller = CI->getFunction();
+      if (Caller == F)
+        continue;
+      auto CallerIt = DirectSCCs.find(NodeMap[Caller]);
+      if (CallerIt == DirectSCCs.end() || CallerIt->second != SCCIt->second)
+        continue;
+      if (F->hasFnAttribute(genx::FunctionMD::CMStackCall))
+        DiagnosticInfoSimdCF::emit(CI, "SIMD recursive call", DS_Warning);
+      else
+        DiagnosticInfoSimdCF::emit(
+            CI, "Recursive function doesn't have CMStackCall attribute");
+    }
+  }
+  // Group the visit order by level, in module order within a level so that
+  // the output is deterministic.
+  std::sort(Order.begin(), Order.end(), [](CGNode *N1, CGNode *N2) {
+    return N1->Level != N2->Level ? N1->Level < N2->Level : N1 < N2;
+  });
+  for (CGNode *N : Order) {
+    VisitOrder->push_back(N->F);
+    Levels->push_back(N->Level);
+  }
+}
+
+/***********************************************************************
+ * getCallMaskWidth : get the call mask width of a function
+ *
+ * Return:  the simd width of the predicated calls to F, or 0 if F is not
+ *          a predicated subroutine (as far as the functions processed so
+ *          far are concerned)
+ */
+unsigned CMSimdCFLower::getCallMaskWidth(Function *F) const
+{
+  auto It = PredicatedSubroutines.find(F);
+  return It == PredicatedSubroutines.end() ? 0 : It->second;
+}
+
+/***********************************************************************
+ * getSCCCallWidth : get the simd width of a call made under simd control
+ *    flow from one function of a recursive SCC to another
+ *
+ * Enter:   SCC = the functions of an SCC of more than one function, none of
+ *              them processed yet
+ *          MaxWidth = the width of EM
+ *
+ * Return:  the simd width of the first such call found, or 0 if there is
+ *          none
+ *
+ * This runs the read-only analysis on the functions of the SCC ahead of
+ * their lowering, to find the calls that predicateCall will see later.
+ */
+static unsigned getSCCCallWidth(ArrayRef<Function *> SCC, unsigned MaxWidth)
+{
+  SmallPtrSet<Function *, 4> Members(SCC.begin(), SCC.end());
+  for (Function *Fn : SCC) {
+    if (Fn->hasFnAttribute("CMGenxNoSIMDPred"))
+      continue;
+    CMSimdCFAnalysis A;
+    A.F = Fn;
+    A.MaxWidth = MaxWidth;
+    CMSimdCFLower::analyzeFunction(&A);
+    for (auto &PB : A.PredicatedBlocks)
+      for (auto &Inst : *PB.first)
+        if (auto CI = dyn_cast<CallInst>(&Inst)) {
+          Function *Callee = CI->getCalledFunction();
+          if (Callee && Callee != Fn && Members.count(Callee))
+            return PB.second;
+        }
+  }
+  return 0;
+}
+
+/***********************************************************************
+ * shareCallMaskWidth : give all the functions of a recursive SCC the call
+ *    mask width of a predicated call into it
+ *
+ * Enter:   SCC = the functions of an SCC of more than one function, none of
+ *              them processed yet
+ *
+ * The function of the SCC visited first is called from another function of
+ * the SCC that is visited after it, so its own predicated calls do not tell
+ * yet whether it is a predicated subroutine. Each function in the SCC can
+ * reach every other one, so a predicated call into any of them makes all of
+ * them predicated. Such a call comes either from outside the SCC, which has
+ * been processed, or from within it, which is found by analyzing the SCC up
+ * front. A mismatching width is diagnosed at the calls within the SCC.
+ */
+void CMSimdCFLower::shareCallMaskWidth(ArrayRef<Function *> SCC)
+{
+  unsigned Width = 0;
+  for (Function *Fn : SCC)
+    if (!Width)
+      Width = getCallMaskWidth(Fn);
+  if (!Width)
+    Width = getSCCCallWidth(SCC, MaxWidth);
+  if (!Width)
+    return;
+  for (Function *Fn : SCC) {
+    auto PSEntry = &PredicatedSubroutines[Fn];
+    if (!*PSEntry) {
+      *PSEntry = Width;
+      ++NumPredicatedSubroutines;
+    }
+  }
+}
+
+/***********************************************************************
+ * cloneForFullMask : make an unpredicated clone of a predicated subroutine
+ *    for the calls to it that run with all channels enabled
+ *
+ * Enter:   F = predicated subroutine, all of whose callers have been
+ *              processed
+ *          Budget = number of instructions that may still be cloned,
+ *              updated
+ *
+ * Return:  the clone, or nullptr if none was made
+ *
+ * A direct call that was not predicated, because it is outside simd control
+ * flow or EM is all ones there, is changed to call the clone. F itself stays
+ * predicated for the other calls, and for any indirect ones.
+ */
+Function *CMSimdCFLower::cloneForFullMask(Function *F, unsigned *Budget)
+{
+  // A stack call may be recursive, and a SIMT entry is not predicated.
+  if (F->hasFnAttribute(genx::FunctionMD::CMStackCall) ||
+      F->hasFnAttribute("CMGenxSIMT"))
+    return nullptr;
+  SmallVector<CallInst *, 4> FullMaskCalls;
+  for (auto *U : F->users()) {
+    auto CI = dyn_cast<CallInst>(U);
+    if (CI && CI->getCalledFunction() == F && !PredicatedCalls.count(CI))
+      FullMaskCalls.push_back(CI);
+  }
+  if (FullMaskCalls.empty())
+    return nullptr;
+  unsigned Size = 0;
+  for (auto fi = F->begin(), fe = F->end(); fi != fe; ++fi)
+    Size += fi->size();
+  if (Size > *Budget)
+    return nullptr;
+  *Budget -= Size;
+  LLVM_DEBUG(dbgs() << "cloning " << F->getName() << " for "
+      << FullMaskCalls.size() << " full mask calls\n");
+  ValueToValueMapTy VMap;
+  Function *Clone = CloneFunction(F, VMap);
+  Clone->setName(F->getName() + ".fullmask");
+  Clone->setLinkage(GlobalValue::InternalLinkage);
+  Clone->setDLLStorageClass(GlobalValue::DefaultStorageClass);
+  Clone->removeFnAttr(genx::FunctionMD::ReferencedIndirectly);
+  for (auto CI : FullMaskCalls)
+    CI->setCalledFunction(Clone);
+  // If the unmask ends have been indexed already, add the clone's.
+  if (UnmaskEndsIndexed) {
+    auto It = UnmaskEnds.find(F);
+    if (It != UnmaskEnds.end()) {
+      auto &Ends = UnmaskEnds[Clone];
+      for (auto CIE : It->second)
+        Ends.push_back(cast<CallInst>(VMap[CIE]));
     }
   }
+  ++NumFullMaskClones;
+  return Clone;
 }
 
 /***********************************************************************
@@ -535,17 +1255,85 @@ void CMSimdCFLowering::calculateVisitOrder(Module *M,
  */
 void CMSimdCFLower::processFunction(Function *ArgF)
 {
-  F = ArgF;
-  LLVM_DEBUG(dbgs() << "CMSimdCFLowering::processFunction:\n" << *F << "\n");
-  LLVM_DEBUG(F->print(dbgs()));
-  unsigned CMWidth = PredicatedSubroutines[F];
+  CMSimdCFAnalysis A;
+  A.F = ArgF;
+  A.CMWidth = getCallMaskWidth(ArgF);
+  A.MaxWidth = MaxWidth;
+  analyzeFunction(&A);
+  applyAnalysis(&A);
+}
+
+/***********************************************************************
+ * analyzeFunction : the read-only analysis phase of processing a function
+ *
+ * Enter:   A = analysis result with F and CMWidth set
+ *
+ * This does not modify the IR or any state shared between functions, so it
+ * can be run concurrently on different functions. Errors are recorded in A
+ * rather than emitted.
+ */
+void CMSimdCFLower::analyzeFunction(CMSimdCFAnalysis *A)
+{
+  LLVM_DEBUG(dbgs() << "CMSimdCFLowering::analyzeFunction:\n" << *A->F << "\n");
+  A->WantRemarks = OptimizationRemarkEmitter(A->F, nullptr)
+                       .allowExtraAnalysis(DEBUG_TYPE);
   // Find the simd branches.
-  bool FoundSIMD = findSimdBranches(CMWidth);
-  if (CMWidth > 0 || FoundSIMD) {
-    // Determine which basic blocks need to be predicated.
-    determinePredicatedBlocks();
-    // Mark the branch at the end of any to-be-predicated block as a simd branch.
-    markPredicatedBranches();
+  findSimdBranches(A);
+  if (A->CMWidth > 0 || A->FoundSIMD) {
+    unsigned NumErrors = A->Errors.size();
+    unsigned NumUniformSimd = 0;
+    for (;;) {
+      // Determine which basic blocks need to be predicated.
+      determinePredicatedBlocks(A);
+      // Mark the branch at the end of any to-be-predicated block as a simd branch.
+      markPredicatedBranches(A);
+      // If that marked a uniform branch as a simd branch, the blocks it
+      // controls need predicating too, so start again.
+      unsigned Count = std::count_if(A->UniformBranches.begin(),
+          A->UniformBranches.end(),
+          [A](BasicBlock *BB) { return A->SimdBranches.count(BB) != 0; });
+      if (Count == NumUniformSimd)
+        break;
+      NumUniformSimd = Count;
+      A->PredicatedBlocks.clear();
+      A->Errors.resize(NumErrors);
+    }
+  }
+}
+
+/***********************************************************************
+ * applyAnalysis : the IR-modifying phase of processing a function
+ *
+ * Enter:   A = analysis result from analyzeFunction
+ *
+ * This must be called in visit order, as it records the call mask width of
+ * the predicated subroutines called from A->F.
+ */
+void CMSimdCFLower::applyAnalysis(CMSimdCFAnalysis *A)
+{
+  F = A->F;
+  LLVM_DEBUG(dbgs() << "CMSimdCFLowering::processFunction:\n" << *F << "\n");
+  unsigned CMWidth = A->CMWidth;
+  for (auto i = A->Errors.begin(), e = A->Errors.end(); i != e; ++i)
+    DiagnosticInfoSimdCF::emit(i->first, i->second);
+  scalarizeUniformBranches(A);
+  if (CMWidth > 0 || A->FoundSIMD) {
+    SimdBranches = std::move(A->SimdBranches);
+    PredicatedBlocks = std::move(A->PredicatedBlocks);
+    // Flatten small regions into predicated code.
+    ifConvert(A);
+    // Remember the simd branches for the remarks, as some are un-simded
+    // on the way.
+    SmallVector<std::pair<Instruction *, unsigned>, 8> Branches;
+    CountPredication = A->WantRemarks;
+    if (CountPredication)
+      for (auto sbi = SimdBranches.begin(), sbe = SimdBranches.end();
+          sbi != sbe; ++sbi)
+        Branches.push_back(
+            std::make_pair(sbi->first->getTerminator(), sbi->second));
+    // Put the blocks in an order that suits the JIPs.
+    if (LayoutSimdCF || !Profile.empty())
+      layoutBlocks();
     // Fix simd branches:
     //  - remove backward simd branches
     //  - ensure that the false leg is fallthrough
@@ -557,28 +1345,42 @@ void CMSimdCFLower::processFunction(Function *ArgF)
     determineJIPs();
     // Predicate the code.
     predicateCode(CMWidth);
+    if (CountPredication)
+      emitRemarks(A, Branches);
     // Lower the control flow.
     lowerSimdCF();
+    if (ShareRMs)
+      shareRMSlots();
     lowerUnmaskOps();
+    if (SSAMasks)
+      promoteMasks();
   }
   SimdBranches.clear();
   PredicatedBlocks.clear();
   JoinPoints.clear();
   RMAddrs.clear();
   AlreadyPredicated.clear();
+  PredicationCounts.clear();
+  SplitJoins.clear();
+  CountPredication = false;
 }
 
 /***********************************************************************
  * findSimdBranches : find the simd branches in the function
  *
- * Enter:   CMWidth = 0 normally, or call mask width if in predicated subroutine
+ * Enter:   A->CMWidth = 0 normally, or call mask width if in predicated
+ *              subroutine
  *
- * This adds blocks to SimdBranches.
+ * This adds blocks to A->SimdBranches, and sets A->FoundSIMD if there are any.
+ * A simd branch whose condition is provably the same in every channel goes
+ * in A->UniformBranches instead: all enabled channels go the same way, so
+ * it does not need a goto unless it ends up in a predicated block anyway.
  */
-bool CMSimdCFLower::findSimdBranches(unsigned CMWidth)
+void CMSimdCFLower::findSimdBranches(CMSimdCFAnalysis *A)
 {
-  bool found = false;
-  for (auto fi = F->begin(), fe = F->end(); fi != fe; ++fi) {
+  unsigned CMWidth = A->CMWidth;
+  SmallDenseMap<Value *, bool, 8> Known;
+  for (auto fi = A->F->begin(), fe = A->F->end(); fi != fe; ++fi) {
     BasicBlock *BB = &*fi;
     auto Br = dyn_cast<BranchInst>(BB->getTerminator());
     if (!Br || !Br->isConditional())
@@ -587,12 +1389,291 @@ bool CMSimdCFLower::findSimdBranches(unsigned CMWidth)
       unsigned SimdWidth =
           cast<VectorType>((*SimdCondUse)->getType())->getNumElements();
       if (CMWidth && SimdWidth != CMWidth)
-        DiagnosticInfoSimdCF::emit(Br, "mismatching SIMD CF width inside SIMD call");
-      SimdBranches[BB] = SimdWidth;
-      found = true;
+        A->Errors.emplace_back(Br, "mismatching SIMD CF width inside SIMD call");
+      if (UniformBranches && isUniformCondition(*SimdCondUse, &Known, 16)) {
+        LLVM_DEBUG(dbgs() << "simd branch at " << BB->getName() << " is uniform\n");
+        A->UniformBranches.push_back(BB);
+        continue;
+      }
+      A->SimdBranches[BB] = SimdWidth;
+      A->FoundSIMD = true;
+      ++NumSimdBranches;
     }
   }
-  return found;
+}
+
+/***********************************************************************
+ * isSplatConstant : see if a vector constant has the same value in every
+ *    element
+ *
+ * This runs in the concurrent analysis phase, so it only compares the
+ * existing elements. Constant::getSplatValue may create a constant for an
+ * element of a ConstantDataVector, which is not safe to do from several
+ * threads at once.
+ */
+static bool isSplatConstant(Constant *C)
+{
+  if (isa<ConstantAggregateZero>(C))
+    return true;
+  if (auto CDV = dyn_cast<ConstantDataVector>(C)) {
+    StringRef Raw = CDV->getRawDataValues();
+    unsigned Size = CDV->getElementByteSize();
+    for (unsigned Offset = Size; Offset < Raw.size(); Offset += Size)
+      if (Raw.substr(Offset, Size) != Raw.substr(0, Size))
+        return false;
+    return true;
+  }
+  if (auto CV = dyn_cast<ConstantVector>(C)) {
+    // Constants are uniqued, so equal elements are the same constant.
+    for (auto &Op : CV->operands())
+      if (Op != CV->getOperand(0) || isa<UndefValue>(Op))
+        return false;
+    return true;
+  }
+  return false;
+}
+
+/***********************************************************************
+ * isUniformCondition : see if a simd condition is provably the same in every
+ *    channel
+ *
+ * Enter:   V = value to check
+ *          Known = results so far for this function
+ *          Depth = how much further to look through operands
+ *
+ * A scalar, a splat constant and a splat shufflevector are uniform, and so
+ * is an elementwise operation or a region read on uniform operands. Anything
+ * else, including a vector argument or load, is assumed not to be. A phi on
+ * a cycle is not uniform, as it is assumed not to be while it is checked.
+ */
+bool CMSimdCFLower::isUniformCondition(Value *V,
+    SmallDenseMap<Value *, bool, 8> *Known, unsigned Depth)
+{
+  auto VT = dyn_cast<VectorType>(V->getType());
+  if (!VT)
+    return true;
+  if (auto C = dyn_cast<Constant>(V))
+    return isSplatConstant(C);
+  auto Inst = dyn_cast<Instruction>(V);
+  if (!Inst || !Depth)
+    return false;
+  auto It = Known->find(V);
+  if (It != Known->end())
+    return It->second;
+  (*Known)[V] = false;
+  bool Uniform = false;
+  auto AllOperandsUniform = [&]() {
+    for (auto &U : Inst->operands())
+      if (!isUniformCondition(U, Known, Depth - 1))
+        return false;
+    return true;
+  };
+  if (auto SVI = dyn_cast<ShuffleVectorInst>(Inst)) {
+    // Uniform if every channel is the same element, or if every channel
+    // comes from the same uniform operand.
+    SmallVector<int, 32> Mask;
+    SVI->getShuffleMask(Mask);
+    unsigned NumSrc =
+        cast<VectorType>(SVI->getOperand(0)->getType())->getNumElements();
+    bool AllSame = true, AllFirst = true, AllSecond = true;
+    for (int Idx : Mask) {
+      AllSame &= Idx >= 0 && Idx == Mask[0];
+      AllFirst &= Idx >= 0 && unsigned(Idx) < NumSrc;
+      AllSecond &= Idx >= 0 && unsigned(Idx) >= NumSrc;
+    }
+    Uniform = AllSame ||
+        (AllFirst && isUniformCondition(SVI->getOperand(0), Known, Depth - 1)) ||
+        (AllSecond && isUniformCondition(SVI->getOperand(1), Known, Depth - 1));
+  } else if (isa<CmpInst>(Inst) || isa<BinaryOperator>(Inst) ||
+      isa<SelectInst>(Inst) || isa<PHINode>(Inst)) {
+    Uniform = AllOperandsUniform();
+  } else if (auto Cast = dyn_cast<CastInst>(Inst)) {
+    // A cast that changes the number of elements, such as a bitcast from a
+    // scalar, does not keep channels apart.
+    auto SrcVT = dyn_cast<VectorType>(Cast->getSrcTy());
+    Uniform = SrcVT && SrcVT->getNumElements() == VT->getNumElements() &&
+        AllOperandsUniform();
+  } else {
+    switch (GenXIntrinsic::getGenXIntrinsicID(Inst)) {
+      case GenXIntrinsic::genx_rdregioni:
+      case GenXIntrinsic::genx_rdregionf: {
+        // A region with zero strides replicates one element; any other
+        // region of a uniform vector is uniform.
+        auto VStride = dyn_cast<ConstantInt>(Inst->getOperand(1));
+        auto Stride = dyn_cast<ConstantInt>(Inst->getOperand(3));
+        Uniform = (VStride && VStride->isZero() && Stride && Stride->isZero() &&
+                   !Inst->getOperand(4)->getType()->isVectorTy()) ||
+            isUniformCondition(Inst->getOperand(0), Known, Depth - 1);
+        break;
+      }
+      default:
+        break;
+    }
+  }
+  (*Known)[V] = Uniform;
+  return Uniform;
+}
+
+/***********************************************************************
+ * scalarizeUniformBranches : turn simd branches on a uniform condition back
+ *    into scalar branches
+ *
+ * Enter:   A = analysis result, A->UniformBranches set by findSimdBranches
+ *
+ * One that is in a predicated block was marked as a simd branch again by
+ * markPredicatedBranches, and is left alone. Any other one branches on
+ * channel 0 of its condition, which is the same as the simdcf.any of it.
+ */
+void CMSimdCFLower::scalarizeUniformBranches(CMSimdCFAnalysis *A)
+{
+  for (auto BB : A->UniformBranches) {
+    if (A->SimdBranches.count(BB))
+      continue;
+    auto Br = cast<BranchInst>(BB->getTerminator());
+    auto Any = isSimdCFAny(Br->getCondition());
+    auto Cond = ExtractElementInst::Create(Any->getOperand(0),
+        ConstantInt::get(Type::getInt32Ty(BB->getContext()), 0),
+        Any->getName() + ".uniform", Br);
+    Cond->setDebugLoc(Br->getDebugLoc());
+    Br->setCondition(Cond);
+    if (Any->use_empty())
+      Any->eraseFromParent();
+    ++NumUniformBranches;
+  }
+}
+
+/***********************************************************************
+ * StructuredSimdCF::reachesExit : see if a block can reach a block with no
+ *    successors
+ */
+bool StructuredSimdCF::reachesExit(unsigned Num)
+{
+  if (ReachesExit.empty()) {
+    ReachesExit.resize(Blocks.size());
+    SmallVector<BasicBlock *, 8> Stack;
+    for (unsigned i = 0, e = Blocks.size(); i != e; ++i) {
+      if (Blocks[i]->getTerminator()->getNumSuccessors())
+        continue;
+      ReachesExit[i] = true;
+      Stack.push_back(Blocks[i]);
+    }
+    while (!Stack.empty()) {
+      BasicBlock *BB = Stack.pop_back_val();
+      for (auto pi = pred_begin(BB), pe = pred_end(BB); pi != pe; ++pi) {
+        unsigned PredNum = Numbers[*pi];
+        if (!ReachesExit[PredNum]) {
+          ReachesExit[PredNum] = true;
+          Stack.push_back(*pi);
+        }
+      }
+    }
+  }
+  return ReachesExit[Num];
+}
+
+/***********************************************************************
+ * StructuredSimdCF::sweep : sweep forwards in layout order from Start,
+ *    finding the blocks that every path from Start passes through
+ *
+ * Enter:   Start = number of first block
+ *          End = number of last block to sweep to, or NoEnd to stop at the
+ *                first block after Start that every path passes through
+ *          Cuts = vector to add the numbers of the found blocks to, in
+ *                 increasing order starting with Start
+ *
+ * Return:  false if the blocks reachable from Start in the swept range have a
+ *          backward edge, an edge past End, or no successors, or if End is
+ *          not reached
+ *
+ * Only edges out of blocks reachable from Start (within the swept range) are
+ * considered. Given they are all forward edges, a reachable block that no
+ * such edge jumps past is passed through by every path from Start.
+ */
+bool StructuredSimdCF::sweep(unsigned Start, unsigned End,
+                             SmallVectorImpl<unsigned> *Cuts)
+{
+  std::vector<bool> Reachable(1, true);
+  unsigned MaxReach = Start;
+  for (unsigned Num = Start; Num != Blocks.size(); ++Num) {
+    bool IsReachable = Num - Start < Reachable.size() && Reachable[Num - Start];
+    if (IsReachable && MaxReach <= Num) {
+      Cuts->push_back(Num);
+      if (End == NoEnd ? Num != Start : Num == End)
+        return true;
+    }
+    if (Num == End)
+      return false;
+    if (!IsReachable)
+      continue;
+    auto Term = cast<VCINTR::TerminatorInst>(Blocks[Num]->getTerminator());
+    if (!Term->getNumSuccessors())
+      return false;
+    for (unsigned si = 0, se = Term->getNumSuccessors(); si != se; ++si) {
+      unsigned SuccNum = Numbers[Term->getSuccessor(si)];
+      if (SuccNum <= Num || SuccNum > End)
+        return false;
+      if (SuccNum - Start >= Reachable.size())
+        Reachable.resize(SuccNum - Start + 1);
+      Reachable[SuccNum - Start] = true;
+      MaxReach = std::max(MaxReach, SuccNum);
+    }
+  }
+  return false;
+}
+
+/***********************************************************************
+ * StructuredSimdCF::getControlDependents : get the blocks control dependent
+ *    on a simd branch, if the code around it is structured
+ *
+ * Enter:   Br = the simd branch
+ *          Deps = vector to add the control dependent blocks to, in the
+ *                 order that the post-dominator tree walk would find them
+ *
+ * Return:  false if the code is not structured enough, in which case Deps
+ *          is unchanged
+ */
+bool StructuredSimdCF::getControlDependents(BranchInst *Br,
+                                            SmallVectorImpl<BasicBlock *> *Deps)
+{
+  unsigned BlockMNum = Numbers[Br->getParent()];
+  if (!reachesExit(BlockMNum))
+    return false;
+  SmallVector<unsigned, 2> SuccNums;
+  bool IsBackward = false;
+  for (unsigned si = 0, se = Br->getNumSuccessors(); si != se; ++si) {
+    SuccNums.push_back(Numbers[Br->getSuccessor(si)]);
+    IsBackward |= SuccNums.back() <= BlockMNum;
+  }
+  SmallVector<unsigned, 8> Result;
+  SmallVector<unsigned, 8> Cuts;
+  if (!IsBackward) {
+    // Forward branch. Find X, the immediate post-dominator of M.
+    if (!sweep(BlockMNum, NoEnd, &Cuts))
+      return false;
+    unsigned X = Cuts.back();
+    // For each successor N, the blocks from N up to but excluding X.
+    for (auto i = SuccNums.begin(), e = SuccNums.end(); i != e; ++i) {
+      Cuts.clear();
+      if (!sweep(*i, X, &Cuts))
+        return false;
+      Result.append(Cuts.begin(), Cuts.end() - 1);
+    }
+  } else {
+    // Backward branch. It must be the only latch of a loop whose body is the
+    // blocks from the header to M, with the other leg being the exit.
+    if (SuccNums.size() != 2 ||
+        (SuccNums[0] <= BlockMNum) == (SuccNums[1] <= BlockMNum))
+      return false;
+    for (auto i = SuccNums.begin(), e = SuccNums.end(); i != e; ++i) {
+      if (*i > BlockMNum)
+        continue; // exit leg post-dominates M
+      if (!sweep(*i, BlockMNum, &Result))
+        return false;
+    }
+  }
+  for (auto i = Result.begin(), e = Result.end(); i != e; ++i)
+    Deps->push_back(Blocks[*i]);
+  return true;
 }
 
 /***********************************************************************
@@ -607,46 +1688,48 @@ bool CMSimdCFLower::findSimdBranches(unsigned CMWidth)
  * the control flow graph where n does not post-dominate m, find l, the
  * closest common ancestor in the post-dominance tree of m and n. All nodes
  * in the post-dominance tree from l to n except l itself are control dependent
- * on m.
+ * on m. (If l is m, as for a do..while back edge, m itself is included.)
+ *
+ * Structured code is handled by StructuredSimdCF. Otherwise this uses
+ * GenXControlDependence, which computes the same sets in linear time.
  */
-void CMSimdCFLower::determinePredicatedBlocks()
+void CMSimdCFLower::determinePredicatedBlocks(CMSimdCFAnalysis *A)
 {
-  PostDominatorTree PDT;
-  PDT.recalculate(*F);
+  // The control dependence is only computed if there is a simd branch that
+  // the structured sweep cannot handle.
+  std::unique_ptr<GenXControlDependence> CD;
+  std::unique_ptr<StructuredSimdCF> Structured;
+  if (EnableStructuredSimdCF)
+    Structured.reset(new StructuredSimdCF(A->F));
 
-  for (auto sbi = SimdBranches.begin(), sbe = SimdBranches.end();
+  for (auto sbi = A->SimdBranches.begin(), sbe = A->SimdBranches.end();
       sbi != sbe; ++sbi) {
     BasicBlock *BlockM = sbi->first;
     auto Br = cast<BranchInst>(BlockM->getTerminator());
     unsigned SimdWidth = sbi->second;
     LLVM_DEBUG(dbgs() << "simd branch (width " << SimdWidth << ") at " << BlockM->getName() << "\n");
-    if (SimdWidth < 2 || SimdWidth > MAX_SIMD_CF_WIDTH || !isPowerOf2_32(SimdWidth))
-      DiagnosticInfoSimdCF::emit(Br, "illegal SIMD CF width");
-    // For each successor BlockN of BlockM...
-    for (unsigned si = 0, se = Br->getNumSuccessors(); si != se; ++si) {
-      auto BlockN = Br->getSuccessor(si);
-      // Get BlockL, the closest common postdominator.
-      auto BlockL = PDT.findNearestCommonDominator(BlockM, BlockN);
-      if (BlockL == BlockM) {
-        // need to include BlockM into the chain 
-        // if the branch is the do-while back-edge
-        if (auto ParentNode = PDT.getNode(BlockM))
-          if (auto IDom = ParentNode->getIDom())
-            BlockL = IDom->getBlock();
-      }
-      // Trace up the postdominator tree from BlockN (inclusive) to BlockL
-      // (exclusive) to find blocks control dependent on BlockM. This also
-      // handles the case that BlockN does postdominate BlockM; no blocks
-      // are control dependent on BlockM.
-      for (auto Node = PDT.getNode(BlockN); Node && Node->getBlock() != BlockL;
-            Node = Node->getIDom()) {
-        auto BB = Node->getBlock();
-        LLVM_DEBUG(dbgs() << "  " << BB->getName() << " needs predicating\n");
-        auto PBEntry = &PredicatedBlocks[BB];
-        if (*PBEntry && *PBEntry != SimdWidth)
-          DiagnosticInfoSimdCF::emit(Br, "mismatching SIMD CF width");
-        *PBEntry = SimdWidth;
+    if (SimdWidth < 2 || SimdWidth > A->MaxWidth || !isPowerOf2_32(SimdWidth))
+      A->Errors.emplace_back(Br, "illegal SIMD CF width");
+    SmallVector<BasicBlock *, 8> Deps;
+    if (!Structured || !Structured->getControlDependents(Br, &Deps)) {
+      if (!CD) {
+        PostDominatorTree PDT;
+        PDT.recalculate(*A->F);
+        CD.reset(new GenXControlDependence);
+        CD->compute(*A->F, PDT);
       }
+      auto CDDeps = CD->getDependentBlocks(BlockM);
+      Deps.append(CDDeps.begin(), CDDeps.end());
+    }
+    if (A->WantRemarks)
+      A->ControlledBlocks[Br].assign(Deps.begin(), Deps.end());
+    for (auto i = Deps.begin(), e = Deps.end(); i != e; ++i) {
+      auto BB = *i;
+      LLVM_DEBUG(dbgs() << "  " << BB->getName() << " needs predicating\n");
+      auto PBEntry = &A->PredicatedBlocks[BB];
+      if (*PBEntry && *PBEntry != SimdWidth)
+        A->Errors.emplace_back(Br, "mismatching SIMD CF width");
+      *PBEntry = SimdWidth;
     }
   }
 }
@@ -658,18 +1741,22 @@ void CMSimdCFLower::determinePredicatedBlocks()
  * This errors if it finds anything other than a BranchInst. Using switch or
  * return inside simd control flow is not allowed.
  */
-void CMSimdCFLower::markPredicatedBranches()
+void CMSimdCFLower::markPredicatedBranches(CMSimdCFAnalysis *A)
 {
-  for (auto pbi = PredicatedBlocks.begin(), pbe = PredicatedBlocks.end();
+  for (auto pbi = A->PredicatedBlocks.begin(), pbe = A->PredicatedBlocks.end();
       pbi != pbe; ++pbi) {
     auto BB = pbi->first;
     unsigned SimdWidth = pbi->second;
     auto Term = BB->getTerminator();
-    if (!isa<BranchInst>(Term))
-      DiagnosticInfoSimdCF::emit(Term, "return or switch not allowed in SIMD control flow");
-    if (!SimdBranches[BB])
+    // Leave the block out of the simd branches, which the analysis may go
+    // through again.
+    if (!isa<BranchInst>(Term)) {
+      A->Errors.emplace_back(Term, "return or switch not allowed in SIMD control flow");
+      continue;
+    }
+    if (!A->SimdBranches[BB])
       LLVM_DEBUG(dbgs() << "branch at " << BB->getName() << " becomes simd\n");
-    SimdBranches[BB] = SimdWidth;
+    A->SimdBranches[BB] = SimdWidth;
   }
 }
 
@@ -685,6 +1772,174 @@ static void fixPHIInput(BasicBlock *Succ, BasicBlock *OldPred, BasicBlock *NewPr
     phi->addIncoming(SrcV, NewPred);
   }
 }
+/***********************************************************************
+ * loadProfile : read a divergence profile for the simd branches
+ *
+ * Enter:   FileName = the profile, with a line for each simd branch of
+ *              "file:line:column all-true all-false divergent", giving the
+ *              branch's debug location and the number of executions in
+ *              which all enabled channels took the true leg, all took the
+ *              false leg, and the channels diverged. Blank lines and
+ *              anything after a # are ignored.
+ */
+void CMSimdCFLower::loadProfile(StringRef FileName)
+{
+  auto Buf = MemoryBuffer::getFile(FileName);
+  if (!Buf)
+    report_fatal_error("CMSimdCFLowering: cannot read profile " + FileName);
+  for (line_iterator li(**Buf, /*SkipBlanks=*/true, '#'); !li.is_at_end();
+      ++li) {
+    SmallVector<StringRef, 4> Fields;
+    SplitString(*li, Fields);
+    if (Fields.empty())
+      continue;
+    SimdBranchProfile P;
+    if (Fields.size() != 4 || Fields[1].getAsInteger(10, P.AllTrue) ||
+        Fields[2].getAsInteger(10, P.AllFalse) ||
+        Fields[3].getAsInteger(10, P.Divergent))
+      report_fatal_error("CMSimdCFLowering: malformed line " +
+                         Twine(li.line_number()) + " in profile " + FileName);
+    Profile[Fields[0]] = P;
+  }
+}
+
+/***********************************************************************
+ * getProfile : get the divergence profile of a simd branch
+ *
+ * Return:  the profile, or nullptr if there is none for the branch's
+ *          debug location
+ */
+const SimdBranchProfile *CMSimdCFLower::getProfile(Instruction *Br) const
+{
+  const DebugLoc &DL = Br->getDebugLoc();
+  if (Profile.empty() || !DL)
+    return nullptr;
+  auto It = Profile.find((DL->getFilename() + ":" + Twine(DL.getLine()) +
+                          ":" + Twine(DL.getCol())).str());
+  return It == Profile.end() ? nullptr : &It->second;
+}
+
+/***********************************************************************
+ * isRarelyDivergent : test whether the profile says a simd branch diverges
+ *      in under -cmsimdcf-rarely-divergent percent of its executions
+ */
+bool CMSimdCFLower::isRarelyDivergent(Instruction *Br) const
+{
+  auto P = getProfile(Br);
+  return P && P->getTotal() &&
+         P->Divergent * 100 < P->getTotal() * RarelyDivergentPercent;
+}
+
+/***********************************************************************
+ * isOftenDivergent : test whether the profile says a simd branch diverges
+ *      in at least -cmsimdcf-often-divergent percent of its executions
+ */
+bool CMSimdCFLower::isOftenDivergent(Instruction *Br) const
+{
+  auto P = getProfile(Br);
+  return P && P->getTotal() &&
+         P->Divergent * 100 >= P->getTotal() * OftenDivergentPercent;
+}
+
+/***********************************************************************
+ * getBranchWeights : get the !prof branch weights of a conditional branch
+ *
+ * Return:  false if it does not have them
+ */
+static bool getBranchWeights(Instruction *Br, uint64_t *TrueWeight,
+    uint64_t *FalseWeight)
+{
+  MDNode *MD = Br->getMetadata(LLVMContext::MD_prof);
+  if (!MD || MD->getNumOperands() != 3)
+    return false;
+  auto Name = dyn_cast<MDString>(MD->getOperand(0));
+  auto TrueC = mdconst::dyn_extract<ConstantInt>(MD->getOperand(1));
+  auto FalseC = mdconst::dyn_extract<ConstantInt>(MD->getOperand(2));
+  if (!Name || Name->getString() != "branch_weights" || !TrueC || !FalseC)
+    return false;
+  *TrueWeight = TrueC->getZExtValue();
+  *FalseWeight = FalseC->getZExtValue();
+  return true;
+}
+
+/***********************************************************************
+ * layoutBlocks : reorder the blocks ready for JIP determination
+ *
+ * The JIPs, and which unconditional simd branches can be un-simded, depend
+ * on the block order. This lays the blocks out in a reverse post order in
+ * which the successors of each block are visited so that the false leg of
+ * a branch comes straight after it, and the exits of a loop come after the
+ * whole loop. In structured code that makes each if or loop a contiguous
+ * region followed by its join point. The entry block stays first, and any
+ * unreachable blocks are left at the end.
+ *
+ * The legs of a two way branch are swapped where a profile says so. The
+ * likely leg of a scalar branch with branch weights comes straight after
+ * it. The likely leg of a rarely divergent simd branch is the one laid out
+ * later, which becomes the goto target, so that when all channels go that
+ * way the goto jumps straight to it over the unlikely leg.
+ */
+void CMSimdCFLower::layoutBlocks()
+{
+  DominatorTree DT(*F);
+  LoopInfo LI(DT);
+  // Successors are visited in the reverse of the order they are laid out:
+  // the loop exits first, then the others with the false leg last.
+  auto getSuccs = [&](BasicBlock *BB) {
+    SmallVector<BasicBlock *, 2> Succs;
+    Loop *L = LI.getLoopFor(BB);
+    auto Term = cast<VCINTR::TerminatorInst>(BB->getTerminator());
+    bool Swap = false;
+    if (Term->getNumSuccessors() == 2) {
+      uint64_t TrueWeight = 0, FalseWeight = 0;
+      if (SimdBranches.count(BB)) {
+        if (isRarelyDivergent(Term)) {
+          auto P = getProfile(Term);
+          Swap = P->AllFalse > P->AllTrue;
+        }
+      } else if (getBranchWeights(Term, &TrueWeight, &FalseWeight))
+        Swap = TrueWeight > FalseWeight;
+    }
+    for (unsigned Exits = 1;; Exits = 0) {
+      for (unsigned si = 0, se = Term->getNumSuccessors(); si != se; ++si) {
+        BasicBlock *Succ = Term->getSuccessor(Swap ? se - 1 - si : si);
+        if ((L && !L->contains(Succ)) == bool(Exits))
+          Succs.push_back(Succ);
+      }
+      if (!Exits)
+        break;
+    }
+    return Succs;
+  };
+  std::vector<BasicBlock *> PostOrder;
+  SmallPtrSet<BasicBlock *, 32> Visited;
+  SmallVector<std::pair<BasicBlock *, SmallVector<BasicBlock *, 2>>, 16> Stack;
+  Visited.insert(&F->front());
+  Stack.push_back(std::make_pair(&F->front(), getSuccs(&F->front())));
+  while (!Stack.empty()) {
+    auto &Succs = Stack.back().second;
+    BasicBlock *Next = nullptr;
+    while (!Succs.empty() && !Next) {
+      BasicBlock *Succ = Succs.front();
+      Succs.erase(Succs.begin());
+      if (Visited.insert(Succ).second)
+        Next = Succ;
+    }
+    if (Next) {
+      Stack.push_back(std::make_pair(Next, getSuccs(Next)));
+      continue;
+    }
+    PostOrder.push_back(Stack.back().first);
+    Stack.pop_back();
+  }
+  BasicBlock *Prev = nullptr;
+  for (auto i = PostOrder.rbegin(), e = PostOrder.rend(); i != e; ++i) {
+    if (Prev)
+      (*i)->moveAfter(Prev);
+    Prev = *i;
+  }
+}
+
 /***********************************************************************
  * fixSimdBranches : fix simd branches ready for JIP determination
  *
@@ -808,6 +2063,8 @@ void CMSimdCFLower::findAndSplitJoinPoints()
       SimdBranches.erase(JP);
     }
     LLVM_DEBUG(dbgs() << "split join point " << JP->getName() << " out to " << SplitBB->getName() << "\n");
+    if (CountPredication)
+      SplitJoins[JP] = SplitBB;
     JoinPoints[JP] = SimdWidth;
   }
 }
@@ -860,6 +2117,13 @@ void CMSimdCFLower::determineJIPs()
       Groups.joinGroups(NextBB, Succ);
     }
   }
+  // The grouping misses joins that end an if..else or a loop, as the edges
+  // into the join join its group with a later one. Those are found by
+  // removeUnneededJIPs, which needs the layout order as a vector.
+  std::vector<BasicBlock *> Layout;
+  if (PreciseJoinJIPs)
+    for (auto fi = F->begin(), fe = F->end(); fi != fe; ++fi)
+      Layout.push_back(&*fi);
   // Repeat until we stop un-simding branches...
   for (;;) {
     // Determine the JIPs for the SIMD branches.
@@ -881,6 +2145,8 @@ void CMSimdCFLower::determineJIPs()
         break;
       BB = BB->getPrevNode();
     }
+    if (PreciseJoinJIPs)
+      removeUnneededJIPs(&Numbers, Layout);
 
     // See if we have any unconditional branch with UIP == JIP or no JIP. If so,
     // it can stay as a scalar unconditional branch.
@@ -903,6 +2169,7 @@ void CMSimdCFLower::determineJIPs()
       break;
     for (auto i = BranchesToUnsimd.begin(), e = BranchesToUnsimd.end(); i != e; ++i)
       SimdBranches.erase(SimdBranches.find(*i));
+    NumUnsimdedBranches += BranchesToUnsimd.size();
 
     // For each join, see if it is still the UIP of any goto. If not, remove it.
     SmallVector<BasicBlock *, 4> JoinsToRemove;
@@ -916,6 +2183,116 @@ void CMSimdCFLower::determineJIPs()
   }
 }
 
+/***********************************************************************
+ * removeUnneededJIPs : remove the JIP from joins that are always reached
+ *    with at least one channel enabled
+ *
+ * Enter:   Numbers = layout number of each block
+ *          Layout = the blocks in layout order
+ *          JIPs = the JIPs determined for the gotos and joins
+ *
+ * A join JP needs no JIP if a block D dominating it starts a single entry
+ * region [D,JP) in layout order: every edge from a block in the region goes
+ * to a block in (D,JP], every edge into (D,JP) comes from the region, and no
+ * goto or join outside the region has a join in (D,JP] as its JIP. D runs
+ * with at least one channel enabled (else it would have been jumped over),
+ * and the region has no way out other than JP, so each of those channels is
+ * back in EM or in JP's RM when JP is reached. Other edges into JP itself,
+ * such as the back edge when JP is also a loop header, are taken with
+ * channels enabled, so they do no harm. That covers a join after an
+ * if..else, where both legs branch from D, the join after a loop whose exits
+ * all go to it, and a join that is also a loop header. Candidates for D are
+ * taken up the dominator tree, as a region that fails because of an edge
+ * back to or before D may fit from an outer one.
+ */
+void CMSimdCFLower::removeUnneededJIPs(
+    std::map<BasicBlock *, unsigned> *Numbers,
+    const std::vector<BasicBlock *> &Layout)
+{
+  // The gotos and joins that jump to each JIP.
+  std::map<BasicBlock *, SmallVector<BasicBlock *, 2>> JIPUsers;
+  auto addJIPUser = [&](BasicBlock *BB) {
+    auto It = JIPs.find(BB);
+    if (It != JIPs.end() && It->second)
+      JIPUsers[It->second].push_back(BB);
+  };
+  for (auto sbi = SimdBranches.begin(), sbe = SimdBranches.end();
+      sbi != sbe; ++sbi)
+    addJIPUser(sbi->first);
+  for (auto jpi = JoinPoints.begin(), jpe = JoinPoints.end();
+      jpi != jpe; ++jpi)
+    addJIPUser(jpi->first);
+  std::unique_ptr<DominatorTree> DT;
+  for (auto jpi = JoinPoints.begin(), jpe = JoinPoints.end();
+      jpi != jpe; ++jpi) {
+    BasicBlock *JP = jpi->first;
+    auto It = JIPs.find(JP);
+    if (It == JIPs.end() || !It->second)
+      continue;
+    if (!DT)
+      DT.reset(new DominatorTree(*F));
+    // Grow the region [Lo,JNum) a dominator at a time. Fails is set if no
+    // region ending at JP can work, and Bound is the latest start that the
+    // edges seen so far allow.
+    int JNum = (*Numbers)[JP];
+    int Lo = JNum;
+    int Bound = JNum;
+    bool Fails = false;
+    auto addEdgesInto = [&](int Num) {
+      for (auto Pred : predecessors(Layout[Num])) {
+        int PredNum = (*Numbers)[Pred];
+        if (PredNum >= JNum) {
+          // A loop back edge to JP itself is taken with channels enabled.
+          if (Num != JNum)
+            Fails = true;
+          continue;
+        }
+        Bound = std::min(Bound, PredNum);
+      }
+      auto UsersIt = JIPUsers.find(Layout[Num]);
+      if (UsersIt == JIPUsers.end())
+        return;
+      for (auto User : UsersIt->second) {
+        int UserNum = (*Numbers)[User];
+        if (UserNum >= JNum)
+          Fails = true;
+        Bound = std::min(Bound, UserNum);
+      }
+    };
+    addEdgesInto(JNum);
+    auto Node = DT->getNode(JP);
+    for (Node = Node ? Node->getIDom() : nullptr; Node && !Fails;
+        Node = Node->getIDom()) {
+      int DNum = (*Numbers)[Node->getBlock()];
+      if (DNum >= Lo)
+        continue;
+      for (int Num = DNum; Num != Lo; ++Num) {
+        if (Num != DNum)
+          addEdgesInto(Num);
+        auto Term = cast<VCINTR::TerminatorInst>(Layout[Num]->getTerminator());
+        if (!Term->getNumSuccessors())
+          Fails = true; // return from inside the region
+        for (unsigned si = 0, se = Term->getNumSuccessors(); si != se; ++si) {
+          int SuccNum = (*Numbers)[Term->getSuccessor(si)];
+          if (SuccNum > JNum)
+            Fails = true;
+          Bound = std::min(Bound, SuccNum - 1);
+        }
+      }
+      if (Lo != JNum)
+        addEdgesInto(Lo);
+      Lo = DNum;
+      if (!Fails && DNum <= Bound) {
+        LLVM_DEBUG(dbgs() << JP->getName() << " ends the region from "
+            << Node->getBlock()->getName() << ", so does not need JIP\n");
+        JIPs.erase(It);
+        ++NumJoinJIPsRemoved;
+        break;
+      }
+    }
+  }
+}
+
 /***********************************************************************
  * determineJIP : determine the JIP for a goto or join
  */
@@ -944,8 +2321,12 @@ void CMSimdCFLower::determineJIP(BasicBlock *BB,
     if (JP == UIP)
       break;
     // See if JP is a basic block with a branch from before BB.
+    // A blockaddress use is not a branch.
     for (auto ui = JP->use_begin(), ue = JP->use_end(); ui != ue; ++ui) {
-      auto BranchBlock = cast<Instruction>(ui->getUser())->getParent();
+      auto User = dyn_cast<Instruction>(ui->getUser());
+      if (!User)
+        continue;
+      auto BranchBlock = User->getParent();
       if ((*Numbers)[BranchBlock] < BBNum) {
         NeedNextJoin = true;
         break;
@@ -962,34 +2343,124 @@ void CMSimdCFLower::determineJIP(BasicBlock *BB,
         break;
       }
     }
-    assert(JP != &BB->getParent()->back() && "reached end");
+    assert(JP != &BB->getParent()->back() && "reached end");
+  }
+  LLVM_DEBUG(dbgs() << BB->getName() << ": JIP is " << JP->getName() << "\n");
+  JIPs[BB] = JP;
+}
+
+/***********************************************************************
+ * predicateCode : predicate the instructions in the code
+ */
+void CMSimdCFLower::predicateCode(unsigned CMWidth)
+{
+  computeAllOnesEM(CMWidth);
+  if (CMWidth) {
+    // Inside a predicated call, also predicate all other blocks. We do this
+    // first so the entry block gets done before any other block, avoiding a
+    // problem that code we insert to set up the EMs and RMs accidentally gets
+    // predicated.
+    for (auto fi = F->begin(), fe = F->end(); fi != fe; ++fi) {
+      BasicBlock *BB = &*fi;
+      if (PredicatedBlocks.find(BB) == PredicatedBlocks.end())
+        predicateBlock(BB, CMWidth);
+    }
+  }
+  // Predicate all basic blocks that need it.
+  for (auto pbi = PredicatedBlocks.begin(), pbe = PredicatedBlocks.end();
+      pbi != pbe; ++pbi) {
+    BasicBlock *BB = pbi->first;
+    unsigned SimdWidth = pbi->second;
+    predicateBlock(BB, SimdWidth);
+  }
+  EMAllOnesAtEntry.clear();
+}
+
+/***********************************************************************
+ * computeAllOnesEM : find the blocks where EM is all ones on entry
+ *
+ * Enter:   CMWidth = call mask width if in predicated subroutine, else 0
+ *
+ * This is a forward "EM is all ones" dataflow over the CFG. EM is all ones
+ * at the entry of a kernel, and after llvm.genx.unmask.begin up to its
+ * llvm.genx.unmask.end. A simd branch (which becomes a goto) and a join
+ * point make it unknown, while a call to a subroutine leaves it as it was.
+ * A block is all ones on entry only if all its predecessors are all ones
+ * on exit.
+ */
+void CMSimdCFLower::computeAllOnesEM(unsigned CMWidth)
+{
+  EMAllOnesAtEntry.clear();
+  bool EntryAllOnes = !CMWidth
+      && F->hasFnAttribute(genx::FunctionMD::CMGenXMain);
+  // Summarize the effect of each block: pass the state through (None), or
+  // set it to all ones or unknown.
+  enum { None, Set, Clear };
+  DenseMap<BasicBlock *, unsigned> Effect;
+  DenseMap<BasicBlock *, bool> AllOnesOut;
+  bool AnySet = EntryAllOnes;
+  ReversePostOrderTraversal<Function *> RPOT(F);
+  for (auto BB : RPOT) {
+    unsigned E = None;
+    if (SimdBranches.count(BB))
+      E = Clear;
+    else {
+      for (auto bi = BB->rbegin(), be = BB->rend(); bi != be && E == None; ++bi)
+        if (updateAllOnesEM(&*bi, false))
+          E = Set;
+        else if (!updateAllOnesEM(&*bi, true))
+          E = Clear;
+    }
+    AnySet |= E == Set;
+    Effect[BB] = E;
+    // Start optimistically, with everything all ones.
+    EMAllOnesAtEntry[BB] = true;
+    AllOnesOut[BB] = true;
+  }
+  if (!AnySet) {
+    EMAllOnesAtEntry.clear();
+    return;
+  }
+  for (bool Changed = true; Changed; ) {
+    Changed = false;
+    for (auto BB : RPOT) {
+      bool In = true;
+      if (BB == &F->getEntryBlock())
+        In = EntryAllOnes;
+      else if (JoinPoints.count(BB))
+        In = false;
+      else {
+        for (auto Pred : predecessors(BB))
+          In &= AllOnesOut.lookup(Pred);
+      }
+      bool Out = Effect[BB] == None ? In : Effect[BB] == Set;
+      if (In != EMAllOnesAtEntry[BB] || Out != AllOnesOut[BB]) {
+        EMAllOnesAtEntry[BB] = In;
+        AllOnesOut[BB] = Out;
+        Changed = true;
+      }
+    }
   }
-  LLVM_DEBUG(dbgs() << BB->getName() << ": JIP is " << JP->getName() << "\n");
-  JIPs[BB] = JP;
 }
 
 /***********************************************************************
- * predicateCode : predicate the instructions in the code
+ * updateAllOnesEM : update the "EM is all ones" state across an instruction
+ *
+ * Enter:   Inst = the instruction
+ *          AllOnes = whether EM is all ones before Inst
+ *
+ * Return:  whether EM is all ones after Inst
  */
-void CMSimdCFLower::predicateCode(unsigned CMWidth)
+bool CMSimdCFLower::updateAllOnesEM(Instruction *Inst, bool AllOnes)
 {
-  if (CMWidth) {
-    // Inside a predicated call, also predicate all other blocks. We do this
-    // first so the entry block gets done before any other block, avoiding a
-    // problem that code we insert to set up the EMs and RMs accidentally gets
-    // predicated.
-    for (auto fi = F->begin(), fe = F->end(); fi != fe; ++fi) {
-      BasicBlock *BB = &*fi;
-      if (PredicatedBlocks.find(BB) == PredicatedBlocks.end())
-        predicateBlock(BB, CMWidth);
-    }
-  }
-  // Predicate all basic blocks that need it.
-  for (auto pbi = PredicatedBlocks.begin(), pbe = PredicatedBlocks.end();
-      pbi != pbe; ++pbi) {
-    BasicBlock *BB = pbi->first;
-    unsigned SimdWidth = pbi->second;
-    predicateBlock(BB, SimdWidth);
+  switch (GenXIntrinsic::getAnyIntrinsicID(Inst)) {
+    case GenXIntrinsic::genx_unmask_begin:
+      return true;
+    case GenXIntrinsic::not_any_intrinsic:
+      // A subroutine returns with EM as it was on entry.
+      return AllOnes;
+    default:
+      return AllOnes && !mayChangeEM(Inst);
   }
 }
 
@@ -1001,10 +2472,46 @@ void CMSimdCFLower::predicateCode(unsigned CMWidth)
  */
 void CMSimdCFLower::predicateBlock(BasicBlock *BB, unsigned SimdWidth)
 {
+  ++NumPredicatedBlocks;
+  EMCache.clear();
+  EMAllOnes = EMAllOnesAtEntry.lookup(BB);
   for (auto bi = BB->begin(), be = BB->end(); bi != be; ) {
     Instruction *Inst = &*bi;
     ++bi; // Increment here in case Inst is removed
+    if (mayChangeEM(Inst))
+      EMCache.clear();
+    EMCacheInst = Inst;
+    bool AllOnesAfter = updateAllOnesEM(Inst, EMAllOnes);
     predicateInst(Inst, SimdWidth);
+    EMAllOnes = AllOnesAfter;
+  }
+  EMCache.clear();
+  EMCacheInst = nullptr;
+  EMAllOnes = false;
+}
+
+/***********************************************************************
+ * mayChangeEM : see if an instruction may change EM, so an EM value loaded
+ *    before it cannot be used after it
+ *
+ * This is a call to a real subroutine, or a simd CF or unmask intrinsic.
+ */
+bool CMSimdCFLower::mayChangeEM(Instruction *Inst)
+{
+  if (!isa<CallInst>(Inst))
+    return false;
+  switch (GenXIntrinsic::getAnyIntrinsicID(Inst)) {
+    case GenXIntrinsic::not_any_intrinsic:
+    case GenXIntrinsic::genx_simdcf_goto:
+    case GenXIntrinsic::genx_simdcf_join:
+    case GenXIntrinsic::genx_simdcf_savemask:
+    case GenXIntrinsic::genx_simdcf_unmask:
+    case GenXIntrinsic::genx_simdcf_remask:
+    case GenXIntrinsic::genx_unmask_begin:
+    case GenXIntrinsic::genx_unmask_end:
+      return true;
+    default:
+      return false;
   }
 }
 
@@ -1030,6 +2537,354 @@ static CallInst *createWrRegion(ArrayRef<Value *> Args, const Twine &Name,
   return WrRegion;
 }
 
+/***********************************************************************
+ * isAlwaysAccessible : see if an access of a type at an address is safe in
+ *    every channel, whether or not the channel is enabled
+ *
+ * Enter:   Ptr = the address
+ *          Ty = the type loaded or stored
+ *          DL = the data layout
+ *
+ * The address must be at a constant offset within a static alloca or an
+ * internal global, or be known dereferenceable. An address passed in from
+ * elsewhere may be valid only for the channels that would have run the
+ * access.
+ */
+static bool isAlwaysAccessible(Value *Ptr, Type *Ty, const DataLayout &DL)
+{
+  APInt Offset(DL.getIndexTypeSizeInBits(Ptr->getType()), 0);
+  Value *Base = Ptr->stripAndAccumulateInBoundsConstantOffsets(DL, Offset);
+  uint64_t Size = 0;
+  if (auto AI = dyn_cast<AllocaInst>(Base)) {
+    auto ArraySize = dyn_cast<ConstantInt>(AI->getArraySize());
+    if (ArraySize)
+      Size = DL.getTypeAllocSize(AI->getAllocatedType()) *
+             ArraySize->getZExtValue();
+  } else if (auto GV = dyn_cast<GlobalVariable>(Base)) {
+    if (GV->hasLocalLinkage() && !GV->isConstant())
+      Size = DL.getTypeAllocSize(GV->getValueType());
+  }
+  if (Size && !Offset.isNegative() &&
+      Offset.getZExtValue() + DL.getTypeStoreSize(Ty) <= Size)
+    return true;
+#if VC_INTR_LLVM_VERSION_MAJOR >= 9
+  return isDereferenceablePointer(Ptr, Ty, DL);
+#else
+  return isDereferenceablePointer(Ptr, DL);
+#endif
+}
+
+/***********************************************************************
+ * ifConvert : flatten small simd regions into straight-line predicated code
+ *
+ * Enter:   A = analysis result, for whether remarks are wanted
+ *
+ * Flattening a region can leave the region around it small enough to
+ * flatten too, so this repeats until nothing changes. That flattens nested
+ * if/else diamonds from the inside out.
+ */
+void CMSimdCFLower::ifConvert(CMSimdCFAnalysis *A)
+{
+  if (!IfConvertThreshold)
+    return;
+  std::unique_ptr<OptimizationRemarkEmitter> ORE;
+  if (A->WantRemarks)
+    ORE.reset(new OptimizationRemarkEmitter(F, nullptr));
+  for (bool Changed = true; Changed;) {
+    Changed = false;
+    SmallVector<BasicBlock *, 8> Branches;
+    for (auto sbi = SimdBranches.begin(), sbe = SimdBranches.end();
+        sbi != sbe; ++sbi)
+      Branches.push_back(sbi->first);
+    for (BasicBlock *BB : Branches)
+      if (SimdBranches.count(BB) && ifConvertBranch(BB, A, ORE.get()))
+        Changed = true;
+  }
+}
+
+/***********************************************************************
+ * ifConvertBranch : flatten the region of one simd branch if it is small
+ *
+ * Enter:   BB = block ending with the simd branch
+ *          A = analysis result, whose record of the blocks controlled by
+ *              each simd branch is updated for the blocks removed
+ *          ORE = remark emitter, or nullptr if remarks are not wanted
+ *
+ * Return:  whether the region was flattened
+ *
+ * The region must be a triangle or diamond: each leg has BB as its only
+ * predecessor and goes straight to the join. The code in the legs must be
+ * safe to run in every channel, apart from stores of the simd width. It
+ * is moved up into BB, and each store is predicated on the branch
+ * condition by a load and select. As that loads and stores in every
+ * channel, the address of each store, and of each vload, must be one that
+ * isAlwaysAccessible accepts. A phi in the join becomes a select on
+ * the condition, or, if one leg just writes a region of the simd width
+ * into the other leg's value, that wrregion is predicated on the
+ * condition. The cost is the number of instructions that results, and it
+ * must be at most -cmsimdcf-ifconvert-threshold.
+ *
+ * A branch that the profile says diverges rarely is left alone, as then
+ * the goto usually jumps straight over the leg that no channel takes. One
+ * that it says diverges often runs both legs anyway most of the time, so
+ * it may be flattened at up to twice the threshold.
+ */
+bool CMSimdCFLower::ifConvertBranch(BasicBlock *BB, CMSimdCFAnalysis *A,
+    OptimizationRemarkEmitter *ORE)
+{
+  auto Br = dyn_cast<BranchInst>(BB->getTerminator());
+  if (!Br || !Br->isConditional() || isRarelyDivergent(Br))
+    return false;
+  Use *CondUse = getSimdConditionUse(Br->getCondition());
+  if (!CondUse)
+    return false;
+  Value *Cond = *CondUse;
+  unsigned SimdWidth = SimdBranches[BB];
+  if (cast<VectorType>(Cond->getType())->getNumElements() != SimdWidth)
+    return false;
+  // Find the legs, true then false, and the join. A missing leg is where
+  // the branch goes straight to the join.
+  BasicBlock *Legs[2] = { Br->getSuccessor(0), Br->getSuccessor(1) };
+  auto getLegSucc = [BB](BasicBlock *Leg) -> BasicBlock * {
+    auto LegBr = dyn_cast<BranchInst>(Leg->getTerminator());
+    if (Leg == BB || Leg->getSinglePredecessor() != BB || !LegBr ||
+        LegBr->isConditional())
+      return nullptr;
+    return LegBr->getSuccessor(0);
+  };
+  BasicBlock *Join = nullptr;
+  BasicBlock *TrueSucc = getLegSucc(Legs[0]);
+  BasicBlock *FalseSucc = getLegSucc(Legs[1]);
+  if (Legs[0] == Legs[1])
+    return false;
+  if (TrueSucc && TrueSucc == FalseSucc)
+    Join = TrueSucc;
+  else if (TrueSucc == Legs[1]) {
+    Join = Legs[1];
+    Legs[1] = nullptr;
+  } else if (FalseSucc == Legs[0]) {
+    Join = Legs[0];
+    Legs[0] = nullptr;
+  } else
+    return false;
+  if (Join == BB)
+    return false;
+  // Check the code in the legs.
+  const DataLayout &DL = F->getParent()->getDataLayout();
+  unsigned Cost = 0;
+  for (BasicBlock *Leg : Legs) {
+    if (!Leg)
+      continue;
+    // A load from an address that the leg stores to is safe, as the store
+    // gets predicated by a load from there anyway. That includes the load
+    // of a store already predicated by flattening an inner region.
+    SmallPtrSet<Value *, 4> StoreAddrs;
+    for (auto bi = Leg->begin(), be = Leg->end(); bi != be; ++bi)
+      if (isa<StoreInst>(&*bi) || GenXIntrinsic::isVStore(&*bi))
+        StoreAddrs.insert(bi->getOperand(1));
+    for (auto bi = Leg->begin(), be = Leg->end(); bi != be; ++bi) {
+      Instruction *Inst = &*bi;
+      if (Inst->isTerminator() || isa<DbgInfoIntrinsic>(Inst))
+        continue;
+      ++Cost;
+      if (isa<StoreInst>(Inst) || GenXIntrinsic::isVStore(Inst)) {
+        auto VT = dyn_cast<VectorType>(Inst->getOperand(0)->getType());
+        if (!VT || VT->getNumElements() != SimdWidth)
+          return false;
+        if (auto SI = dyn_cast<StoreInst>(Inst))
+          if (!SI->isSimple())
+            return false;
+        if (!isAlwaysAccessible(Inst->getOperand(1), VT, DL))
+          return false;
+        // It needs a load and a select too.
+        Cost += 2;
+        continue;
+      }
+      if (isa<PHINode>(Inst))
+        return false;
+      if (GenXIntrinsic::isVLoad(Inst)) {
+        if (!isAlwaysAccessible(Inst->getOperand(0), Inst->getType(), DL))
+          return false;
+        continue;
+      }
+      if (auto LI = dyn_cast<LoadInst>(Inst))
+        if (LI->isSimple() && StoreAddrs.count(LI->getPointerOperand()))
+          continue;
+      if (GenXIntrinsic::isGenXIntrinsic(Inst) &&
+          cast<CallInst>(Inst)->doesNotAccessMemory())
+        continue;
+      if (!isSafeToSpeculativelyExecute(Inst))
+        return false;
+    }
+  }
+  // Check the phis in the join. For each one, find the leg (if any) with a
+  // wrregion to predicate instead of using a select.
+  BasicBlock *From[2] = { Legs[0] ? Legs[0] : BB, Legs[1] ? Legs[1] : BB };
+  SmallVector<std::pair<PHINode *, int>, 4> Phis;
+  for (auto bi = Join->begin(); auto Phi = dyn_cast<PHINode>(&*bi); ++bi) {
+    Value *Vals[2] = { Phi->getIncomingValueForBlock(From[0]),
+                       Phi->getIncomingValueForBlock(From[1]) };
+    int WrRLeg = -1;
+    if (Vals[0] != Vals[1]) {
+      auto VT = dyn_cast<VectorType>(Phi->getType());
+      if (!VT || VT->getNumElements() != SimdWidth) {
+        for (unsigned k = 0; k != 2; ++k) {
+          auto WrR = dyn_cast<CallInst>(Vals[k]);
+          if (!WrR || !Legs[k] || WrR->getParent() != Legs[k] ||
+              !WrR->hasOneUse() || !GenXIntrinsic::isWrRegion(WrR) ||
+              WrR->getArgOperand(GenXIntrinsic::GenXRegion::OldValueOperandNum)
+                  != Vals[1 - k])
+            continue;
+          auto NewVT = dyn_cast<VectorType>(WrR->getArgOperand(
+              GenXIntrinsic::GenXRegion::NewValueOperandNum)->getType());
+          if (NewVT && NewVT->getNumElements() == SimdWidth)
+            WrRLeg = k;
+        }
+        if (WrRLeg < 0)
+          return false;
+      }
+      ++Cost;
+    }
+    Phis.push_back(std::make_pair(Phi, WrRLeg));
+  }
+  unsigned Threshold = IfConvertThreshold;
+  if (isOftenDivergent(Br))
+    Threshold *= 2;
+  if (Cost > Threshold)
+    return false;
+  LLVM_DEBUG(dbgs() << "if-converting simd branch at " << BB->getName()
+                    << ", cost " << Cost << "\n");
+  if (ORE) {
+    using namespace ore;
+    OptimizationRemark R(DEBUG_TYPE, "IfConverted", Br);
+    R << "SIMD branch flattened into " << NV("Cost", Cost)
+      << " instructions of predicated code";
+    ORE->emit(R);
+  }
+  // Move the code of the legs up to the branch, predicating the stores.
+  Value *NotCond = nullptr;
+  auto getNotCond = [&]() {
+    if (!NotCond)
+      NotCond = BinaryOperator::Create(Instruction::Xor, Cond,
+          Constant::getAllOnesValue(Cond->getType()),
+          Cond->getName() + ".not", Br);
+    return NotCond;
+  };
+  for (unsigned k = 0; k != 2; ++k) {
+    BasicBlock *Leg = Legs[k];
+    if (!Leg)
+      continue;
+    while (!Leg->front().isTerminator()) {
+      Instruction *Inst = &Leg->front();
+      Inst->moveBefore(Br);
+      if (!isa<StoreInst>(Inst) && !GenXIntrinsic::isVStore(Inst))
+        continue;
+      Value *Addr = Inst->getOperand(1);
+      Instruction *Load = nullptr;
+      if (isa<StoreInst>(Inst))
+        Load = new LoadInst(Addr->getType()->getPointerElementType(), Addr,
+                            Addr->getName() + ".ifcvt.load", Inst);
+      else {
+        Type *Tys[] = { Addr->getType()->getPointerElementType(),
+                        Addr->getType() };
+        auto Fn = GenXIntrinsic::getGenXDeclaration(F->getParent(),
+            GenXIntrinsic::genx_vload, Tys);
+        Load = CallInst::Create(Fn, Addr, ".ifcvt.vload", Inst);
+      }
+      Load->setDebugLoc(Inst->getDebugLoc());
+      Value *V = Inst->getOperand(0);
+      auto Select = SelectInst::Create(Cond, k ? Load : V, k ? V : Load,
+          V->getName() + ".ifcvt", Inst);
+      Select->setDebugLoc(Inst->getDebugLoc());
+      Inst->setOperand(0, Select);
+    }
+  }
+  // Replace the phis' values from the region.
+  for (auto &Entry : Phis) {
+    PHINode *Phi = Entry.first;
+    Value *Vals[2] = { Phi->getIncomingValueForBlock(From[0]),
+                       Phi->getIncomingValueForBlock(From[1]) };
+    Value *NewVal = Vals[0];
+    if (Entry.second >= 0) {
+      unsigned k = Entry.second;
+      auto WrR = cast<CallInst>(Vals[k]);
+      SmallVector<Value *, 8> Args(WrR->arg_begin(), WrR->arg_end());
+      Value *Pred = Args[GenXIntrinsic::GenXRegion::PredicateOperandNum];
+      Value *LegCond = k ? getNotCond() : Cond;
+      if (auto C = dyn_cast<Constant>(Pred))
+        if (C->isAllOnesValue())
+          Pred = nullptr;
+      if (!Pred)
+        Pred = LegCond;
+      else {
+        auto And = BinaryOperator::Create(Instruction::And, Pred, LegCond,
+            Pred->getName() + ".and." + LegCond->getName(), WrR);
+        And->setDebugLoc(WrR->getDebugLoc());
+        Pred = And;
+      }
+      Args[GenXIntrinsic::GenXRegion::PredicateOperandNum] = Pred;
+      NewVal = createWrRegion(Args, WrR->getName(), WrR);
+      WrR->replaceAllUsesWith(NewVal);
+      NewVal->takeName(WrR);
+      WrR->eraseFromParent();
+    } else if (Vals[0] != Vals[1]) {
+      auto Select = SelectInst::Create(Cond, Vals[0], Vals[1],
+          Phi->getName() + ".ifcvt", Br);
+      Select->setDebugLoc(Br->getDebugLoc());
+      NewVal = Select;
+    }
+    for (BasicBlock *Pred : From)
+      if (Phi->getBasicBlockIndex(Pred) >= 0)
+        Phi->removeIncomingValue(Pred, /*DeletePHIIfEmpty=*/false);
+    Phi->addIncoming(NewVal, BB);
+  }
+  // Removed blocks must not stay in the record used for the remarks, as a
+  // block created later may reuse the memory.
+  auto forgetBlock = [A](BasicBlock *Gone) {
+    for (auto &Entry : A->ControlledBlocks) {
+      auto &Deps = Entry.second;
+      Deps.erase(std::remove(Deps.begin(), Deps.end(), Gone), Deps.end());
+    }
+  };
+  // Replace the branch, and remove the legs.
+  auto NewBr = BranchInst::Create(Join, Br);
+  NewBr->setDebugLoc(Br->getDebugLoc());
+  auto Any = dyn_cast<Instruction>(Br->getCondition());
+  A->ControlledBlocks.erase(Br);
+  Br->eraseFromParent();
+  if (Any && Any->use_empty())
+    Any->eraseFromParent();
+  SimdBranches.erase(BB);
+  for (BasicBlock *Leg : Legs) {
+    if (!Leg)
+      continue;
+    SimdBranches.erase(Leg);
+    PredicatedBlocks.erase(Leg);
+    forgetBlock(Leg);
+    Leg->eraseFromParent();
+  }
+  ++NumIfConverted;
+  // Merge the join into BB if nothing else reaches it and it is predicated
+  // the same, so that the region around can be flattened in turn. The merge
+  // may be refused, for example if the join's address is taken, and then
+  // the join keeps its entries.
+  if (Join->getSinglePredecessor() == BB &&
+      PredicatedBlocks.count(BB) == PredicatedBlocks.count(Join) &&
+      PredicatedBlocks.lookup(BB) == PredicatedBlocks.lookup(Join)) {
+    auto JoinBranch = SimdBranches.find(Join);
+    unsigned JoinWidth = JoinBranch == SimdBranches.end()
+        ? 0 : JoinBranch->second;
+    if (MergeBlockIntoPredecessor(Join)) {
+      SimdBranches.erase(Join);
+      PredicatedBlocks.erase(Join);
+      forgetBlock(Join);
+      if (JoinWidth)
+        SimdBranches[BB] = JoinWidth;
+    }
+  }
+  return true;
+}
+
 /***********************************************************************
  * predicateInst : add predication to an Instruction if necessary
  *
@@ -1038,6 +2893,7 @@ static CallInst *createWrRegion(ArrayRef<Value *> Args, const Twine &Name,
  */
 void CMSimdCFLower::predicateInst(Instruction *Inst, unsigned SimdWidth) {
   if (isa<StoreInst>(Inst) || GenXIntrinsic::isVStore(Inst)) {
+    countPredication(Inst, /*IsStore=*/true);
     predicateStore(Inst, SimdWidth);
     return;
   }
@@ -1069,12 +2925,14 @@ void CMSimdCFLower::predicateInst(Instruction *Inst, unsigned SimdWidth) {
         return;
 
       case GenXIntrinsic::genx_simdcf_predicate:
+        countPredication(CI, /*IsStore=*/false);
         rewritePredication(CI, SimdWidth);
         return;
       case GenXIntrinsic::genx_raw_send:
       case GenXIntrinsic::genx_raw_send_noresult:
       case GenXIntrinsic::genx_raw_sends:
       case GenXIntrinsic::genx_raw_sends_noresult:
+        countPredication(CI, /*IsStore=*/false);
         predicateSend(CI, IntrinsicID, SimdWidth);
         return;
       case GenXIntrinsic::not_any_intrinsic:
@@ -1083,6 +2941,7 @@ void CMSimdCFLower::predicateInst(Instruction *Inst, unsigned SimdWidth) {
         // conservatively allow everything for now.
         if (!Callee || (!Callee->hasFnAttribute("CMGenxSIMT") &&
                         !Callee->hasFnAttribute("CMGenxNoSIMDPred"))) {
+          countPredication(CI, /*IsStore=*/false);
           predicateCall(CI, SimdWidth);
         }
         return;
@@ -1095,13 +2954,25 @@ void CMSimdCFLower::predicateInst(Instruction *Inst, unsigned SimdWidth) {
     if (CI->getMetadata("ISPC-Uniform") != nullptr)
       return;
 
-    // Look for a predicate operand in operand 2, 1 or 0.
+    // Use the predicate operand given in the intrinsic's description.
+    int DescPredNum = GenXIntrinsic::getPredicateOperandNum(IntrinsicID);
+    if (DescPredNum >= 0) {
+      auto VT = dyn_cast<VectorType>(CI->getArgOperand(DescPredNum)->getType());
+      if (VT && VT->getElementType()->isIntegerTy(1)) {
+        countPredication(CI, /*IsStore=*/false);
+        predicateScatterGather(CI, SimdWidth, DescPredNum);
+        return;
+      }
+    }
+
+    // Otherwise look for a predicate operand, starting from the last one.
     unsigned PredNum = CI->getNumArgOperands() - 1;
     for (;;) {
       if (auto VT = dyn_cast<VectorType>(CI->getArgOperand(PredNum)->getType()))
       {
         if (VT->getElementType()->isIntegerTy(1)) {
           // We have a predicate operand.
+          countPredication(CI, /*IsStore=*/false);
           predicateScatterGather(CI, SimdWidth, PredNum);
           return;
         }
@@ -1115,6 +2986,98 @@ void CMSimdCFLower::predicateInst(Instruction *Inst, unsigned SimdWidth) {
   }
 }
 
+/***********************************************************************
+ * countPredication : count an instruction being predicated, for the remarks
+ *
+ * Enter:   Inst = instruction about to be predicated
+ *          IsStore = whether it is a store
+ *
+ * Nothing is counted where EM is all ones, as the predication is skipped.
+ */
+void CMSimdCFLower::countPredication(Instruction *Inst, bool IsStore)
+{
+  if (!CountPredication || EMAllOnes)
+    return;
+  auto &Counts = PredicationCounts[Inst->getParent()];
+  ++Counts.first;
+  Counts.second += IsStore;
+}
+
+/***********************************************************************
+ * emitRemarks : emit an optimization remark for each simd branch and join
+ *
+ * Enter:   A = analysis result, with the blocks each branch controls
+ *          Branches = the simd branches before any was un-simded, with
+ *              their widths
+ *
+ * This is called after predication and before the control flow is lowered,
+ * so the branches are still there to give the location. A branch that is
+ * still simd gets an analysis remark with the cost of predicating the
+ * blocks it controls, and one that was un-simded gets a remark saying so.
+ */
+void CMSimdCFLower::emitRemarks(CMSimdCFAnalysis *A,
+    ArrayRef<std::pair<Instruction *, unsigned>> Branches)
+{
+  using namespace ore;
+  OptimizationRemarkEmitter ORE(F, nullptr);
+  for (auto &Entry : Branches) {
+    auto Br = cast<BranchInst>(Entry.first);
+    BasicBlock *BB = Br->getParent();
+    unsigned NumInsts = 0, NumStores = 0;
+    auto It = A->ControlledBlocks.find(Br);
+    if (It != A->ControlledBlocks.end()) {
+      for (BasicBlock *Dep : It->second) {
+        // The code of a join point was split out to another block.
+        for (BasicBlock *Part : { Dep, SplitJoins.lookup(Dep) }) {
+          auto Counts = PredicationCounts.lookup(Part);
+          NumInsts += Counts.first;
+          NumStores += Counts.second;
+        }
+      }
+    }
+    bool Unsimded = !SimdBranches.count(BB);
+    BasicBlock *JIP = Unsimded ? nullptr : JIPs[BB];
+    bool NeedsJIP = JIP && JIP != Br->getSuccessor(0);
+    auto P = getProfile(Br);
+    auto addDetails = [&](DiagnosticInfoOptimizationBase &R) {
+      R << "SIMD branch of width " << NV("SimdWidth", Entry.second)
+        << " predicates " << NV("PredicatedInstructions", NumInsts)
+        << " instructions including " << NV("PredicatedStores", NumStores)
+        << " stores; needs JIP: " << NV("NeedsJIP", NeedsJIP)
+        << ", un-simded: " << NV("Unsimded", Unsimded);
+      if (P && P->getTotal())
+        R << "; divergent in "
+          << NV("DivergentPercent",
+                unsigned(P->Divergent * 100 / P->getTotal()))
+          << "% of executions";
+    };
+    if (Unsimded) {
+      OptimizationRemark R(DEBUG_TYPE, "UnsimdedBranch", Br);
+      addDetails(R);
+      ORE.emit(R);
+    } else {
+      OptimizationRemarkAnalysis R(DEBUG_TYPE, "SimdBranch", Br);
+      addDetails(R);
+      ORE.emit(R);
+    }
+  }
+  for (auto jpi = JoinPoints.begin(), jpe = JoinPoints.end();
+      jpi != jpe; ++jpi) {
+    BasicBlock *JP = jpi->first;
+    // The join's location is that of the first code after it.
+    DebugLoc DL;
+    if (BasicBlock *Code = SplitJoins.lookup(JP))
+      for (auto bi = Code->begin(), be = Code->end(); bi != be && !DL; ++bi)
+        DL = bi->getDebugLoc();
+    auto It = JIPs.find(JP);
+    bool NeedsJIP = It != JIPs.end() && It->second;
+    OptimizationRemarkAnalysis R(DEBUG_TYPE, "Join", DL, JP);
+    R << "join of width " << NV("SimdWidth", jpi->second)
+      << "; needs JIP: " << NV("NeedsJIP", NeedsJIP);
+    ORE.emit(R);
+  }
+}
+
 /***********************************************************************
  * rewritePredication : convert a predication intrinsic call into a
  * selection based on the region's SIMD predicate mask.
@@ -1135,6 +3098,13 @@ void CMSimdCFLower::rewritePredication(CallInst *CI, unsigned SimdWidth)
     DiagnosticInfoSimdCF::emit(CI, "mismatching SIMD width inside SIMD control flow");
     return;
   }
+  if (EMAllOnes) {
+    // All channels are enabled, so the predication is a no-op.
+    ++NumAllOnesSkipped;
+    CI->replaceAllUsesWith(EnabledValues);
+    CI->eraseFromParent();
+    return;
+  }
   auto EM = loadExecutionMask(CI, SimdWidth);
   auto Select = SelectInst::Create(EM, EnabledValues, DisabledDefaults,
       EnabledValues->getName() + ".simdcfpred", CI);
@@ -1275,12 +3245,17 @@ void CMSimdCFLower::predicateStore(Instruction *SI, unsigned SimdWidth)
       assert(false && "unexpected data size inside SIMD control flow");
     }
   }
+  if (WrRegionToPredicate && EMAllOnes) {
+    ++NumAllOnesSkipped;
+    return;
+  }
   if (WrRegionToPredicate) {
     // We found a wrregion to predicate. Replace it with a predicated one.
     assert(UseNeedsUpdate); 
     *UseNeedsUpdate = predicateWrRegion(WrRegionToPredicate, SimdWidth);
     if (WrRegionToPredicate->use_empty())
       WrRegionToPredicate->eraseFromParent();
+    ++NumStoresPredicatedByWrRegion;
     return;
   }
   // Instructions like gather4 have more output than execution size.
@@ -1304,6 +3279,12 @@ void CMSimdCFLower::predicateStore(Instruction *SI, unsigned SimdWidth)
     DiagnosticInfoSimdCF::emit(SI, "mismatching SIMD width inside SIMD control flow");
     return;
   }
+  if (EMAllOnes) {
+    ++NumAllOnesSkipped;
+    return;
+  }
+  if (MaskedStores && predicateStoreByMask(SI, SimdWidth, NumChannels))
+    return;
   // Predicate the store by creating a select.
   Instruction *Load = nullptr;
   if (auto SInst = dyn_cast<StoreInst>(SI)) {
@@ -1324,6 +3305,55 @@ void CMSimdCFLower::predicateStore(Instruction *SI, unsigned SimdWidth)
   auto Select = SelectInst::Create(EM, SI->getOperand(0), Load,
       SI->getOperand(0)->getName() + ".simdcfpred", SI);
   SI->setOperand(0, Select);
+  ++NumStoresPredicatedBySelect;
+}
+
+/***********************************************************************
+ * predicateStoreByMask : predicate a store by changing it to a masked store
+ *
+ * Enter:   SI = the store or vstore, already checked to be the right width
+ *          SimdWidth = simd cf width in force
+ *          NumChannels = number of EM copies needed to cover the value
+ *
+ * Return:  true if the store was changed, false if it is not one that can
+ *          be (a store to something other than an alloca)
+ *
+ * A store to an alloca becomes llvm.masked.store and a vstore becomes
+ * llvm.genx.vstore.masked, so the disabled channels are not read and
+ * written back.
+ */
+bool CMSimdCFLower::predicateStoreByMask(Instruction *SI, unsigned SimdWidth,
+    unsigned NumChannels)
+{
+  Module *M = SI->getModule();
+  Value *V = SI->getOperand(0);
+  CallInst *NewSI = nullptr;
+  if (auto SInst = dyn_cast<StoreInst>(SI)) {
+    Value *Ptr = SInst->getPointerOperand();
+    if (!isa<AllocaInst>(Ptr->stripInBoundsOffsets()))
+      return false;
+    unsigned Align = SInst->getAlignment();
+    if (!Align)
+      Align = M->getDataLayout().getABITypeAlignment(V->getType());
+    auto EM = loadExecutionMask(SI, SimdWidth, NumChannels);
+    Type *Tys[] = { V->getType(), Ptr->getType() };
+    Function *Decl = Intrinsic::getDeclaration(M, Intrinsic::masked_store, Tys);
+    Value *Args[] = { V, Ptr,
+        ConstantInt::get(Type::getInt32Ty(SI->getContext()), Align), EM };
+    NewSI = CallInst::Create(Decl, Args, "", SI);
+  } else {
+    Value *Addr = SI->getOperand(1);
+    auto EM = loadExecutionMask(SI, SimdWidth, NumChannels);
+    Type *Tys[] = { V->getType(), Addr->getType(), EM->getType() };
+    Function *Decl = GenXIntrinsic::getGenXDeclaration(M,
+        GenXIntrinsic::genx_vstore_masked, Tys);
+    Value *Args[] = { V, Addr, EM };
+    NewSI = CallInst::Create(Decl, Args, "", SI);
+  }
+  NewSI->setDebugLoc(SI->getDebugLoc());
+  SI->eraseFromParent();
+  ++NumStoresPredicatedByMask;
+  return true;
 }
 
 /***********************************************************************
@@ -1336,12 +3366,17 @@ void CMSimdCFLower::predicateStore(Instruction *SI, unsigned SimdWidth)
 void CMSimdCFLower::predicateSend(CallInst *CI, unsigned IntrinsicID,
       unsigned SimdWidth)
 {
-  unsigned PredOperandNum = 1;
+  unsigned PredOperandNum = GenXIntrinsic::getPredicateOperandNum(IntrinsicID);
   if (isa<VectorType>(CI->getOperand(PredOperandNum)->getType())) {
     // We already have a vector predicate.
     predicateScatterGather(CI, SimdWidth, PredOperandNum);
     return;
   }
+  if (EMAllOnes) {
+    // Keep the scalar predicate.
+    ++NumAllOnesSkipped;
+    return;
+  }
   IRBuilder<> Builder(CI);
   Builder.SetCurrentDebugLocation(CI->getDebugLoc());
   // Need to convert scalar predicate to vector. We need to get a new intrinsic
@@ -1402,7 +3437,7 @@ void CMSimdCFLower::predicateSend(CallInst *CI, unsigned IntrinsicID,
 /***********************************************************************
  * predicateScatterGather : predicate a scatter/gather intrinsic call
  *
- * This works on the scatter/gather intrinsics with a predicate operand.
+ * This works on any intrinsic with a vector predicate operand.
  */
 void CMSimdCFLower::predicateScatterGather(CallInst *CI, unsigned SimdWidth,
       unsigned PredOperandNum)
@@ -1413,6 +3448,11 @@ void CMSimdCFLower::predicateScatterGather(CallInst *CI, unsigned SimdWidth,
     DiagnosticInfoSimdCF::emit(CI, "mismatching SIMD width of scatter/gather inside SIMD control flow");
     return;
   }
+  if (EMAllOnes) {
+    ++NumAllOnesSkipped;
+    AlreadyPredicated.insert(CI);
+    return;
+  }
   Instruction *NewPred = loadExecutionMask(CI, SimdWidth);
   if (auto C = dyn_cast<Constant>(OldPred))
     if (C->isAllOnesValue())
@@ -1477,9 +3517,18 @@ void CMSimdCFLower::predicateCall(CallInst *CI, unsigned SimdWidth)
   if (CI->getFunction() == F)
     return;
 
-  if (!*PSEntry)
+  // A call with all channels enabled does not make the subroutine
+  // predicated.
+  if (EMAllOnes) {
+    ++NumAllOnesSkipped;
+    return;
+  }
+
+  PredicatedCalls.insert(CI);
+  if (!*PSEntry) {
     *PSEntry = SimdWidth;
-  else if (*PSEntry != SimdWidth)
+    ++NumPredicatedSubroutines;
+  } else if (*PSEntry != SimdWidth)
     DiagnosticInfoSimdCF::emit(CI, "mismatching SIMD width of called subroutine");
 }
 
@@ -1537,9 +3586,24 @@ void CMSimdCFLower::lowerSimdCF()
     // Insert {NewEM,NewRM,BranchCond} = llvm.genx.simdcf.goto(OldEM,OldRM,~Cond)
      // TODO: rewrite everything below using IRBuilder
     unsigned SimdWidth = cast<VectorType>(Cond->getType())->getNumElements();
-    auto NotCond = BinaryOperator::Create(Instruction::Xor, Cond,
-        Constant::getAllOnesValue(Cond->getType()), Cond->getName() + ".not",
-        Br);
+    // If the condition is itself an inversion used only here, as it is for
+    // the latch of a do..while loop after fixSimdBranches has inverted it,
+    // give the goto what it inverts rather than inverting it back.
+    Value *NotCond = nullptr;
+    auto Invert = dyn_cast<BinaryOperator>(Cond);
+    if (CondUse && Invert && Invert->hasOneUse() &&
+        Invert->getOpcode() == Instruction::Xor)
+      if (auto C = dyn_cast<Constant>(Invert->getOperand(1)))
+        if (C->isAllOnesValue())
+          NotCond = Invert->getOperand(0);
+    if (NotCond)
+      ++NumInversionsFolded;
+    else {
+      Invert = nullptr;
+      NotCond = BinaryOperator::Create(Instruction::Xor, Cond,
+          Constant::getAllOnesValue(Cond->getType()), Cond->getName() + ".not",
+          Br);
+    }
     Value *RMAddr = getRMAddr(UIP, SimdWidth);
     Instruction *OldEM = new LoadInst(EMVar->getType()->getPointerElementType(),
                                       EMVar, EMVar->getName(), Br);
@@ -1564,9 +3628,11 @@ void CMSimdCFLower::lowerSimdCF()
     Br->setCondition(BranchCond);
     // Change the branch target to JIP.
     Br->setSuccessor(0, JIP);
-    // Erase the old llvm.genx.simdcf.any.
+    // Erase the old llvm.genx.simdcf.any, and the folded inversion.
     if (OldCond && OldCond->use_empty())
       OldCond->eraseFromParent();
+    if (Invert && Invert->use_empty())
+      Invert->eraseFromParent();
   }
   // Then lower the join points.
   for (auto jpi = JoinPoints.begin(), jpe = JoinPoints.end();
@@ -1599,7 +3665,10 @@ void CMSimdCFLower::lowerSimdCF()
     (new StoreInst(Constant::getNullValue(RM->getType()), RMAddr, InsertBefore))
           ->setDebugLoc(DL);
     BasicBlock *JIP = JIPs[JP];
-    if (JIP) {
+    if (!JIP)
+      ++NumJoinsWithoutJIP;
+    else {
+      ++NumJoinsWithJIP;
       // This join point is in predicated code, so it was separated into its
       // own block. It needs to be turned into a conditional branch to JIP,
       // with the condition from llvm.genx.simdcf.join.
@@ -1616,85 +3685,301 @@ void CMSimdCFLower::lowerSimdCF()
 }
 
 /***********************************************************************
- * lowerUnmaskOps : lower the simd unmask begins and ends
+ * shareRMSlots : give join points whose resume masks are never in use at
+ *    the same time one RM variable
+ *
+ * This runs on the lowered control flow. An RM variable is zero except from
+ * a goto that stores to it up to the join that reads and zeroes it. A
+ * forward dataflow finds which RMs may be non-zero at each point, and two RMs
+ * interfere if one is written (by a goto or a join) where the other may be
+ * non-zero. Each RM is then given the first variable of the same width that
+ * it does not interfere with, and the other allocas and their zero
+ * initializing stores are removed.
  */
-void CMSimdCFLower::lowerUnmaskOps() {
-  std::vector<Instruction *> MaskBegins;
-  std::vector<Instruction *> MaskEnds;
+void CMSimdCFLower::shareRMSlots()
+{
+  // Number the RM variables in block order, so the result is deterministic.
+  SmallVector<AllocaInst *, 16> RMs;
+  DenseMap<Value *, unsigned> RMNums;
   for (auto fi = F->begin(), fe = F->end(); fi != fe; ++fi) {
-    BasicBlock *BB = &*fi;
+    auto It = RMAddrs.find(&*fi);
+    if (It != RMAddrs.end() &&
+        RMNums.insert(std::make_pair(It->second, RMs.size())).second)
+      RMs.push_back(It->second);
+  }
+  if (RMs.size() < 2)
+    return;
+  // Record the writes to RMs in each block, in order: true for a goto
+  // storing a new RM, false for zeroing it.
+  ReversePostOrderTraversal<Function *> RPOT(F);
+  DenseMap<BasicBlock *, unsigned> BlockNums;
+  std::vector<SmallVector<std::pair<unsigned, bool>, 2>> Writes;
+  for (auto BB : RPOT) {
+    BlockNums[BB] = Writes.size();
+    Writes.emplace_back();
     for (auto bi = BB->begin(), be = BB->end(); bi != be; ++bi) {
-      Instruction *Inst = &*bi;
-      // doing the work
-      if (auto CIE = dyn_cast_or_null<CallInst>(Inst)) {
-        if (GenXIntrinsic::getGenXIntrinsicID(CIE) ==
-            GenXIntrinsic::genx_unmask_end) {
-          auto LoadV = dyn_cast<LoadInst>(CIE->getArgOperand(0));
-          assert(LoadV);
-          auto PtrV = dyn_cast<AllocaInst>(LoadV->getPointerOperand());
-          assert(PtrV);
-          StoreInst *StoreV = nullptr;
-          // search uses of PtrV
-          for (auto ui = PtrV->use_begin(), ue = PtrV->use_end(); ui != ue;
-                ++ui) {
-            if (auto SI = dyn_cast<StoreInst>(ui->getUser())) {
-              StoreV = SI;
-              break;
-            }
-          }
-          assert(StoreV);
-          auto CIB = dyn_cast<CallInst>(StoreV->getValueOperand());
-          assert(GenXIntrinsic::getGenXIntrinsicID(CIB) ==
-                  GenXIntrinsic::genx_unmask_begin);
-          MaskBegins.push_back(CIB);
-          MaskEnds.push_back(CIE);
-          // put in genx_simdcf_savemask and genx_simdcf_remask
-          auto DL = cast<CallInst>(CIB)->getDebugLoc();
-          Instruction *OldEM =
-              new LoadInst(EMVar->getType()->getPointerElementType(), EMVar,
-                           EMVar->getName(), CIB);
-          OldEM->setDebugLoc(DL);
-          Type *Tys[] = {OldEM->getType()};
-          auto SavemaskFunc =  GenXIntrinsic::getGenXDeclaration(
-                               BB->getParent()->getParent(),
-                               GenXIntrinsic::genx_simdcf_savemask, Tys);
-          Value *Args[] = {OldEM};
-          auto Savemask = CallInst::Create(SavemaskFunc, Args, "savemask", CIB);
-          Savemask->setDebugLoc(DL);
-          // the use should be the store for savemask
-          CIB->replaceAllUsesWith(Savemask); 
-          Type *Ty1s[] = {OldEM->getType()};
-          auto UnmaskFunc = GenXIntrinsic::getGenXDeclaration(
-              BB->getParent()->getParent(), GenXIntrinsic::genx_simdcf_unmask,
-              Ty1s);
-          Value *Arg1s[] = {Savemask, ConstantInt::get(Savemask->getType(), 0xFFFFFFFF) };
-          auto Unmask = CallInst::Create(UnmaskFunc, Arg1s, "unmask", CIB);
-          Unmask->setDebugLoc(DL);
-          (new StoreInst(Unmask, EMVar, CIB))->setDebugLoc(DL);
-          // put in genx_simdcf_remask
-          DL = CIE->getDebugLoc();
-          OldEM = new LoadInst(EMVar->getType()->getPointerElementType(), EMVar,
-                               EMVar->getName(), CIE);
-          OldEM->setDebugLoc(DL);
-          Type *Ty2s[] = {OldEM->getType()};
-          auto RemaskFunc = GenXIntrinsic::getGenXDeclaration(
-                              BB->getParent()->getParent(),
-                              GenXIntrinsic::genx_simdcf_remask, Ty2s);
-          Value *Arg2s[] = {OldEM, LoadV};
-          auto Remask = CallInst::Create(RemaskFunc, Arg2s, "remask", CIE);
-          Remask->setDebugLoc(DL);
-          (new StoreInst(Remask, EMVar, CIE))->setDebugLoc(DL);
+      auto SI = dyn_cast<StoreInst>(&*bi);
+      if (!SI)
+        continue;
+      auto It = RMNums.find(SI->getPointerOperand());
+      if (It == RMNums.end())
+        continue;
+      auto C = dyn_cast<Constant>(SI->getValueOperand());
+      Writes.back().push_back(
+          std::make_pair(It->second, !C || !C->isNullValue()));
+    }
+  }
+  std::vector<SmallVector<unsigned, 4>> Interferes(RMs.size());
+  auto applyWrites = [&](unsigned BlockNum, SparseBitVector<> *Live,
+                         bool RecordInterference) {
+    for (auto &W : Writes[BlockNum]) {
+      if (RecordInterference) {
+        for (unsigned Other : *Live) {
+          if (Other == W.first)
+            continue;
+          Interferes[W.first].push_back(Other);
+          Interferes[Other].push_back(W.first);
         }
       }
+      if (W.second)
+        Live->set(W.first);
+      else
+        Live->reset(W.first);
+    }
+  };
+  auto getLiveIn = [&](BasicBlock *BB, std::vector<SparseBitVector<>> &LiveOut) {
+    SparseBitVector<> Live;
+    for (auto Pred : predecessors(BB)) {
+      auto It = BlockNums.find(Pred);
+      if (It != BlockNums.end())
+        Live |= LiveOut[It->second];
+    }
+    return Live;
+  };
+  std::vector<SparseBitVector<>> LiveOut(Writes.size());
+  for (bool Changed = true; Changed; ) {
+    Changed = false;
+    for (auto BB : RPOT) {
+      unsigned Num = BlockNums[BB];
+      SparseBitVector<> Live = getLiveIn(BB, LiveOut);
+      applyWrites(Num, &Live, false);
+      if (Live != LiveOut[Num]) {
+        LiveOut[Num] = Live;
+        Changed = true;
+      }
     }
   }
-  // erase Mask Ends
+  for (auto BB : RPOT) {
+    SparseBitVector<> Live = getLiveIn(BB, LiveOut);
+    applyWrites(BlockNums[BB], &Live, true);
+  }
+  // Greedily assign each RM to the first variable of the same width that
+  // none of the RMs already assigned to it interferes with.
+  SmallVector<unsigned, 16> Slots(RMs.size());
+  SmallVector<unsigned, 8> Reps;
+  for (unsigned i = 0, e = RMs.size(); i != e; ++i) {
+    SmallSet<unsigned, 8> Taken;
+    for (unsigned Other : Interferes[i])
+      if (Other < i)
+        Taken.insert(Slots[Other]);
+    Slots[i] = i;
+    for (unsigned Rep : Reps) {
+      if (RMs[Rep]->getAllocatedType() == RMs[i]->getAllocatedType() &&
+          !Taken.count(Rep)) {
+        Slots[i] = Rep;
+        break;
+      }
+    }
+    if (Slots[i] == i)
+      Reps.push_back(i);
+  }
+  if (Reps.size() == RMs.size())
+    return;
+  for (auto i = RMAddrs.begin(), e = RMAddrs.end(); i != e; ++i)
+    i->second = RMs[Slots[RMNums[i->second]]];
+  for (unsigned i = 0, e = RMs.size(); i != e; ++i) {
+    if (Slots[i] == i)
+      continue;
+    AllocaInst *RM = RMs[i];
+    LLVM_DEBUG(dbgs() << RM->getName() << " shares " << RMs[Slots[i]]->getName() << "\n");
+    // Remove the zero initialization; the shared variable has its own.
+    SmallVector<StoreInst *, 2> Inits;
+    for (auto *U : RM->users()) {
+      auto SI = dyn_cast<StoreInst>(U);
+      if (SI && SI->getParent() == &F->front() &&
+          isa<Constant>(SI->getValueOperand()) &&
+          cast<Constant>(SI->getValueOperand())->isNullValue())
+        Inits.push_back(SI);
+    }
+    for (auto SI : Inits)
+      SI->eraseFromParent();
+    RM->replaceAllUsesWith(RMs[Slots[i]]);
+    RM->eraseFromParent();
+    ++NumRMAllocasShared;
+  }
+}
+
+/***********************************************************************
+ * indexUnmaskEnds : record the llvm.genx.unmask.end calls in each function
+ *
+ * This walks the use list of the declaration once per module, so that
+ * lowerUnmaskOps does not need to scan the whole function.
+ */
+void CMSimdCFLower::indexUnmaskEnds(Module *M)
+{
+  UnmaskEndsIndexed = true;
+  for (auto &Decl : *M) {
+    if (GenXIntrinsic::getGenXIntrinsicID(&Decl) !=
+        GenXIntrinsic::genx_unmask_end)
+      continue;
+    for (auto *U : Decl.users())
+      if (auto CIE = dyn_cast<CallInst>(U))
+        UnmaskEnds[CIE->getFunction()].push_back(CIE);
+  }
+  // Use lists are in reverse order of creation; put the calls back in the
+  // order they were created so that the output is stable.
+  for (auto &Ends : UnmaskEnds)
+    std::reverse(Ends.second.begin(), Ends.second.end());
+}
+
+/***********************************************************************
+ * getAvailableEM : see if a load of EM can reuse an earlier EM value
+ *
+ * Enter:   Load = load of EMVar
+ *
+ * Return:  the EM value stored or loaded by an instruction shortly before
+ *          Load in the same basic block, with nothing in between that may
+ *          write EM, else nullptr
+ */
+Value *CMSimdCFLower::getAvailableEM(Instruction *Load)
+{
+  // Only look a short way back, so the cost does not depend on block size.
+  const unsigned MaxScan = 16;
+  unsigned Scanned = 0;
+  for (auto bi = Load->getIterator(), be = Load->getParent()->begin();
+       bi != be && Scanned != MaxScan; ++Scanned) {
+    Instruction *Inst = &*--bi;
+    if (auto SI = dyn_cast<StoreInst>(Inst)) {
+      Value *Ptr = SI->getPointerOperand()->stripPointerCasts();
+      if (Ptr == EMVar)
+        return SI->getValueOperand();
+      // A store to a local or another global cannot change EM.
+      if (isa<AllocaInst>(Ptr) || isa<GlobalVariable>(Ptr))
+        continue;
+      return nullptr;
+    }
+    if (auto LI = dyn_cast<LoadInst>(Inst))
+      if (LI->getPointerOperand() == EMVar)
+        return LI;
+    if (Inst->mayWriteToMemory())
+      return nullptr;
+  }
+  return nullptr;
+}
+
+/***********************************************************************
+ * lowerUnmaskOps : lower the simd unmask begins and ends
+ *
+ * The unmask ends of F come from the per-module index. Each end finds its
+ * begin through the temp that holds the saved mask:
+ *
+ *    %t = call i32 @llvm.genx.unmask.begin()
+ *    store i32 %t, i32* %tmp
+ *    ...
+ *    %l = load i32, i32* %tmp
+ *    call void @llvm.genx.unmask.end(i32 %l)
+ *
+ * A begin shared by several ends is only lowered once. Once the whole
+ * function is lowered, an EM load that directly follows an EM store or load
+ * reuses that value.
+ */
+void CMSimdCFLower::lowerUnmaskOps() {
+  if (!UnmaskEndsIndexed)
+    indexUnmaskEnds(F->getParent());
+  auto It = UnmaskEnds.find(F);
+  if (It == UnmaskEnds.end())
+    return;
+  SmallVector<CallInst *, 4> MaskEnds = std::move(It->second);
+  UnmaskEnds.erase(It);
+  SmallPtrSet<CallInst *, 4> MaskBegins;
+  SmallVector<Instruction *, 8> EMLoads;
+  Module *M = F->getParent();
+  Type *EMTy = EMVar->getType()->getPointerElementType();
+  Type *Tys[] = {EMTy};
+  auto SavemaskFunc = GenXIntrinsic::getGenXDeclaration(
+      M, GenXIntrinsic::genx_simdcf_savemask, Tys);
+  auto UnmaskFunc = GenXIntrinsic::getGenXDeclaration(
+      M, GenXIntrinsic::genx_simdcf_unmask, Tys);
+  auto RemaskFunc = GenXIntrinsic::getGenXDeclaration(
+      M, GenXIntrinsic::genx_simdcf_remask, Tys);
+  // Pair each end with its begin before lowering any of them, as lowering a
+  // begin replaces it in the store that the other ends find it through.
+  SmallVector<std::pair<CallInst *, CallInst *>, 4> Pairs;
   for (auto CIE : MaskEnds) {
-    CIE->eraseFromParent();
+    auto LoadV = dyn_cast<LoadInst>(CIE->getArgOperand(0));
+    assert(LoadV);
+    auto PtrV = dyn_cast<AllocaInst>(LoadV->getPointerOperand());
+    assert(PtrV);
+    CallInst *CIB = nullptr;
+    for (auto *U : PtrV->users()) {
+      if (auto SI = dyn_cast<StoreInst>(U)) {
+        CIB = dyn_cast<CallInst>(SI->getValueOperand());
+        break;
+      }
+    }
+    assert(CIB && GenXIntrinsic::getGenXIntrinsicID(CIB) ==
+                      GenXIntrinsic::genx_unmask_begin);
+    Pairs.push_back(std::make_pair(CIB, CIE));
+  }
+  for (auto &Pair : Pairs) {
+    CallInst *CIB = Pair.first;
+    CallInst *CIE = Pair.second;
+    auto LoadV = cast<LoadInst>(CIE->getArgOperand(0));
+    if (MaskBegins.insert(CIB).second) {
+      ++NumUnmaskPairs;
+      // The saved mask is an i32, so it cannot hold a wider EM.
+      if (MaxWidth > MAX_SIMD_CF_WIDTH)
+        DiagnosticInfoSimdCF::emit(
+            CIB, "unmask is not supported with an execution mask wider "
+                 "than 32 channels");
+      // put in genx_simdcf_savemask and genx_simdcf_unmask
+      auto DL = CIB->getDebugLoc();
+      auto OldEM = new LoadInst(EMTy, EMVar, EMVar->getName(), CIB);
+      OldEM->setDebugLoc(DL);
+      EMLoads.push_back(OldEM);
+      Value *Args[] = {OldEM};
+      auto Savemask = CallInst::Create(SavemaskFunc, Args, "savemask", CIB);
+      Savemask->setDebugLoc(DL);
+      // the use should be the store for savemask
+      CIB->replaceAllUsesWith(Savemask);
+      Value *Arg1s[] = {Savemask,
+                        Constant::getAllOnesValue(Savemask->getType())};
+      auto Unmask = CallInst::Create(UnmaskFunc, Arg1s, "unmask", CIB);
+      Unmask->setDebugLoc(DL);
+      (new StoreInst(Unmask, EMVar, CIB))->setDebugLoc(DL);
+    }
+    // put in genx_simdcf_remask
+    auto DL = CIE->getDebugLoc();
+    auto OldEM = new LoadInst(EMTy, EMVar, EMVar->getName(), CIE);
+    OldEM->setDebugLoc(DL);
+    EMLoads.push_back(OldEM);
+    Value *Arg2s[] = {OldEM, LoadV};
+    auto Remask = CallInst::Create(RemaskFunc, Arg2s, "remask", CIE);
+    Remask->setDebugLoc(DL);
+    (new StoreInst(Remask, EMVar, CIE))->setDebugLoc(DL);
   }
+  // erase Mask Ends
+  for (auto CIE : MaskEnds)
+    CIE->eraseFromParent();
   // erase Mask Begins
-  for (auto CIB : MaskBegins) {
+  for (auto CIB : MaskBegins)
     CIB->eraseFromParent();
+  // Reuse an EM value that is already available for each EM load we added.
+  for (auto OldEM : EMLoads) {
+    if (auto EM = getAvailableEM(OldEM)) {
+      OldEM->replaceAllUsesWith(EM);
+      OldEM->eraseFromParent();
+    }
   }
 }
 
@@ -1725,19 +4010,41 @@ CallInst *CMSimdCFLower::isSimdCFAny(Value *V)
 
 /***********************************************************************
  * loadExecutionMask : create instruction to load EM
+ *
+ * When inserting before the instruction being predicated, this reuses an EM
+ * value (or slice of EM) already loaded in the same block, if nothing that
+ * may change EM comes in between.
  */
 Instruction *CMSimdCFLower::loadExecutionMask(Instruction *InsertBefore,
     unsigned SimdWidth, unsigned NumChannels)
 {
-  Instruction *EM = new LoadInst(EMVar->getType()->getPointerElementType(),
-                                 EMVar, EMVar->getName(), InsertBefore);
-  EM->setDebugLoc(InsertBefore->getDebugLoc());
-  // If the simd width is not MAX_SIMD_CF_WIDTH, extract the part of EM we want.
-  if (NumChannels == 1 && SimdWidth == MAX_SIMD_CF_WIDTH)
+  bool UseCache = InsertBefore == EMCacheInst;
+  if (UseCache) {
+    auto It = EMCache.find(std::make_pair(SimdWidth, NumChannels));
+    if (It != EMCache.end()) {
+      ++NumEMReuses;
+      return It->second;
+    }
+  }
+  Instruction *EM = nullptr;
+  auto FullKey = std::make_pair(MaxWidth, 1U);
+  if (UseCache && EMCache.count(FullKey))
+    EM = EMCache[FullKey];
+  else {
+    EM = new LoadInst(EMVar->getType()->getPointerElementType(), EMVar,
+                      EMVar->getName(), InsertBefore);
+    EM->setDebugLoc(InsertBefore->getDebugLoc());
+    ++NumEMLoads;
+    if (UseCache)
+      EMCache[FullKey] = EM;
+  }
+  // If the simd width is not the EM width, extract the part of EM we want.
+  if (NumChannels == 1 && SimdWidth == MaxWidth)
     return EM;
+  ++NumEMShuffles;
   if (ShuffleMask.empty()) {
     auto I32Ty = Type::getInt32Ty(F->getContext());
-    for (unsigned i = 0; i != 32; ++i)
+    for (unsigned i = 0; i != MaxWidth; ++i)
       ShuffleMask.push_back(ConstantInt::get(I32Ty, i));
   }
   if (NumChannels == 1) {
@@ -1755,6 +4062,8 @@ Instruction *CMSimdCFLower::loadExecutionMask(Instruction *InsertBefore,
         Twine("ChannelEM") + Twine(SimdWidth), InsertBefore);
   }
   EM->setDebugLoc(InsertBefore->getDebugLoc());
+  if (UseCache)
+    EMCache[std::make_pair(SimdWidth, NumChannels)] = EM;
   return EM;
 }
 
@@ -1781,6 +4090,7 @@ Value *CMSimdCFLower::getRMAddr(BasicBlock *JP, unsigned SimdWidth)
                              Twine("RM.") + JP->getName(), InsertBefore);
     // Initialize to all zeros.
     new StoreInst(Constant::getNullValue(RMTy), *RMAddr, InsertBefore);
+    ++NumRMAllocas;
   }
   assert(!SimdWidth ||
          cast<VectorType>((*RMAddr)->getType()->getPointerElementType())
@@ -1788,6 +4098,77 @@ Value *CMSimdCFLower::getRMAddr(BasicBlock *JP, unsigned SimdWidth)
   return *RMAddr;
 }
 
+/***********************************************************************
+ * promoteMasks : turn EM and the RM variables into SSA values
+ *
+ * The EM global is replaced within F by a local variable, loaded from the
+ * global on entry and after each call, and stored back to the global before
+ * each call and return (other than the return from a kernel, where EM is
+ * dead). Then the local EM and the RM variables are promoted to registers,
+ * giving phi nodes at the joins and loop headers, so later passes do not
+ * need to promote them.
+ */
+void CMSimdCFLower::promoteMasks()
+{
+  Type *EMTy = EMVar->getType()->getPointerElementType();
+  Instruction *EntryInsert = &*F->front().getFirstInsertionPt();
+  auto EMAddr = new AllocaInst(EMTy, /*AddrSpace*/ 0, "EM.local",
+                               &F->front().front());
+  auto loadGlobalEM = [&](Instruction *InsertBefore) {
+    auto EM = new LoadInst(EMTy, EMVar, EMVar->getName(), InsertBefore);
+    new StoreInst(EM, EMAddr, InsertBefore);
+  };
+  SmallVector<StoreInst *, 4> GlobalStores;
+  auto storeGlobalEM = [&](Instruction *InsertBefore) {
+    auto EM = new LoadInst(EMTy, EMAddr, EMVar->getName(), InsertBefore);
+    GlobalStores.push_back(new StoreInst(EM, EMVar, InsertBefore));
+  };
+  bool IsKernel = F->hasFnAttribute(genx::FunctionMD::CMGenXMain);
+  SmallVector<Instruction *, 4> Calls;
+  SmallVector<Instruction *, 4> Returns;
+  for (auto &Inst : instructions(F)) {
+    if (auto LI = dyn_cast<LoadInst>(&Inst)) {
+      if (LI->getPointerOperand() == EMVar)
+        LI->setOperand(LI->getPointerOperandIndex(), EMAddr);
+    } else if (auto SI = dyn_cast<StoreInst>(&Inst)) {
+      if (SI->getPointerOperand() == EMVar)
+        SI->setOperand(SI->getPointerOperandIndex(), EMAddr);
+    } else if (isa<CallInst>(&Inst)) {
+      if (GenXIntrinsic::getAnyIntrinsicID(&Inst) ==
+              GenXIntrinsic::not_any_intrinsic &&
+          !cast<CallInst>(&Inst)->isInlineAsm())
+        Calls.push_back(&Inst);
+    } else if (isa<ReturnInst>(&Inst) && !IsKernel)
+      Returns.push_back(&Inst);
+  }
+  loadGlobalEM(EntryInsert);
+  for (auto CI : Calls) {
+    storeGlobalEM(CI);
+    loadGlobalEM(CI->getNextNode());
+  }
+  for (auto RI : Returns)
+    storeGlobalEM(RI);
+  // Promote the local EM and the RMs.
+  SmallVector<AllocaInst *, 8> Allocas;
+  Allocas.push_back(EMAddr);
+  SmallPtrSet<AllocaInst *, 8> SeenRMs;
+  for (auto i = RMAddrs.begin(), e = RMAddrs.end(); i != e; ++i)
+    if (SeenRMs.insert(i->second).second && isAllocaPromotable(i->second))
+      Allocas.push_back(i->second);
+  DominatorTree DT(*F);
+  PromoteMemToReg(Allocas, DT);
+  // Remove a store back to the global of the value just loaded from it,
+  // as happens for a return straight after a call.
+  for (auto SI : GlobalStores) {
+    auto LI = dyn_cast<LoadInst>(SI->getValueOperand());
+    if (LI && LI->getPointerOperand() == EMVar && LI->getNextNode() == SI) {
+      SI->eraseFromParent();
+      if (LI->use_empty())
+        LI->eraseFromParent();
+    }
+  }
+}
+
 /***********************************************************************
  * DiagnosticInfoSimdCF::emit : emit an error or warning
  */
@@ -0,0 +1,35 @@
+; RUN: opt -analyze -GenXControlDependence < %s | FileCheck %s
+
+declare i1 @llvm.genx.simdcf.any.v16i1(<16 x i1>)
+declare i1 @llvm.genx.simdcf.any.v8i1(<8 x i1>)
+
+; CHECK-LABEL: GenX control dependence for function 'test':
+; CHECK-NEXT: then: entry(simd16)
+; CHECK-NEXT: inner: then
+; CHECK-NEXT: else: entry(simd16)
+; CHECK-NEXT: loop: loop(simd8)
+; CHECK-NOT: :
+define void @test(<16 x i1> %pred16, <8 x i1> %pred8, i1 %cond) {
+entry:
+  %any16 = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %pred16)
+  br i1 %any16, label %then, label %else
+
+then:
+  br i1 %cond, label %inner, label %join
+
+inner:
+  br label %join
+
+else:
+  br label %join
+
+join:
+  br label %loop
+
+loop:
+  %any8 = call i1 @llvm.genx.simdcf.any.v8i1(<8 x i1> %pred8)
+  br i1 %any8, label %loop, label %exit
+
+exit:
+  ret void
+}
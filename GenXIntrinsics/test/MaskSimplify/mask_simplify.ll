@@ -0,0 +1,78 @@
+; RUN: opt -GenXMaskSimplify -S < %s | FileCheck %s
+
+declare i1 @llvm.genx.any.v16i1(<16 x i1>) readnone
+declare i1 @llvm.genx.all.v16i1(<16 x i1>) readnone
+declare <8 x i1> @llvm.genx.rdpredregion.v8i1.v16i1(<16 x i1>, i32) readnone
+declare <4 x i1> @llvm.genx.rdpredregion.v4i1.v8i1(<8 x i1>, i32) readnone
+declare <16 x i1> @llvm.genx.wrpredregion.v16i1.v8i1(<16 x i1>, <8 x i1>, i32) readnone
+declare <16 x i1> @llvm.genx.wrpredpredregion.v16i1.v8i1(<16 x i1>, <8 x i1>, i32, <16 x i1>) readnone
+declare <32 x i1> @llvm.genx.simdcf.get.em.v32i1(<32 x i1>)
+declare void @use(<16 x i1>)
+
+; CHECK-LABEL: define i1 @any_all_const(
+; CHECK-NEXT: ret i1 true
+define i1 @any_all_const() {
+  %any = call i1 @llvm.genx.any.v16i1(<16 x i1> <i1 false, i1 false, i1 false, i1 false, i1 false, i1 false, i1 false, i1 false, i1 false, i1 false, i1 false, i1 false, i1 false, i1 false, i1 false, i1 true>)
+  %all = call i1 @llvm.genx.all.v16i1(<16 x i1> <i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 false>)
+  %notall = xor i1 %all, true
+  %r = and i1 %any, %notall
+  ret i1 %r
+}
+
+; any(~x) is ~all(x), with no vector negation left.
+; CHECK-LABEL: define i1 @any_not(
+; CHECK-NEXT: %any.inv = call i1 @llvm.genx.all.v16i1(<16 x i1> %x)
+; CHECK-NEXT: %any = xor i1 %any.inv, true
+; CHECK-NEXT: ret i1 %any
+define i1 @any_not(<16 x i1> %x) {
+  %not = xor <16 x i1> %x, <i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true>
+  %any = call i1 @llvm.genx.any.v16i1(<16 x i1> %not)
+  ret i1 %any
+}
+
+; CHECK-LABEL: define <8 x i1> @rd_wr(
+; CHECK-NEXT: %rd2 = call <8 x i1> @llvm.genx.rdpredregion.v8i1.v16i1(<16 x i1> %x, i32 0)
+; CHECK-NEXT: %r = and <8 x i1> %y, %rd2
+; CHECK-NEXT: ret <8 x i1> %r
+define <8 x i1> @rd_wr(<16 x i1> %x, <8 x i1> %y) {
+  %wr = call <16 x i1> @llvm.genx.wrpredregion.v16i1.v8i1(<16 x i1> %x, <8 x i1> %y, i32 8)
+  %rd = call <8 x i1> @llvm.genx.rdpredregion.v8i1.v16i1(<16 x i1> %wr, i32 8)
+  %rd2 = call <8 x i1> @llvm.genx.rdpredregion.v8i1.v16i1(<16 x i1> %wr, i32 0)
+  %r = and <8 x i1> %rd, %rd2
+  ret <8 x i1> %r
+}
+
+; CHECK-LABEL: define <4 x i1> @rd_rd(
+; CHECK-NEXT: %rd2 = call <4 x i1> @llvm.genx.rdpredregion.v4i1.v16i1(<16 x i1> %x, i32 12)
+; CHECK-NEXT: ret <4 x i1> %rd2
+define <4 x i1> @rd_rd(<16 x i1> %x) {
+  %rd = call <8 x i1> @llvm.genx.rdpredregion.v8i1.v16i1(<16 x i1> %x, i32 8)
+  %rd2 = call <4 x i1> @llvm.genx.rdpredregion.v4i1.v8i1(<8 x i1> %rd, i32 4)
+  ret <4 x i1> %rd2
+}
+
+; CHECK-LABEL: define <16 x i1> @wr_rd(
+; CHECK-NEXT: %wrp = call <16 x i1> @llvm.genx.wrpredregion.v16i1.v8i1(<16 x i1> %x, <8 x i1> %y, i32 0)
+; CHECK-NEXT: ret <16 x i1> %wrp
+define <16 x i1> @wr_rd(<16 x i1> %x, <8 x i1> %y) {
+  %rd = call <8 x i1> @llvm.genx.rdpredregion.v8i1.v16i1(<16 x i1> %x, i32 8)
+  %wr = call <16 x i1> @llvm.genx.wrpredregion.v16i1.v8i1(<16 x i1> %x, <8 x i1> %rd, i32 8)
+  %wrp = call <16 x i1> @llvm.genx.wrpredpredregion.v16i1.v8i1(<16 x i1> %wr, <8 x i1> %y, i32 0, <16 x i1> <i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 false, i1 false, i1 false, i1 false, i1 false, i1 false, i1 false, i1 false>)
+  ret <16 x i1> %wrp
+}
+
+; The negated goto condition: the double negation goes, and the negation
+; of the compare becomes the inverse compare. An unused get.em goes too.
+; CHECK-LABEL: define void @goto_cond(
+; CHECK-NEXT: %notc2 = icmp sle <16 x i32> %v, zeroinitializer
+; CHECK-NEXT: call void @use(<16 x i1> %notc2)
+; CHECK-NEXT: ret void
+define void @goto_cond(<16 x i32> %v, <32 x i1> %em) {
+  %c = icmp sgt <16 x i32> %v, zeroinitializer
+  %notc = xor <16 x i1> %c, <i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true>
+  %c2 = xor <16 x i1> <i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true>, %notc
+  %notc2 = xor <16 x i1> %c2, <i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true>
+  %unused = call <32 x i1> @llvm.genx.simdcf.get.em.v32i1(<32 x i1> %em)
+  call void @use(<16 x i1> %notc2)
+  ret void
+}
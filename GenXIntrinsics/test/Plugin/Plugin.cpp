@@ -23,6 +23,8 @@
 ======================= end_copyright_notice ==================================*/
 
 
+#include "llvm/GenXIntrinsics/GenXControlDependence.h"
+#include "llvm/GenXIntrinsics/GenXIntrOpts.h"
 #include "llvm/GenXIntrinsics/GenXSPIRVReaderAdaptor.h"
 #include "llvm/GenXIntrinsics/GenXSPIRVWriterAdaptor.h"
 
@@ -34,8 +36,12 @@ using namespace llvm;
 static int initializePasses() {
   PassRegistry &PR = *PassRegistry::getPassRegistry();
 
+  initializeCMSimdCFLoweringPass(PR);
+  initializeGenXControlDependenceWrapperPassPass(PR);
+  initializeGenXMaskSimplifyPass(PR);
   initializeGenXSPIRVReaderAdaptorPass(PR);
   initializeGenXSPIRVWriterAdaptorPass(PR);
+  initializeISPCSimdCFLoweringPass(PR);
 
   return 0;
 }
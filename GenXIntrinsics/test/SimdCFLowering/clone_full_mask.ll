@@ -0,0 +1,44 @@
+; RUN: opt -cmsimdcflowering -cmsimdcf-clone-budget=100 -S < %s | FileCheck %s
+; RUN: opt -cmsimdcflowering -cmsimdcf-clone-budget=100 -cmsimdcf-analysis-threads=1 -S < %s | FileCheck %s
+; RUN: opt -cmsimdcflowering -cmsimdcf-clone-budget=100 -cmsimdcf-analysis-threads=4 -S < %s | FileCheck %s
+
+; @sub is called both inside and outside simd control flow. The call outside
+; gets an unpredicated clone, and @sub itself stays predicated. The result is
+; the same whether the analysis of @kernel and @sub runs on one thread or more.
+
+declare i1 @llvm.genx.simdcf.any.v16i1(<16 x i1>)
+
+; CHECK-LABEL: define dllexport void @kernel(
+; CHECK: call void @sub.fullmask(<16 x i32> %v, <16 x i32>* %p)
+; CHECK: then:
+; CHECK: call void @sub(<16 x i32> %v, <16 x i32>* %p)
+define dllexport void @kernel(<16 x i32> %v, <16 x i32>* %p) #0 {
+entry:
+  call void @sub(<16 x i32> %v, <16 x i32>* %p)
+  %c = icmp sgt <16 x i32> %v, zeroinitializer
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %then, label %end
+
+then:
+  call void @sub(<16 x i32> %v, <16 x i32>* %p)
+  br label %end
+
+end:
+  ret void
+}
+
+; CHECK-LABEL: define internal void @sub(
+; CHECK: select <16 x i1>
+; CHECK: ret void
+define internal void @sub(<16 x i32> %v, <16 x i32>* %p) {
+entry:
+  store <16 x i32> %v, <16 x i32>* %p
+  ret void
+}
+
+; CHECK-LABEL: define internal void @sub.fullmask(
+; CHECK-NOT: select
+; CHECK: store <16 x i32> %v, <16 x i32>* %p
+; CHECK-NEXT: ret void
+
+attributes #0 = { "CMGenxMain" }
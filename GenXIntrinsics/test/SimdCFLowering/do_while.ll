@@ -0,0 +1,30 @@
+; RUN: opt -cmsimdcflowering -S < %s | FileCheck %s
+
+; Making the false leg of the latch fall through inverts the condition, and
+; the goto takes the condition inverted again. The goto gets the original
+; condition instead, and the latch keeps its backward branch block.
+
+declare i1 @llvm.genx.simdcf.any.v16i1(<16 x i1>)
+
+; CHECK-LABEL: define void @do_while(
+; CHECK: %c = icmp sgt <16 x i32> %y, zeroinitializer
+; CHECK-NOT: xor
+; CHECK: call { <32 x i1>, <16 x i1>, i1 } @llvm.genx.simdcf.goto.v32i1.v16i1(<32 x i1> %{{[^,]+}}, <16 x i1> %{{[^,]+}}, <16 x i1> %c)
+; CHECK: br i1 %goto.extractcond, label %exit, label %loop.backward
+; CHECK: loop.backward:
+; CHECK-NEXT: br label %loop
+define void @do_while(<16 x i32> %v, <16 x i32>* %p) {
+entry:
+  br label %loop
+
+loop:
+  %x = load <16 x i32>, <16 x i32>* %p
+  %y = add <16 x i32> %x, %v
+  store <16 x i32> %y, <16 x i32>* %p
+  %c = icmp sgt <16 x i32> %y, zeroinitializer
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %loop, label %exit
+
+exit:
+  ret void
+}
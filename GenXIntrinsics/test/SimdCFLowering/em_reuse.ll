@@ -0,0 +1,69 @@
+; RUN: opt -cmsimdcflowering -S < %s | FileCheck %s
+
+; Predicated stores in one block share a load of EM and its 16 channel slice.
+; A call, an unmask region, or a goto or join may change EM, so a store after
+; one of them loads EM again.
+
+declare i1 @llvm.genx.simdcf.any.v16i1(<16 x i1>)
+declare i32 @llvm.genx.unmask.begin()
+declare void @llvm.genx.unmask.end(i32)
+
+; CHECK-LABEL: define void @reuse(
+; CHECK: then:
+; CHECK: [[EM1:%.*]] = load <32 x i1>, <32 x i1>* @EM
+; CHECK-NEXT: [[SLICE1:%.*]] = shufflevector <32 x i1> [[EM1]], <32 x i1> undef, <16 x i32>
+; CHECK-NEXT: select <16 x i1> [[SLICE1]], <16 x i32> %v,
+; CHECK-NEXT: store <16 x i32> {{%.*}}, <16 x i32>* %p
+; CHECK-NOT: @EM
+; CHECK: select <16 x i1> [[SLICE1]], <16 x i32> %v,
+; CHECK-NEXT: store <16 x i32> {{%.*}}, <16 x i32>* %q
+; CHECK-NOT: @EM
+; CHECK: select <16 x i1> [[SLICE1]], <16 x i32> %v,
+; CHECK-NEXT: store <16 x i32> {{%.*}}, <16 x i32>* %r
+; CHECK-NEXT: call void @sub(
+; CHECK: [[EM2:%.*]] = load <32 x i1>, <32 x i1>* @EM
+; CHECK-NEXT: [[SLICE2:%.*]] = shufflevector <32 x i1> [[EM2]]
+; CHECK-NEXT: select <16 x i1> [[SLICE2]], <16 x i32> %v,
+; CHECK-NEXT: store <16 x i32> {{%.*}}, <16 x i32>* %q
+; CHECK: @llvm.genx.simdcf.remask.v32i1(
+; CHECK: [[EM3:%.*]] = load <32 x i1>, <32 x i1>* @EM
+; CHECK-NEXT: [[SLICE3:%.*]] = shufflevector <32 x i1> [[EM3]]
+; CHECK-NEXT: select <16 x i1> [[SLICE3]], <16 x i32> %v,
+; CHECK-NEXT: store <16 x i32> {{%.*}}, <16 x i32>* %r
+; CHECK: @llvm.genx.simdcf.join.v32i1.v16i1(
+; CHECK: .afterjoin:
+; CHECK: [[EM4:%.*]] = load <32 x i1>, <32 x i1>* @EM
+; CHECK-NEXT: [[SLICE4:%.*]] = shufflevector <32 x i1> [[EM4]]
+; CHECK-NEXT: select <16 x i1> [[SLICE4]], <16 x i32> zeroinitializer,
+define void @reuse(<16 x i32> %v, <16 x i32>* %p, <16 x i32>* %q, <16 x i32>* %r) {
+entry:
+  %saved = alloca i32
+  %c = icmp sgt <16 x i32> %v, zeroinitializer
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %then, label %else
+
+then:
+  store <16 x i32> %v, <16 x i32>* %p
+  store <16 x i32> %v, <16 x i32>* %q
+  store <16 x i32> %v, <16 x i32>* %r
+  call void @sub(<16 x i32>* %p)
+  store <16 x i32> %v, <16 x i32>* %q
+  %begin = call i32 @llvm.genx.unmask.begin()
+  store i32 %begin, i32* %saved
+  %load = load i32, i32* %saved
+  call void @llvm.genx.unmask.end(i32 %load)
+  store <16 x i32> %v, <16 x i32>* %r
+  br label %end
+
+else:
+  store <16 x i32> zeroinitializer, <16 x i32>* %p
+  br label %end
+
+end:
+  ret void
+}
+
+define internal void @sub(<16 x i32>* %p) {
+entry:
+  ret void
+}
@@ -0,0 +1,181 @@
+; RUN: opt -cmsimdcflowering -cmsimdcf-ifconvert-threshold=12 -S < %s | FileCheck %s
+
+; An if/else with an if nested in its true leg. Under the threshold, the
+; inner if is flattened first, which leaves the outer if/else small enough
+; to flatten too: the store to the alloca becomes a load and select on both
+; conditions, and the phi becomes a select. An if costing more than the
+; threshold keeps its goto and join.
+
+declare i1 @llvm.genx.simdcf.any.v16i1(<16 x i1>)
+
+; CHECK-LABEL: define <16 x i32> @nested(
+; CHECK-NOT: simdcf
+; CHECK: %p.ifcvt.load = load <16 x i32>, <16 x i32>* %p
+; CHECK: %inc.ifcvt = select <16 x i1> %d, <16 x i32> %inc, <16 x i32> %p.ifcvt.load
+; CHECK: %p.ifcvt.load1 = load <16 x i32>, <16 x i32>* %p
+; CHECK: %inc.ifcvt.ifcvt = select <16 x i1> %c, <16 x i32> %inc.ifcvt, <16 x i32> %p.ifcvt.load1
+; CHECK: store <16 x i32> %inc.ifcvt.ifcvt, <16 x i32>* %p
+; CHECK: %r.ifcvt = select <16 x i1> %c, <16 x i32> %inc, <16 x i32> %neg
+; CHECK-NOT: simdcf
+; CHECK: ret <16 x i32> %r.ifcvt
+define <16 x i32> @nested(<16 x i32> %v, <16 x i32> %w) {
+entry:
+  %p = alloca <16 x i32>
+  %c = icmp sgt <16 x i32> %v, zeroinitializer
+  %any.c = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any.c, label %then, label %else
+
+then:
+  %inc = add <16 x i32> %v, %w
+  %d = icmp sgt <16 x i32> %w, zeroinitializer
+  %any.d = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %d)
+  br i1 %any.d, label %inner, label %then.join
+
+inner:
+  store <16 x i32> %inc, <16 x i32>* %p
+  br label %then.join
+
+then.join:
+  br label %join
+
+else:
+  %neg = sub <16 x i32> zeroinitializer, %v
+  br label %join
+
+join:
+  %r = phi <16 x i32> [ %inc, %then.join ], [ %neg, %else ]
+  ret <16 x i32> %r
+}
+
+; CHECK-LABEL: define void @too_big(
+; CHECK: @llvm.genx.simdcf.goto
+; CHECK: @llvm.genx.simdcf.join
+define void @too_big(<16 x i32> %v) {
+entry:
+  %p = alloca <16 x i32>
+  %q = alloca <16 x i32>
+  %r = alloca <16 x i32>
+  %s = alloca <16 x i32>
+  %t = alloca <16 x i32>
+  %c = icmp sgt <16 x i32> %v, zeroinitializer
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %then, label %join
+
+then:
+  store <16 x i32> %v, <16 x i32>* %p
+  store <16 x i32> %v, <16 x i32>* %q
+  store <16 x i32> %v, <16 x i32>* %r
+  store <16 x i32> %v, <16 x i32>* %s
+  store <16 x i32> %v, <16 x i32>* %t
+  br label %join
+
+join:
+  ret void
+}
+
+; A store through a pointer argument may only be valid for the channels
+; that take the leg, so it is not made unconditional. A store at a constant
+; offset within an internal global is.
+
+@g = internal global [2 x <16 x i32>] zeroinitializer
+
+; CHECK-LABEL: define void @argument_store(
+; CHECK: @llvm.genx.simdcf.goto
+; CHECK: @llvm.genx.simdcf.join
+define void @argument_store(<16 x i32> %v, <16 x i32>* %p) {
+entry:
+  %c = icmp sgt <16 x i32> %v, zeroinitializer
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %then, label %join
+
+then:
+  store <16 x i32> %v, <16 x i32>* %p
+  br label %join
+
+join:
+  ret void
+}
+
+; CHECK-LABEL: define void @global_store(
+; CHECK-NOT: simdcf
+; CHECK: %g1.ifcvt.load = load <16 x i32>, <16 x i32>* %g1
+; CHECK-NEXT: %v.ifcvt = select <16 x i1> %c, <16 x i32> %v, <16 x i32> %g1.ifcvt.load
+; CHECK-NEXT: store <16 x i32> %v.ifcvt, <16 x i32>* %g1
+define void @global_store(<16 x i32> %v) {
+entry:
+  %g1 = getelementptr inbounds [2 x <16 x i32>], [2 x <16 x i32>]* @g, i32 0, i32 1
+  %c = icmp sgt <16 x i32> %v, zeroinitializer
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %then, label %join
+
+then:
+  store <16 x i32> %v, <16 x i32>* %g1
+  br label %join
+
+join:
+  ret void
+}
+
+; A wrregion of the simd width in the only leg gets the branch condition as
+; its predicate in place of a select.
+
+declare <32 x i32> @llvm.genx.wrregioni.v32i32.v16i32.i16.i1(<32 x i32>, <16 x i32>, i32, i32, i32, i16, i32, i1) readnone
+
+; CHECK-LABEL: define <32 x i32> @wrregion(
+; CHECK-NEXT: entry:
+; CHECK-NEXT: %c = icmp sgt <16 x i32> %v, zeroinitializer
+; CHECK-NEXT: %w = call <32 x i32> @llvm.genx.wrregioni.v32i32.v16i32.i16.v16i1(<32 x i32> %a, <16 x i32> %v, i32 0, i32 16, i32 1, i16 0, i32 undef, <16 x i1> %c)
+; CHECK-NEXT: ret <32 x i32> %w
+define <32 x i32> @wrregion(<16 x i32> %v, <32 x i32> %a) {
+entry:
+  %c = icmp sgt <16 x i32> %v, zeroinitializer
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %then, label %join
+
+then:
+  %w = call <32 x i32> @llvm.genx.wrregioni.v32i32.v16i32.i16.i1(<32 x i32> %a, <16 x i32> %v, i32 0, i32 16, i32 1, i16 0, i32 undef, i1 true)
+  br label %join
+
+join:
+  %r = phi <32 x i32> [ %w, %then ], [ %a, %entry ]
+  ret <32 x i32> %r
+}
+
+; The inner if in @join_address_taken is flattened, but its join cannot be
+; merged into the block above as its address is taken. The join stays
+; predicated by the outer if.
+
+; CHECK-LABEL: define void @join_address_taken(
+; CHECK: then:
+; CHECK: %inc.ifcvt = select <16 x i1> %d, <16 x i32> %inc,
+; CHECK: then.join:
+; CHECK: [[EM:%.*]] = load <32 x i1>, <32 x i1>* @EM
+; CHECK: [[EM16:%.*]] = shufflevector <32 x i1> [[EM]], <32 x i1> undef, <16 x i32>
+; CHECK: select <16 x i1> [[EM16]], <16 x i32> %w,
+; CHECK: @llvm.genx.simdcf.join
+@join_addr = internal global i8* blockaddress(@join_address_taken, %then.join)
+
+define void @join_address_taken(<16 x i32> %v, <16 x i32> %w, <16 x i32>* %q) {
+entry:
+  %p = alloca <16 x i32>
+  %c = icmp sgt <16 x i32> %v, zeroinitializer
+  %any.c = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any.c, label %then, label %end
+
+then:
+  %inc = add <16 x i32> %v, %w
+  %d = icmp sgt <16 x i32> %w, zeroinitializer
+  %any.d = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %d)
+  br i1 %any.d, label %inner, label %then.join
+
+inner:
+  store <16 x i32> %inc, <16 x i32>* %p
+  br label %then.join
+
+then.join:
+  store <16 x i32> %w, <16 x i32>* %q
+  br label %end
+
+end:
+  ret void
+}
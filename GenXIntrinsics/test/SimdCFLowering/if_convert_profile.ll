@@ -0,0 +1,74 @@
+; RUN: echo "k.cm:3:3 10 10 80" > %t.prof
+; RUN: echo "k.cm:9:3 40 30 30" >> %t.prof
+; RUN: opt -cmsimdcflowering -cmsimdcf-profile=%t.prof -cmsimdcf-ifconvert-threshold=12 -S < %s | FileCheck %s
+
+; Both simd ifs cost 15 instructions once flattened, over the threshold of
+; 12. The profile says the first one diverges in 80% of its executions, so
+; both legs run most of the time anyway and it is flattened at up to twice
+; the threshold. The second one diverges in 30% of its executions and keeps
+; its goto and join.
+
+@p = internal global <16 x i32> zeroinitializer
+@q = internal global <16 x i32> zeroinitializer
+@r = internal global <16 x i32> zeroinitializer
+@s = internal global <16 x i32> zeroinitializer
+@t = internal global <16 x i32> zeroinitializer
+
+declare i1 @llvm.genx.simdcf.any.v16i1(<16 x i1>)
+
+; CHECK-LABEL: define void @often(
+; CHECK-NOT: @llvm.genx.simdcf.goto
+; CHECK: select <16 x i1> %c, <16 x i32> %v,
+; CHECK-LABEL: define void @sometimes(
+; CHECK: @llvm.genx.simdcf.goto.v32i1.v16i1(
+define void @often(<16 x i32> %v) !dbg !5 {
+entry:
+  %c = icmp sgt <16 x i32> %v, zeroinitializer, !dbg !8
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c), !dbg !8
+  br i1 %any, label %then, label %end, !dbg !8
+
+then:
+  store <16 x i32> %v, <16 x i32>* @p, !dbg !9
+  store <16 x i32> %v, <16 x i32>* @q, !dbg !9
+  store <16 x i32> %v, <16 x i32>* @r, !dbg !9
+  store <16 x i32> %v, <16 x i32>* @s, !dbg !9
+  store <16 x i32> %v, <16 x i32>* @t, !dbg !9
+  br label %end, !dbg !9
+
+end:
+  ret void, !dbg !9
+}
+
+define void @sometimes(<16 x i32> %v) !dbg !10 {
+entry:
+  %c = icmp sgt <16 x i32> %v, zeroinitializer, !dbg !11
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c), !dbg !11
+  br i1 %any, label %then, label %end, !dbg !11
+
+then:
+  store <16 x i32> %v, <16 x i32>* @p, !dbg !12
+  store <16 x i32> %v, <16 x i32>* @q, !dbg !12
+  store <16 x i32> %v, <16 x i32>* @r, !dbg !12
+  store <16 x i32> %v, <16 x i32>* @s, !dbg !12
+  store <16 x i32> %v, <16 x i32>* @t, !dbg !12
+  br label %end, !dbg !12
+
+end:
+  ret void, !dbg !12
+}
+
+!llvm.dbg.cu = !{!0}
+!llvm.module.flags = !{!3, !4}
+
+!0 = distinct !DICompileUnit(language: DW_LANG_C_plus_plus, file: !1, emissionKind: LineTablesOnly)
+!1 = !DIFile(filename: "k.cm", directory: "/")
+!3 = !{i32 2, !"Debug Info Version", i32 3}
+!4 = !{i32 2, !"Dwarf Version", i32 4}
+!5 = distinct !DISubprogram(name: "often", scope: !1, file: !1, line: 1, type: !6, scopeLine: 1, spFlags: DISPFlagDefinition, unit: !0)
+!6 = !DISubroutineType(types: !7)
+!7 = !{}
+!8 = !DILocation(line: 3, column: 3, scope: !5)
+!9 = !DILocation(line: 4, column: 5, scope: !5)
+!10 = distinct !DISubprogram(name: "sometimes", scope: !1, file: !1, line: 7, type: !6, scopeLine: 7, spFlags: DISPFlagDefinition, unit: !0)
+!11 = !DILocation(line: 9, column: 3, scope: !10)
+!12 = !DILocation(line: 10, column: 5, scope: !10)
@@ -0,0 +1,71 @@
+; RUN: opt -cmsimdcflowering -disable-output < %s 2>&1 | FileCheck %s
+
+; @a and @b may be called indirectly and both make an indirect call, so the
+; indirect call node puts them in one SCC. The direct call from @a to @b is
+; not recursive and is not diagnosed. @e and @f call each other directly,
+; which is diagnosed.
+
+; CHECK-NOT: recursive
+; CHECK: warning: {{.*}}SIMD recursive call
+; CHECK-NEXT: warning: {{.*}}SIMD recursive call
+; CHECK-NOT: recursive
+
+declare i1 @llvm.genx.simdcf.any.v16i1(<16 x i1>)
+
+define dllexport void @kernel(<16 x i32> %v, <16 x i32>* %p, void (<16 x i32>, <16 x i32>*)* %fp) #0 {
+entry:
+  %c = icmp sgt <16 x i32> %v, zeroinitializer
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %then, label %end
+
+then:
+  call void %fp(<16 x i32> %v, <16 x i32>* %p)
+  call void @e(<16 x i32> %v, <16 x i32>* %p, i32 1)
+  br label %end
+
+end:
+  ret void
+}
+
+define internal void @a(<16 x i32> %v, <16 x i32>* %p) #1 {
+entry:
+  %fp = load void (<16 x i32>, <16 x i32>*)*, void (<16 x i32>, <16 x i32>*)** @target
+  call void %fp(<16 x i32> %v, <16 x i32>* %p)
+  call void @b(<16 x i32> %v, <16 x i32>* %p)
+  ret void
+}
+
+define internal void @b(<16 x i32> %v, <16 x i32>* %p) #1 {
+entry:
+  %fp = load void (<16 x i32>, <16 x i32>*)*, void (<16 x i32>, <16 x i32>*)** @target
+  call void %fp(<16 x i32> %v, <16 x i32>* %p)
+  store <16 x i32> %v, <16 x i32>* %p
+  ret void
+}
+
+@target = internal global void (<16 x i32>, <16 x i32>*)* null
+
+define internal void @e(<16 x i32> %v, <16 x i32>* %p, i32 %n) #2 {
+entry:
+  store <16 x i32> %v, <16 x i32>* %p
+  %z = icmp eq i32 %n, 0
+  br i1 %z, label %done, label %rec
+
+rec:
+  %m = sub i32 %n, 1
+  call void @f(<16 x i32> %v, <16 x i32>* %p, i32 %m)
+  br label %done
+
+done:
+  ret void
+}
+
+define internal void @f(<16 x i32> %v, <16 x i32>* %p, i32 %n) #2 {
+entry:
+  call void @e(<16 x i32> %v, <16 x i32>* %p, i32 %n)
+  ret void
+}
+
+attributes #0 = { "CMGenxMain" }
+attributes #1 = { "referenced-indirectly" }
+attributes #2 = { "CMStackCall" }
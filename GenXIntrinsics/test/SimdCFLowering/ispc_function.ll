@@ -0,0 +1,66 @@
+; RUN: opt -ispcsimdcflowering -ispcsimdcf-function=f -S < %s | FileCheck %s
+; RUN: opt -ispcsimdcflowering -ispcsimdcf-function=f -S < %s | opt -ispcsimdcflowering -ispcsimdcf-function=k -S | FileCheck --check-prefix=SECOND %s
+
+; Lowering one function only lowers it and the subroutines it makes
+; predicated, which record their call mask width. Other functions are left
+; alone, and a later run for another function reuses the EM variable.
+
+; CHECK: @EM = internal global <32 x i1> {{.*}}, !genx.simdcf.em
+; CHECK-LABEL: define void @f(
+; CHECK: @llvm.genx.simdcf.goto.v32i1.v16i1(
+; CHECK-LABEL: define internal void @g(
+; CHECK-SAME: !genx.simdcf.callmask [[CM:![0-9]+]]
+; CHECK: select <16 x i1>
+; CHECK-LABEL: define internal void @h(
+; CHECK-NEXT: store <16 x i32> zeroinitializer
+; CHECK-LABEL: define void @k(
+; CHECK: @llvm.genx.simdcf.any.v16i1(
+; CHECK: [[CM]] = !{i32 16}
+
+; SECOND: @EM = internal global <32 x i1>
+; SECOND-NOT: @EM.
+; SECOND-LABEL: define void @k(
+; SECOND-NOT: @llvm.genx.simdcf.any
+; SECOND: @llvm.genx.simdcf.goto.v32i1.v16i1(<32 x i1> %{{.*}}
+; SECOND: ret void
+
+declare i1 @llvm.genx.simdcf.any.v16i1(<16 x i1>)
+
+define void @f(<16 x i32> %v, <16 x i32>* %p) {
+entry:
+  %c = icmp sgt <16 x i32> %v, zeroinitializer
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %then, label %end
+
+then:
+  call void @g(<16 x i32> %v, <16 x i32>* %p)
+  br label %end
+
+end:
+  call void @h(<16 x i32>* %p)
+  ret void
+}
+
+define internal void @g(<16 x i32> %v, <16 x i32>* %p) {
+  store <16 x i32> %v, <16 x i32>* %p
+  ret void
+}
+
+define internal void @h(<16 x i32>* %p) {
+  store <16 x i32> zeroinitializer, <16 x i32>* %p
+  ret void
+}
+
+define void @k(<16 x i32> %v, <16 x i32>* %p) {
+entry:
+  %c = icmp sgt <16 x i32> %v, zeroinitializer
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %then, label %end
+
+then:
+  store <16 x i32> %v, <16 x i32>* %p
+  br label %end
+
+end:
+  ret void
+}
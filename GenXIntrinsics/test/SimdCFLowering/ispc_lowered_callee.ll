@@ -0,0 +1,48 @@
+; RUN: opt -ispcsimdcflowering -ispcsimdcf-function=f -S < %s | FileCheck %s
+; RUN: opt -ispcsimdcflowering -ispcsimdcf-function=f -S < %s | not opt -ispcsimdcflowering -ispcsimdcf-function=k -disable-output 2>&1 | FileCheck --check-prefix=ERROR %s
+
+; The EM variable is found through its metadata, not its name, so a user
+; global called @EM is left alone. @f is lowered with its own simd CF and
+; no call mask. A later lowering of @k, which calls @f under simd CF, cannot
+; lower @f again as a predicated subroutine, and reports an error.
+
+; CHECK: @EM = global i32 0
+; CHECK: [[EMVAR:@EM[.0-9]+]] = internal global <32 x i1> {{.*}}, !genx.simdcf.em
+; CHECK-LABEL: define void @f(
+; CHECK: load <32 x i1>, <32 x i1>* [[EMVAR]]
+; CHECK: store i32 1, i32* @EM
+
+; ERROR: error: CMSimdCFLowering: subroutine called under SIMD control flow was already lowered without this call mask
+
+@EM = global i32 0
+
+declare i1 @llvm.genx.simdcf.any.v16i1(<16 x i1>)
+
+define void @f(<16 x i32> %v, <16 x i32>* %p) {
+entry:
+  %c = icmp sgt <16 x i32> %v, zeroinitializer
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %then, label %end
+
+then:
+  store <16 x i32> %v, <16 x i32>* %p
+  br label %end
+
+end:
+  store i32 1, i32* @EM
+  ret void
+}
+
+define void @k(<16 x i32> %v, <16 x i32>* %p) {
+entry:
+  %c = icmp sgt <16 x i32> %v, zeroinitializer
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %then, label %end
+
+then:
+  call void @f(<16 x i32> %v, <16 x i32>* %p)
+  br label %end
+
+end:
+  ret void
+}
@@ -0,0 +1,39 @@
+; RUN: opt -cmsimdcflowering -S < %s | FileCheck %s
+; RUN: opt -cmsimdcflowering -cmsimdcf-precise-join-jips=false -S < %s | FileCheck --check-prefix=GROUPING %s
+
+; The join at the loop header ends the region from entry, so every path to
+; it has a channel enabled and it does not need a JIP. The grouping alone
+; puts it in one group with the loop exit, so it gets a JIP.
+
+declare i1 @llvm.genx.simdcf.any.v16i1(<16 x i1>)
+
+; CHECK-LABEL: define void @if_then_loop(
+; CHECK: loop:
+; CHECK: call { <32 x i1>, i1 } @llvm.genx.simdcf.join.v32i1.v16i1(
+; CHECK-NOT: br i1
+; CHECK: br label %.afterjoin
+; GROUPING-LABEL: define void @if_then_loop(
+; GROUPING: loop:
+; GROUPING: call { <32 x i1>, i1 } @llvm.genx.simdcf.join.v32i1.v16i1(
+; GROUPING: br i1 %join.extractcond, label %exit, label %.afterjoin
+define void @if_then_loop(<16 x i32> %v, <16 x i32> %w, <16 x i32>* %p) {
+entry:
+  %c = icmp sgt <16 x i32> %v, zeroinitializer
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %then, label %loop
+
+then:
+  store <16 x i32> %v, <16 x i32>* %p
+  br label %loop
+
+loop:
+  %x = phi <16 x i32> [ %w, %entry ], [ %w, %then ], [ %y, %loop ]
+  %y = add <16 x i32> %x, %v
+  store <16 x i32> %y, <16 x i32>* %p
+  %d = icmp sgt <16 x i32> %y, zeroinitializer
+  %anyd = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %d)
+  br i1 %anyd, label %loop, label %exit
+
+exit:
+  ret void
+}
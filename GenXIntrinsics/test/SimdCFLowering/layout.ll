@@ -0,0 +1,43 @@
+; RUN: opt -cmsimdcflowering -cmsimdcf-layout -S < %s | FileCheck %s
+; RUN: opt -cmsimdcflowering -S < %s | FileCheck --check-prefix=ASIS %s
+
+; The join block comes before the legs of the if-else. Laid out, the false
+; leg falls through from the branch, the true leg's join follows it and the
+; final join follows the whole region. Left as it is, the false leg needs an
+; extra fallthrough block and the final join comes first.
+
+declare i1 @llvm.genx.simdcf.any.v16i1(<16 x i1>)
+
+; CHECK-LABEL: define void @if_else(
+; CHECK: entry:
+; CHECK: br i1 %goto.extractcond, label %then, label %else
+; CHECK: else:
+; CHECK: call { <32 x i1>, <16 x i1>, i1 } @llvm.genx.simdcf.goto.v32i1.v16i1(
+; CHECK: then:
+; CHECK: call { <32 x i1>, i1 } @llvm.genx.simdcf.join.v32i1.v16i1(
+; CHECK: join:
+; CHECK: call { <32 x i1>, i1 } @llvm.genx.simdcf.join.v32i1.v16i1(
+; CHECK: ret void
+; ASIS-LABEL: define void @if_else(
+; ASIS: br i1 %goto.extractcond, label %then, label %entry.fallthrough
+; ASIS: entry.fallthrough:
+; ASIS-NEXT: br label %else
+; ASIS: join:
+; ASIS-NEXT: ret void
+define void @if_else(<16 x i32> %v, <16 x i32> %w, <16 x i32>* %p) {
+entry:
+  %c = icmp sgt <16 x i32> %v, zeroinitializer
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %then, label %else
+
+join:
+  ret void
+
+then:
+  store <16 x i32> %v, <16 x i32>* %p
+  br label %join
+
+else:
+  store <16 x i32> %w, <16 x i32>* %p
+  br label %join
+}
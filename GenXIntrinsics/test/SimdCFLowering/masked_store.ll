@@ -0,0 +1,37 @@
+; RUN: opt -cmsimdcflowering -cmsimdcf-masked-stores -S < %s | FileCheck %s
+
+; With -cmsimdcf-masked-stores, a predicated store to an alloca becomes
+; llvm.masked.store and a predicated vstore becomes llvm.genx.vstore.masked.
+; Other stores are still predicated with a select.
+
+declare i1 @llvm.genx.simdcf.any.v16i1(<16 x i1>)
+declare void @llvm.genx.vstore.v16i32.p0v16i32(<16 x i32>, <16 x i32>*)
+
+; CHECK-LABEL: define void @masked(
+; CHECK: then:
+; CHECK: [[EM:%.*]] = load <32 x i1>, <32 x i1>* @EM
+; CHECK-NEXT: [[EM16:%.*]] = shufflevector <32 x i1> [[EM]], <32 x i1> undef,
+; CHECK-NEXT: call void @llvm.masked.store.v16i32.p0v16i32(<16 x i32> %v, <16 x i32>* %a, i32 64, <16 x i1> [[EM16]])
+; CHECK-NEXT: call void @llvm.genx.vstore.masked.v16i32.p0v16i32.v16i1(<16 x i32> %v, <16 x i32>* %q, <16 x i1> [[EM16]])
+; CHECK-NEXT: [[OLD:%.*]] = load <16 x i32>, <16 x i32>* %p
+; CHECK: select <16 x i1> [[EM16]], <16 x i32> %v, <16 x i32> [[OLD]]
+; CHECK: end:
+define void @masked(<16 x i32> %v, <16 x i32> %w, <16 x i32>* %p, <16 x i32>* %q) {
+entry:
+  %a = alloca <16 x i32>, align 64
+  store <16 x i32> %w, <16 x i32>* %a
+  %c = icmp sgt <16 x i32> %v, %w
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %then, label %end
+
+then:
+  store <16 x i32> %v, <16 x i32>* %a, align 64
+  call void @llvm.genx.vstore.v16i32.p0v16i32(<16 x i32> %v, <16 x i32>* %q)
+  store <16 x i32> %v, <16 x i32>* %p
+  br label %end
+
+end:
+  %r = load <16 x i32>, <16 x i32>* %a
+  store <16 x i32> %r, <16 x i32>* %p
+  ret void
+}
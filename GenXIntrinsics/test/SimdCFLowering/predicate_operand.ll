@@ -0,0 +1,30 @@
+; RUN: opt -cmsimdcflowering -S < %s | FileCheck %s
+
+; An intrinsic is predicated through the predicate operand given in its
+; description, even where another operand is also a vector of i1.
+
+declare i1 @llvm.genx.simdcf.any.v16i1(<16 x i1>)
+declare <16 x i32> @llvm.genx.svm.atomic.add.v16i32.v16i1.v16i64(<16 x i1>, <16 x i64>, <16 x i32>, <16 x i32>)
+declare void @llvm.genx.svm.scatter.v16i1.v16i64.v16i1(<16 x i1>, i32, <16 x i64>, <16 x i1>)
+
+; CHECK-LABEL: define void @pred_operand(
+; CHECK: then:
+; CHECK: [[EM16:%.*]] = shufflevector <32 x i1> {{%.*}}, <32 x i1> undef,
+; CHECK-NEXT: [[AND:%.*]] = and <16 x i1> %m, [[EM16]]
+; CHECK-NEXT: call <16 x i32> @llvm.genx.svm.atomic.add.v16i32.v16i1.v16i64(<16 x i1> [[AND]], <16 x i64> %a, <16 x i32> %v, <16 x i32> undef)
+; CHECK: call void @llvm.genx.svm.scatter.v16i1.v16i64.v16i1(<16 x i1> [[EM16]], i32 0, <16 x i64> %a, <16 x i1> %m)
+; CHECK: end:
+define void @pred_operand(<16 x i32> %v, <16 x i64> %a, <16 x i1> %m) {
+entry:
+  %c = icmp sgt <16 x i32> %v, zeroinitializer
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %then, label %end
+
+then:
+  %old = call <16 x i32> @llvm.genx.svm.atomic.add.v16i32.v16i1.v16i64(<16 x i1> %m, <16 x i64> %a, <16 x i32> %v, <16 x i32> undef)
+  call void @llvm.genx.svm.scatter.v16i1.v16i64.v16i1(<16 x i1> <i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true, i1 true>, i32 0, <16 x i64> %a, <16 x i1> %m)
+  br label %end
+
+end:
+  ret void
+}
@@ -0,0 +1,77 @@
+; RUN: echo "k.cm:5:3 1 95 4" > %t.prof
+; RUN: opt -cmsimdcflowering -cmsimdcf-profile=%t.prof -pass-remarks-analysis=cmsimdcflowering -S < %s 2>%t.err | FileCheck %s
+; RUN: FileCheck --check-prefix=REMARK %s < %t.err
+; RUN: opt -cmsimdcflowering -cmsimdcf-layout -S < %s | FileCheck --check-prefix=NOPROF %s
+
+; The scalar branch's weights put its likely leg %fast straight after it.
+; The profile says the simd branch rarely diverges and nearly always takes
+; its false leg, so %else is laid out to be the goto target and %then falls
+; through. Without the profile only the weights are used, and %else falls
+; through.
+
+; REMARK: remark: k.cm:5:3: SIMD branch of width 16 predicates 2 instructions including 2 stores; needs JIP: false, un-simded: false; divergent in 4% of executions
+
+declare i1 @llvm.genx.simdcf.any.v16i1(<16 x i1>)
+
+; CHECK-LABEL: define void @profiled(
+; CHECK: entry:
+; CHECK: fast:
+; CHECK: slow:
+; CHECK: simd:
+; CHECK: br i1 %goto.extractcond, label %else, label %then
+; CHECK: then:
+; CHECK: else:
+; CHECK: join:
+; NOPROF-LABEL: define void @profiled(
+; NOPROF: entry:
+; NOPROF: fast:
+; NOPROF: slow:
+; NOPROF: simd:
+; NOPROF: br i1 %goto.extractcond, label %then, label %else
+; NOPROF: else:
+; NOPROF: then:
+; NOPROF: join:
+define void @profiled(i1 %s, <16 x i32> %v, <16 x i32>* %p) !dbg !5 {
+entry:
+  br i1 %s, label %fast, label %slow, !prof !13, !dbg !8
+
+slow:
+  store <16 x i32> zeroinitializer, <16 x i32>* %p, !dbg !9
+  br label %simd, !dbg !9
+
+fast:
+  br label %simd, !dbg !9
+
+simd:
+  %c = icmp sgt <16 x i32> %v, zeroinitializer, !dbg !10
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c), !dbg !10
+  br i1 %any, label %then, label %else, !dbg !10
+
+then:
+  store <16 x i32> %v, <16 x i32>* %p, !dbg !11
+  br label %join, !dbg !11
+
+else:
+  store <16 x i32> zeroinitializer, <16 x i32>* %p, !dbg !12
+  br label %join, !dbg !12
+
+join:
+  ret void, !dbg !12
+}
+
+!llvm.dbg.cu = !{!0}
+!llvm.module.flags = !{!3, !4}
+
+!0 = distinct !DICompileUnit(language: DW_LANG_C_plus_plus, file: !1, emissionKind: LineTablesOnly)
+!1 = !DIFile(filename: "k.cm", directory: "/")
+!3 = !{i32 2, !"Debug Info Version", i32 3}
+!4 = !{i32 2, !"Dwarf Version", i32 4}
+!5 = distinct !DISubprogram(name: "profiled", scope: !1, file: !1, line: 1, type: !6, scopeLine: 1, spFlags: DISPFlagDefinition, unit: !0)
+!6 = !DISubroutineType(types: !7)
+!7 = !{}
+!8 = !DILocation(line: 2, column: 3, scope: !5)
+!9 = !DILocation(line: 3, column: 5, scope: !5)
+!10 = !DILocation(line: 5, column: 3, scope: !5)
+!11 = !DILocation(line: 6, column: 5, scope: !5)
+!12 = !DILocation(line: 8, column: 5, scope: !5)
+!13 = !{!"branch_weights", i32 100, i32 1}
@@ -0,0 +1,63 @@
+; RUN: opt -cmsimdcflowering -pass-remarks=cmsimdcflowering -pass-remarks-analysis=cmsimdcflowering -disable-output < %s 2>&1 | FileCheck %s
+; RUN: opt -cmsimdcflowering -pass-remarks-output=%t -disable-output < %s
+; RUN: FileCheck --check-prefix=YAML %s < %t
+
+; Each simd branch and join gets a remark with its location and the cost of
+; the predication it needs.
+
+; CHECK: remark: k.cm:3:5: SIMD branch of width 16 predicates 2 instructions including 1 stores; needs JIP: false, un-simded: false
+; CHECK: remark: k.cm:6:5: SIMD branch of width 16 predicates 0 instructions including 0 stores; needs JIP: false, un-simded: true
+; CHECK: remark: k.cm:7:3: join of width 16; needs JIP: false
+
+; YAML: --- !Analysis
+; YAML-NEXT: Pass: cmsimdcflowering
+; YAML-NEXT: Name: SimdBranch
+; YAML-NEXT: DebugLoc: { File: k.cm, Line: 3, Column: 5 }
+; YAML-NEXT: Function: simd_if
+; YAML-NEXT: Args:
+; YAML: - SimdWidth: '16'
+; YAML: - PredicatedInstructions: '2'
+; YAML: - PredicatedStores: '1'
+; YAML: - NeedsJIP: 'false'
+; YAML: - Unsimded: 'false'
+; YAML: --- !Passed
+; YAML-NEXT: Pass: cmsimdcflowering
+; YAML-NEXT: Name: UnsimdedBranch
+; YAML: --- !Analysis
+; YAML-NEXT: Pass: cmsimdcflowering
+; YAML-NEXT: Name: Join
+
+declare i1 @llvm.genx.simdcf.any.v16i1(<16 x i1>)
+declare <16 x i32> @llvm.genx.simdcf.predicate.v16i32(<16 x i32>, <16 x i32>)
+
+define void @simd_if(<16 x i32> %v, <16 x i32>* %p) !dbg !5 {
+entry:
+  %c = icmp sgt <16 x i32> %v, zeroinitializer, !dbg !8
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c), !dbg !8
+  br i1 %any, label %then, label %end, !dbg !8
+
+then:
+  %pred = call <16 x i32> @llvm.genx.simdcf.predicate.v16i32(<16 x i32> %v, <16 x i32> zeroinitializer), !dbg !9
+  store <16 x i32> %pred, <16 x i32>* %p, !dbg !10
+  br label %end, !dbg !11
+
+end:
+  store <16 x i32> %v, <16 x i32>* %p, !dbg !12
+  ret void, !dbg !12
+}
+
+!llvm.dbg.cu = !{!0}
+!llvm.module.flags = !{!3, !4}
+
+!0 = distinct !DICompileUnit(language: DW_LANG_C_plus_plus, file: !1, emissionKind: LineTablesOnly)
+!1 = !DIFile(filename: "k.cm", directory: "/")
+!3 = !{i32 2, !"Debug Info Version", i32 3}
+!4 = !{i32 2, !"Dwarf Version", i32 4}
+!5 = distinct !DISubprogram(name: "simd_if", scope: !1, file: !1, line: 1, type: !6, scopeLine: 1, spFlags: DISPFlagDefinition, unit: !0)
+!6 = !DISubroutineType(types: !7)
+!7 = !{}
+!8 = !DILocation(line: 3, column: 5, scope: !5)
+!9 = !DILocation(line: 4, column: 7, scope: !5)
+!10 = !DILocation(line: 5, column: 7, scope: !5)
+!11 = !DILocation(line: 6, column: 5, scope: !5)
+!12 = !DILocation(line: 7, column: 3, scope: !5)
@@ -0,0 +1,32 @@
+; RUN: not opt -cmsimdcflowering -disable-output < %s 2>&1 | FileCheck %s
+
+; A return inside simd control flow is reported as an error, also when a
+; uniform branch there makes the analysis run again.
+
+; CHECK: error: CMSimdCFLowering: return or switch not allowed in SIMD control flow
+
+declare i1 @llvm.genx.simdcf.any.v16i1(<16 x i1>)
+
+define void @ret_in_simd(<16 x i32> %v, <16 x i32>* %p, i32 %s) {
+entry:
+  %c = icmp sgt <16 x i32> %v, zeroinitializer
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %then, label %end
+
+then:
+  %ins = insertelement <16 x i32> undef, i32 %s, i32 0
+  %splat = shufflevector <16 x i32> %ins, <16 x i32> undef, <16 x i32> zeroinitializer
+  %u = icmp sgt <16 x i32> %splat, zeroinitializer
+  %uany = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %u)
+  br i1 %uany, label %inner, label %out
+
+inner:
+  store <16 x i32> %v, <16 x i32>* %p
+  br label %end
+
+out:
+  ret void
+
+end:
+  ret void
+}
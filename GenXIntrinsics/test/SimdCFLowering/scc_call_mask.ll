@@ -0,0 +1,134 @@
+; RUN: opt -cmsimdcflowering -S < %s 2>/dev/null | FileCheck %s
+
+; Each subroutine gets the width of the simd CF its calls are made under.
+; @inner is only reached through @outer, so it is not visited until @outer
+; has been. @even and @odd call each other; whichever of them is visited
+; first, both are predicated with the width of the call from @kernel8.
+; @f1 and @f2 call each other, and @kernel_plain calls @f2 with all channels
+; enabled. The only simd CF is around the call from @f2 to @f1, which is
+; found before either of them is lowered, so @f1 is predicated although it
+; is visited first.
+
+declare i1 @llvm.genx.simdcf.any.v16i1(<16 x i1>)
+declare i1 @llvm.genx.simdcf.any.v8i1(<8 x i1>)
+
+define dllexport void @kernel16(<16 x i32> %v, <16 x i32>* %p) #0 {
+entry:
+  %c = icmp sgt <16 x i32> %v, zeroinitializer
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %then, label %end
+
+then:
+  call void @outer(<16 x i32> %v, <16 x i32>* %p)
+  br label %end
+
+end:
+  ret void
+}
+
+define dllexport void @kernel8(<8 x i32> %w, <8 x i32>* %q, i32 %n) #0 {
+entry:
+  %d = icmp sgt <8 x i32> %w, zeroinitializer
+  %any8 = call i1 @llvm.genx.simdcf.any.v8i1(<8 x i1> %d)
+  br i1 %any8, label %then8, label %end
+
+then8:
+  call void @even(<8 x i32> %w, <8 x i32>* %q, i32 %n)
+  br label %end
+
+end:
+  ret void
+}
+
+define dllexport void @kernel_plain(<8 x i32> %w, <8 x i32>* %q, i32 %n) #0 {
+entry:
+  call void @f2(<8 x i32> %w, <8 x i32>* %q, i32 %n)
+  ret void
+}
+
+; CHECK-LABEL: define internal void @outer(
+; CHECK: shufflevector <32 x i1> {{%.*}}, <32 x i1> undef, <16 x i32>
+; CHECK: select <16 x i1>
+define internal void @outer(<16 x i32> %v, <16 x i32>* %p) {
+entry:
+  store <16 x i32> %v, <16 x i32>* %p
+  call void @inner(<16 x i32> %v, <16 x i32>* %p)
+  ret void
+}
+
+; CHECK-LABEL: define internal void @inner(
+; CHECK: shufflevector <32 x i1> {{%.*}}, <32 x i1> undef, <16 x i32>
+; CHECK: select <16 x i1>
+define internal void @inner(<16 x i32> %v, <16 x i32>* %p) {
+entry:
+  store <16 x i32> %v, <16 x i32>* %p
+  ret void
+}
+
+; CHECK-LABEL: define internal void @even(
+; CHECK: shufflevector <32 x i1> {{%.*}}, <32 x i1> undef, <8 x i32>
+; CHECK: select <8 x i1>
+define internal void @even(<8 x i32> %w, <8 x i32>* %q, i32 %n) #1 {
+entry:
+  store <8 x i32> %w, <8 x i32>* %q
+  %z = icmp eq i32 %n, 0
+  br i1 %z, label %done, label %rec
+
+rec:
+  %m = sub i32 %n, 1
+  call void @odd(<8 x i32> %w, <8 x i32>* %q, i32 %m)
+  br label %done
+
+done:
+  ret void
+}
+
+; CHECK-LABEL: define internal void @odd(
+; CHECK: shufflevector <32 x i1> {{%.*}}, <32 x i1> undef, <8 x i32>
+; CHECK: select <8 x i1>
+define internal void @odd(<8 x i32> %w, <8 x i32>* %q, i32 %n) #1 {
+entry:
+  store <8 x i32> %w, <8 x i32>* %q
+  %m = sub i32 %n, 1
+  call void @even(<8 x i32> %w, <8 x i32>* %q, i32 %m)
+  ret void
+}
+
+; CHECK-LABEL: define internal void @f2(
+; CHECK: @llvm.genx.simdcf.goto.v32i1.v8i1(
+; CHECK: then:
+; CHECK: call void @f1(
+define internal void @f2(<8 x i32> %w, <8 x i32>* %q, i32 %n) #1 {
+entry:
+  %d = icmp sgt <8 x i32> %w, zeroinitializer
+  %any = call i1 @llvm.genx.simdcf.any.v8i1(<8 x i1> %d)
+  br i1 %any, label %then, label %end
+
+then:
+  call void @f1(<8 x i32> %w, <8 x i32>* %q, i32 %n)
+  br label %end
+
+end:
+  ret void
+}
+
+; CHECK-LABEL: define internal void @f1(
+; CHECK: shufflevector <32 x i1> {{%.*}}, <32 x i1> undef, <8 x i32>
+; CHECK: select <8 x i1>
+define internal void @f1(<8 x i32> %w, <8 x i32>* %q, i32 %n) #1 {
+entry:
+  store <8 x i32> %w, <8 x i32>* %q
+  %z = icmp eq i32 %n, 0
+  br i1 %z, label %done, label %rec
+
+rec:
+  %m = sub i32 %n, 1
+  call void @f2(<8 x i32> %w, <8 x i32>* %q, i32 %m)
+  br label %done
+
+done:
+  ret void
+}
+
+attributes #0 = { "CMGenxMain" }
+attributes #1 = { "CMStackCall" }
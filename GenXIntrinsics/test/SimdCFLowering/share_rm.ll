@@ -0,0 +1,67 @@
+; RUN: opt -cmsimdcflowering -S < %s | FileCheck %s
+; RUN: opt -cmsimdcflowering -cmsimdcf-structured=0 -S < %s | FileCheck %s
+; RUN: opt -cmsimdcflowering -cmsimdcf-share-rm=false -S < %s | FileCheck --check-prefix=NOSHARE %s
+
+; Two simd ifs one after the other never have their resume masks in use at
+; the same time, so their joins share one RM variable. A nested if needs its
+; own. The control dependence found for these structured regions is the same
+; with the post dominator tree walk as without it.
+
+declare i1 @llvm.genx.simdcf.any.v16i1(<16 x i1>)
+
+; CHECK-LABEL: define void @sequential_ifs(
+; CHECK: alloca <16 x i1>
+; CHECK-NOT: alloca <16 x i1>
+; CHECK: ret void
+; NOSHARE-LABEL: define void @sequential_ifs(
+; NOSHARE: alloca <16 x i1>
+; NOSHARE: alloca <16 x i1>
+; NOSHARE: ret void
+define void @sequential_ifs(<16 x i32> %v, <16 x i32> %w, <16 x i32>* %p, <16 x i32>* %q) {
+entry:
+  %c1 = icmp sgt <16 x i32> %v, zeroinitializer
+  %any1 = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c1)
+  br i1 %any1, label %then1, label %mid
+
+then1:
+  store <16 x i32> %v, <16 x i32>* %p
+  br label %mid
+
+mid:
+  %c2 = icmp sgt <16 x i32> %w, zeroinitializer
+  %any2 = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c2)
+  br i1 %any2, label %then2, label %end
+
+then2:
+  store <16 x i32> %w, <16 x i32>* %q
+  br label %end
+
+end:
+  ret void
+}
+
+; CHECK-LABEL: define void @nested_ifs(
+; CHECK: alloca <16 x i1>
+; CHECK: alloca <16 x i1>
+; CHECK: ret void
+define void @nested_ifs(<16 x i32> %v, <16 x i32> %w, <16 x i32>* %p) {
+entry:
+  %c1 = icmp sgt <16 x i32> %v, zeroinitializer
+  %any1 = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c1)
+  br i1 %any1, label %outer, label %end
+
+outer:
+  %c2 = icmp sgt <16 x i32> %w, zeroinitializer
+  %any2 = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c2)
+  br i1 %any2, label %inner, label %join
+
+inner:
+  store <16 x i32> %w, <16 x i32>* %p
+  br label %join
+
+join:
+  br label %end
+
+end:
+  ret void
+}
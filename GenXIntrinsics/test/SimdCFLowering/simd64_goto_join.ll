@@ -0,0 +1,60 @@
+; RUN: opt -cmsimdcflowering -cmsimdcf-max-width=64 -S < %s | FileCheck %s
+
+; SIMD64 control flow needs a 64 bit execution mask.
+
+declare i1 @llvm.genx.simdcf.any.v64i1(<64 x i1>)
+declare i1 @llvm.genx.simdcf.any.v16i1(<16 x i1>)
+
+; CHECK: @EM = internal global <64 x i1> <i1 true,
+
+; CHECK-LABEL: define void @simd64_if_else(
+; CHECK: entry:
+; CHECK: [[EM:%.*]] = load <64 x i1>, <64 x i1>* @EM
+; CHECK: [[GOTO:%.*]] = call { <64 x i1>, <64 x i1>, i1 } @llvm.genx.simdcf.goto.v64i1.v64i1(<64 x i1> [[EM]],
+; CHECK: then:
+; CHECK: [[THENEM:%.*]] = load <64 x i1>, <64 x i1>* @EM
+; CHECK-NEXT: select <64 x i1> [[THENEM]], <64 x i32> %v,
+; CHECK: call { <64 x i1>, i1 } @llvm.genx.simdcf.join.v64i1.v64i1(
+; CHECK: ret void
+define void @simd64_if_else(<64 x i32> %v, <64 x i32> %w, <64 x i32>* %p) {
+entry:
+  %c = icmp sgt <64 x i32> %v, %w
+  %any = call i1 @llvm.genx.simdcf.any.v64i1(<64 x i1> %c)
+  br i1 %any, label %then, label %else
+
+then:
+  store <64 x i32> %v, <64 x i32>* %p
+  br label %end
+
+else:
+  store <64 x i32> %w, <64 x i32>* %p
+  br label %end
+
+end:
+  ret void
+}
+
+; A narrower simd branch uses a slice of the 64 bit EM.
+
+; CHECK-LABEL: define void @simd16_loop(
+; CHECK: loop:
+; CHECK: [[EM:%.*]] = load <64 x i1>, <64 x i1>* @EM
+; CHECK-NEXT: [[EM16:%.*]] = shufflevector <64 x i1> [[EM]], <64 x i1> undef, <16 x i32> <i32 0, i32 1, i32 2, i32 3, i32 4, i32 5, i32 6, i32 7, i32 8, i32 9, i32 10, i32 11, i32 12, i32 13, i32 14, i32 15>
+; CHECK-NEXT: select <16 x i1> [[EM16]],
+; CHECK: call { <64 x i1>, <16 x i1>, i1 } @llvm.genx.simdcf.goto.v64i1.v16i1(
+; CHECK: call { <64 x i1>, i1 } @llvm.genx.simdcf.join.v64i1.v16i1(
+define void @simd16_loop(<16 x i32> %v, <16 x i32>* %p) {
+entry:
+  br label %loop
+
+loop:
+  %x = phi <16 x i32> [ %v, %entry ], [ %y, %loop ]
+  %y = add <16 x i32> %x, <i32 -1, i32 -1, i32 -1, i32 -1, i32 -1, i32 -1, i32 -1, i32 -1, i32 -1, i32 -1, i32 -1, i32 -1, i32 -1, i32 -1, i32 -1, i32 -1>
+  store <16 x i32> %y, <16 x i32>* %p
+  %c = icmp sgt <16 x i32> %y, zeroinitializer
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %loop, label %exit
+
+exit:
+  ret void
+}
@@ -0,0 +1,71 @@
+; RUN: opt -cmsimdcflowering -cmsimdcf-ssa-masks -S < %s | FileCheck %s
+
+; With -cmsimdcf-ssa-masks, EM and RM are SSA values within a function. The
+; loop header gets phis for the EM and RM coming round the back edge, and the
+; goto/join take them directly. EM only goes through the EM global at a call:
+; it is stored before the call and reloaded after it, and the join after the
+; call gets a phi of the reloaded EM and the EM of the path around the call.
+
+declare i1 @llvm.genx.simdcf.any.v16i1(<16 x i1>)
+
+; CHECK-LABEL: define dllexport void @kernel(
+; CHECK: entry:
+; CHECK-NEXT: [[EM0:%.*]] = load <32 x i1>, <32 x i1>* @EM
+; CHECK: loop:
+; CHECK-NEXT: [[RM:%.*]] = phi <16 x i1> [ zeroinitializer, %entry ], [ [[GOTORM:%.*]], %loop.backward ]
+; CHECK-NEXT: [[EM:%.*]] = phi <32 x i1> [ [[EM0]], %entry ], [ [[GOTOEM:%.*]], %loop.backward ]
+; CHECK: shufflevector <32 x i1> [[EM]], <32 x i1> undef, <16 x i32>
+; CHECK: [[GOTO:%.*]] = call { <32 x i1>, <16 x i1>, i1 } @llvm.genx.simdcf.goto.v32i1.v16i1(<32 x i1> [[EM]], <16 x i1> [[RM]], <16 x i1> %c)
+; CHECK-NEXT: [[GOTOEM]] = extractvalue { <32 x i1>, <16 x i1>, i1 } [[GOTO]], 0
+; CHECK-NEXT: [[GOTORM]] = extractvalue { <32 x i1>, <16 x i1>, i1 } [[GOTO]], 1
+; CHECK: after:
+; CHECK-NEXT: call { <32 x i1>, i1 } @llvm.genx.simdcf.join.v32i1.v16i1(<32 x i1> [[GOTOEM]], <16 x i1> [[GOTORM]])
+; CHECK: [[GOTO2:%.*]] = call { <32 x i1>, <16 x i1>, i1 } @llvm.genx.simdcf.goto.v32i1.v16i1(
+; CHECK-NEXT: [[GOTO2EM:%.*]] = extractvalue { <32 x i1>, <16 x i1>, i1 } [[GOTO2]], 0
+; CHECK: then:
+; CHECK-NEXT: store <32 x i1> [[GOTO2EM]], <32 x i1>* @EM
+; CHECK-NEXT: call void @sub(
+; CHECK-NEXT: [[EMAFTER:%.*]] = load <32 x i1>, <32 x i1>* @EM
+; CHECK: end:
+; CHECK-NEXT: [[EMJOIN:%.*]] = phi <32 x i1> [ [[GOTO2EM]], %.afterjoin ], [ [[EMAFTER]], %then ]
+; CHECK-NEXT: call { <32 x i1>, i1 } @llvm.genx.simdcf.join.v32i1.v16i1(<32 x i1> [[EMJOIN]],
+; CHECK-NOT: alloca
+; CHECK: ret void
+define dllexport void @kernel(<16 x i32> %v, <16 x i32>* %p) #0 {
+entry:
+  br label %loop
+
+loop:
+  %i = phi <16 x i32> [ %v, %entry ], [ %dec, %loop ]
+  %dec = sub <16 x i32> %i, <i32 1, i32 1, i32 1, i32 1, i32 1, i32 1, i32 1, i32 1, i32 1, i32 1, i32 1, i32 1, i32 1, i32 1, i32 1, i32 1>
+  store <16 x i32> %dec, <16 x i32>* %p
+  %c = icmp sgt <16 x i32> %dec, zeroinitializer
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %loop, label %after
+
+after:
+  %d = icmp sgt <16 x i32> %v, <i32 5, i32 5, i32 5, i32 5, i32 5, i32 5, i32 5, i32 5, i32 5, i32 5, i32 5, i32 5, i32 5, i32 5, i32 5, i32 5>
+  %any2 = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %d)
+  br i1 %any2, label %then, label %end
+
+then:
+  call void @sub(<16 x i32> %v, <16 x i32>* %p)
+  br label %end
+
+end:
+  ret void
+}
+
+; The predicated subroutine takes its call mask from the EM global.
+; CHECK-LABEL: define internal void @sub(
+; CHECK-NEXT: entry:
+; CHECK-NEXT: [[SUBEM:%.*]] = load <32 x i1>, <32 x i1>* @EM
+; CHECK: shufflevector <32 x i1> [[SUBEM]], <32 x i1> undef, <16 x i32>
+; CHECK: ret void
+define internal void @sub(<16 x i32> %v, <16 x i32>* %p) {
+entry:
+  store <16 x i32> %v, <16 x i32>* %p
+  ret void
+}
+
+attributes #0 = { "CMGenxMain" }
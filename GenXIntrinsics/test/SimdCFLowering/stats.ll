@@ -0,0 +1,80 @@
+; REQUIRES: asserts
+; RUN: opt -cmsimdcflowering -stats -disable-output < %S/share_rm.ll 2>&1 | FileCheck --check-prefix=SHARE %s
+; RUN: opt -cmsimdcflowering -stats -disable-output < %s 2>&1 | FileCheck %s
+; RUN: opt -cmsimdcflowering -stats -stats-json -disable-output < %s 2>&1 | FileCheck --check-prefix=JSON %s
+
+; The statistics for share_rm.ll: four simd ifs, three of them predicating a
+; store, with one resume mask variable saved by sharing.
+
+; SHARE-DAG: 4 cmsimdcflowering - Number of simd branches found
+; SHARE-DAG: 6 cmsimdcflowering - Number of basic blocks predicated
+; SHARE-DAG: 3 cmsimdcflowering - Number of stores predicated by load, select, store
+; SHARE-DAG: 4 cmsimdcflowering - Number of resume mask variables created
+; SHARE-DAG: 1 cmsimdcflowering - Number of resume mask variables removed by sharing
+
+; The statistics for @kernel below: a simd16 if/else, with a store
+; predicated through a wrregion and a call in the true leg, and an unmask
+; region and a store in the false leg. Each predicated store, including the
+; one in @sub, loads and slices EM. The join at the start of the false leg
+; needs a JIP and the one at the end does not. The false leg's branch to
+; the end stays scalar.
+
+; CHECK-DAG: 1 cmsimdcflowering - Number of simd branches found
+; CHECK-DAG: 4 cmsimdcflowering - Number of basic blocks predicated
+; CHECK-DAG: 1 cmsimdcflowering - Number of simd branches converted back to scalar branches
+; CHECK-DAG: 1 cmsimdcflowering - Number of joins with a JIP
+; CHECK-DAG: 1 cmsimdcflowering - Number of joins without a JIP
+; CHECK-DAG: 1 cmsimdcflowering - Number of stores predicated by predicating a wrregion
+; CHECK-DAG: 2 cmsimdcflowering - Number of stores predicated by load, select, store
+; CHECK-DAG: 3 cmsimdcflowering - Number of execution mask loads for predication
+; CHECK-DAG: 3 cmsimdcflowering - Number of execution mask slices for predication
+; CHECK-DAG: 2 cmsimdcflowering - Number of resume mask variables created
+; CHECK-DAG: 1 cmsimdcflowering - Number of unmask begin/end pairs lowered
+; CHECK-DAG: 1 cmsimdcflowering - Number of predicated subroutines
+
+; JSON: {
+; JSON-DAG: "cmsimdcflowering.NumSimdBranches": 1
+; JSON-DAG: "cmsimdcflowering.NumUnmaskPairs": 1
+; JSON-DAG: "cmsimdcflowering.NumPredicatedSubroutines": 1
+; JSON-DAG: "cmsimdcflowering.NumEMShuffles": 3
+; JSON: }
+
+declare i1 @llvm.genx.simdcf.any.v16i1(<16 x i1>)
+declare i32 @llvm.genx.unmask.begin()
+declare void @llvm.genx.unmask.end(i32)
+declare <32 x i32> @llvm.genx.wrregioni.v32i32.v16i32.i16.i1(<32 x i32>, <16 x i32>, i32, i32, i32, i16, i32, i1) readnone
+
+define dllexport void @kernel(<16 x i32> %v, <16 x i32>* %p, <32 x i32>* %q, i32* %s) #0 {
+entry:
+  %saved = alloca i32
+  %c = icmp sgt <16 x i32> %v, zeroinitializer
+  %any.c = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any.c, label %then, label %else
+
+then:
+  %old = load <32 x i32>, <32 x i32>* %q
+  %new = call <32 x i32> @llvm.genx.wrregioni.v32i32.v16i32.i16.i1(<32 x i32> %old, <16 x i32> %v, i32 0, i32 16, i32 1, i16 0, i32 undef, i1 true)
+  store <32 x i32> %new, <32 x i32>* %q
+  call void @sub(<16 x i32> %v, <16 x i32>* %p)
+  br label %end
+
+else:
+  %begin = call i32 @llvm.genx.unmask.begin()
+  store i32 %begin, i32* %saved
+  store i32 0, i32* %s
+  %load = load i32, i32* %saved
+  call void @llvm.genx.unmask.end(i32 %load)
+  store <16 x i32> %v, <16 x i32>* %p
+  br label %end
+
+end:
+  ret void
+}
+
+define internal void @sub(<16 x i32> %v, <16 x i32>* %p) {
+entry:
+  store <16 x i32> %v, <16 x i32>* %p
+  ret void
+}
+
+attributes #0 = { "CMGenxMain" }
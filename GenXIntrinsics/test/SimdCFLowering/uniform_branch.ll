@@ -0,0 +1,101 @@
+; RUN: opt -cmsimdcflowering -S < %s | FileCheck %s
+
+; A simd branch on a condition that is the same in every channel stays a
+; scalar branch on channel 0 of the condition.
+
+declare i1 @llvm.genx.simdcf.any.v16i1(<16 x i1>)
+
+; CHECK-LABEL: define void @uniform_if(
+; CHECK: [[COND:%.*]] = extractelement <16 x i1> %c, i32 0
+; CHECK-NEXT: br i1 [[COND]], label %then, label %end
+; CHECK: then:
+; CHECK-NEXT: store <16 x i32> %v, <16 x i32>* %p
+; CHECK-NOT: @llvm.genx.simdcf.goto
+; CHECK: ret void
+define void @uniform_if(i32 %s, <16 x i32> %v, <16 x i32>* %p) {
+entry:
+  %ins = insertelement <16 x i32> undef, i32 %s, i32 0
+  %splat = shufflevector <16 x i32> %ins, <16 x i32> undef, <16 x i32> zeroinitializer
+  %c = icmp sgt <16 x i32> %splat, zeroinitializer
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %then, label %end
+
+then:
+  store <16 x i32> %v, <16 x i32>* %p
+  br label %end
+
+end:
+  ret void
+}
+
+; A uniform branch inside simd control flow is still lowered to a goto, and
+; the code it controls is predicated.
+
+; CHECK-LABEL: define void @uniform_in_simd_if(
+; CHECK: @llvm.genx.simdcf.goto.v32i1.v16i1(
+; CHECK: inner:
+; CHECK: @llvm.genx.simdcf.goto.v32i1.v16i1(
+; CHECK: then:
+; CHECK: select <16 x i1> {{%.*}}, <16 x i32> %v,
+; CHECK: ret void
+define void @uniform_in_simd_if(i32 %s, <16 x i32> %v, <16 x i32>* %p) {
+entry:
+  %d = icmp sgt <16 x i32> %v, zeroinitializer
+  %anyd = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %d)
+  br i1 %anyd, label %inner, label %end
+
+inner:
+  %ins = insertelement <16 x i32> undef, i32 %s, i32 0
+  %splat = shufflevector <16 x i32> %ins, <16 x i32> undef, <16 x i32> zeroinitializer
+  %c = icmp sgt <16 x i32> %splat, zeroinitializer
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %then, label %end
+
+then:
+  store <16 x i32> %v, <16 x i32>* %p
+  br label %end
+
+end:
+  ret void
+}
+
+; Comparing with a splat constant keeps the condition uniform; comparing
+; with a constant whose elements differ does not.
+; CHECK-LABEL: define void @splat_constant(
+; CHECK: extractelement <16 x i1> %c, i32 0
+; CHECK-NOT: @llvm.genx.simdcf.goto
+; CHECK: ret void
+define void @splat_constant(i32 %s, <16 x i32> %v, <16 x i32>* %p) {
+entry:
+  %ins = insertelement <16 x i32> undef, i32 %s, i32 0
+  %splat = shufflevector <16 x i32> %ins, <16 x i32> undef, <16 x i32> zeroinitializer
+  %c = icmp sgt <16 x i32> %splat, <i32 5, i32 5, i32 5, i32 5, i32 5, i32 5, i32 5, i32 5, i32 5, i32 5, i32 5, i32 5, i32 5, i32 5, i32 5, i32 5>
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %then, label %end
+
+then:
+  store <16 x i32> %v, <16 x i32>* %p
+  br label %end
+
+end:
+  ret void
+}
+
+; CHECK-LABEL: define void @non_splat_constant(
+; CHECK: @llvm.genx.simdcf.goto.v32i1.v16i1(
+; CHECK: ret void
+define void @non_splat_constant(i32 %s, <16 x i32> %v, <16 x i32>* %p) {
+entry:
+  %ins = insertelement <16 x i32> undef, i32 %s, i32 0
+  %splat = shufflevector <16 x i32> %ins, <16 x i32> undef, <16 x i32> zeroinitializer
+  %c = icmp sgt <16 x i32> %splat, <i32 0, i32 1, i32 2, i32 3, i32 4, i32 5, i32 6, i32 7, i32 8, i32 9, i32 10, i32 11, i32 12, i32 13, i32 14, i32 15>
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %then, label %end
+
+then:
+  store <16 x i32> %v, <16 x i32>* %p
+  br label %end
+
+end:
+  ret void
+}
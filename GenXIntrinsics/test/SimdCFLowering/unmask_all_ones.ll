@@ -0,0 +1,73 @@
+; RUN: opt -cmsimdcflowering -S < %s | FileCheck %s
+
+; Inside an unmask region EM is all ones, so a store there is not predicated
+; even though its block is controlled by a simd branch.
+
+declare i1 @llvm.genx.simdcf.any.v16i1(<16 x i1>)
+declare i32 @llvm.genx.unmask.begin()
+declare void @llvm.genx.unmask.end(i32)
+
+; CHECK-LABEL: define void @unmask_in_simd_if(
+; CHECK: then:
+; CHECK: select <16 x i1> {{%.*}}, <16 x i32> %v,
+; CHECK: @llvm.genx.simdcf.unmask.v32i1(
+; CHECK-NOT: select
+; CHECK: store <16 x i32> %w, <16 x i32>* %p
+; CHECK: @llvm.genx.simdcf.remask.v32i1(
+; CHECK: ret void
+define void @unmask_in_simd_if(<16 x i32> %v, <16 x i32> %w, <16 x i32>* %p) {
+entry:
+  %saved = alloca i32
+  %c = icmp sgt <16 x i32> %v, %w
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %then, label %end
+
+then:
+  store <16 x i32> %v, <16 x i32>* %p
+  %begin = call i32 @llvm.genx.unmask.begin()
+  store i32 %begin, i32* %saved
+  store <16 x i32> %w, <16 x i32>* %p
+  %load = load i32, i32* %saved
+  call void @llvm.genx.unmask.end(i32 %load)
+  br label %end
+
+end:
+  ret void
+}
+
+; A call inside an unmask region runs with all channels enabled, so it does
+; not make @sub a predicated subroutine.
+; CHECK-LABEL: define void @call_in_unmask(
+; CHECK: @llvm.genx.simdcf.unmask.v32i1(
+; CHECK-NOT: @llvm.genx.simdcf.remask
+; CHECK: call void @sub(<16 x i32> %w, <16 x i32>* %p)
+; CHECK: @llvm.genx.simdcf.remask.v32i1(
+; CHECK: ret void
+define void @call_in_unmask(<16 x i32> %v, <16 x i32> %w, <16 x i32>* %p) {
+entry:
+  %saved = alloca i32
+  %c = icmp sgt <16 x i32> %v, %w
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %then, label %end
+
+then:
+  %begin = call i32 @llvm.genx.unmask.begin()
+  store i32 %begin, i32* %saved
+  call void @sub(<16 x i32> %w, <16 x i32>* %p)
+  %load = load i32, i32* %saved
+  call void @llvm.genx.unmask.end(i32 %load)
+  br label %end
+
+end:
+  ret void
+}
+
+; CHECK-LABEL: define internal void @sub(
+; CHECK-NEXT: entry:
+; CHECK-NEXT: store <16 x i32> %w, <16 x i32>* %p
+; CHECK-NEXT: ret void
+define internal void @sub(<16 x i32> %w, <16 x i32>* %p) {
+entry:
+  store <16 x i32> %w, <16 x i32>* %p
+  ret void
+}
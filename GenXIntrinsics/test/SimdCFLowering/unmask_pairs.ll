@@ -0,0 +1,89 @@
+; RUN: opt -cmsimdcflowering -S < %s | FileCheck %s
+; RUN: not opt -cmsimdcflowering -cmsimdcf-max-width=64 -disable-output < %s 2>&1 | FileCheck --check-prefix=SIMD64 %s
+
+; Unmask begins and ends are paired through the temp holding the saved mask.
+; An EM load that directly follows an EM store takes the stored value, so the
+; second of two adjacent regions saves the mask the first one restored. A
+; begin shared by two ends is lowered once, and each end gets its remask.
+; The mask is saved in an i32, so unmask is an error with a 64 bit EM.
+
+; SIMD64: error: CMSimdCFLowering: unmask is not supported with an execution mask wider than 32 channels
+
+declare i1 @llvm.genx.simdcf.any.v16i1(<16 x i1>)
+declare i32 @llvm.genx.unmask.begin()
+declare void @llvm.genx.unmask.end(i32)
+
+; CHECK-LABEL: define void @back_to_back(
+; CHECK: [[EM:%.*]] = load <32 x i1>, <32 x i1>* @EM
+; CHECK-NEXT: [[SAVE1:%.*]] = call i32 @llvm.genx.simdcf.savemask.v32i1(<32 x i1> [[EM]])
+; CHECK-NEXT: [[UNMASK1:%.*]] = call <32 x i1> @llvm.genx.simdcf.unmask.v32i1(i32 [[SAVE1]], i32 -1)
+; CHECK-NEXT: store <32 x i1> [[UNMASK1]], <32 x i1>* @EM
+; CHECK: [[REMASK1:%.*]] = call <32 x i1> @llvm.genx.simdcf.remask.v32i1(
+; CHECK-NEXT: store <32 x i1> [[REMASK1]], <32 x i1>* @EM
+; CHECK-NEXT: [[SAVE2:%.*]] = call i32 @llvm.genx.simdcf.savemask.v32i1(<32 x i1> [[REMASK1]])
+; CHECK-NEXT: [[UNMASK2:%.*]] = call <32 x i1> @llvm.genx.simdcf.unmask.v32i1(i32 [[SAVE2]], i32 -1)
+; CHECK-NEXT: store <32 x i1> [[UNMASK2]], <32 x i1>* @EM
+; CHECK-NEXT: store i32 [[SAVE2]], i32* %saved2
+; CHECK-NEXT: [[LOAD2:%.*]] = load i32, i32* %saved2
+; CHECK-NEXT: call <32 x i1> @llvm.genx.simdcf.remask.v32i1(<32 x i1> [[UNMASK2]], i32 [[LOAD2]])
+; CHECK-NOT: unmask.begin
+; CHECK-NOT: unmask.end
+define void @back_to_back(<16 x i32> %v, <16 x i32>* %p) {
+entry:
+  %saved1 = alloca i32
+  %saved2 = alloca i32
+  %begin1 = call i32 @llvm.genx.unmask.begin()
+  store i32 %begin1, i32* %saved1
+  store <16 x i32> %v, <16 x i32>* %p
+  %load1 = load i32, i32* %saved1
+  call void @llvm.genx.unmask.end(i32 %load1)
+  %begin2 = call i32 @llvm.genx.unmask.begin()
+  store i32 %begin2, i32* %saved2
+  %load2 = load i32, i32* %saved2
+  call void @llvm.genx.unmask.end(i32 %load2)
+  %c = icmp sgt <16 x i32> %v, zeroinitializer
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %then, label %end
+
+then:
+  store <16 x i32> %v, <16 x i32>* %p
+  br label %end
+
+end:
+  ret void
+}
+
+; CHECK-LABEL: define void @two_ends(
+; CHECK: call i32 @llvm.genx.simdcf.savemask.v32i1(
+; CHECK-NOT: @llvm.genx.simdcf.savemask
+; CHECK: a:
+; CHECK: call <32 x i1> @llvm.genx.simdcf.remask.v32i1(<32 x i1> {{%.*}}, i32 %load.a)
+; CHECK: b:
+; CHECK: call <32 x i1> @llvm.genx.simdcf.remask.v32i1(<32 x i1> {{%.*}}, i32 %load.b)
+define void @two_ends(<16 x i32> %v, <16 x i32>* %p, i1 %c) {
+entry:
+  %saved = alloca i32
+  %cv = icmp sgt <16 x i32> %v, zeroinitializer
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %cv)
+  br i1 %any, label %then, label %join
+
+then:
+  store <16 x i32> %v, <16 x i32>* %p
+  br label %join
+
+join:
+  %begin = call i32 @llvm.genx.unmask.begin()
+  store i32 %begin, i32* %saved
+  br i1 %c, label %a, label %b
+
+a:
+  store <16 x i32> %v, <16 x i32>* %p
+  %load.a = load i32, i32* %saved
+  call void @llvm.genx.unmask.end(i32 %load.a)
+  ret void
+
+b:
+  %load.b = load i32, i32* %saved
+  call void @llvm.genx.unmask.end(i32 %load.b)
+  ret void
+}
@@ -0,0 +1,72 @@
+; REQUIRES: simdcf-sim
+; RUN: echo 'v 1 -2 3 -4 5 -6 7 -8 9 -10 11 -12 13 -14 15 -16' > %t.if_else
+; RUN: echo 'p 0' >> %t.if_else
+; RUN: echo '---' >> %t.if_else
+; RUN: echo 'v 1' >> %t.if_else
+; RUN: echo 'p 0' >> %t.if_else
+; RUN: genx-simdcf-sim -lower -kernel if_else -input %t.if_else -print-buffers %s \
+; RUN:   | FileCheck %s --check-prefix=IF-ELSE
+; RUN: echo 'v 1' > %t.do_while
+; RUN: echo 'p -1 -2 -3 -4' >> %t.do_while
+; RUN: genx-simdcf-sim -lower -kernel do_while -input %t.do_while -print-buffers %s \
+; RUN:   | FileCheck %s --check-prefix=DO-WHILE
+
+; The simulator runs the lowered kernels on fixed inputs and reports the
+; fraction of lanes active per kernel, block and goto.
+
+declare i1 @llvm.genx.simdcf.any.v16i1(<16 x i1>)
+
+; The first run diverges, with half of the lanes taking each leg. In the
+; second all lanes take the then leg, and the else leg runs with no lanes.
+
+; IF-ELSE: run 0: p: 2 2 4 4 6 6 8 8 10 10 12 12 14 14 16 16
+; IF-ELSE-NEXT: run 1: p: 2 2 2 2 2 2 2 2 2 2 2 2 2 2 2 2
+; IF-ELSE-NEXT: kernel if_else: 2 run(s), simd width 16, 101 instructions, 58.9% lanes active
+; IF-ELSE: if_else/entry 2 28 92.9%
+; IF-ELSE-NEXT: if_else/then 2 32 56.2%
+; IF-ELSE-NEXT: if_else/else 2 16 9.4%
+; IF-ELSE: goto
+; IF-ELSE-NEXT: if_else/entry 2 100.0% 50.0% 0.0% 50.0%
+define void @if_else(<16 x i32> %v, <16 x i32>* %p) {
+entry:
+  %c = icmp sgt <16 x i32> %v, zeroinitializer
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %then, label %else
+
+then:
+  %a = add <16 x i32> %v, <i32 1, i32 1, i32 1, i32 1, i32 1, i32 1, i32 1, i32 1, i32 1, i32 1, i32 1, i32 1, i32 1, i32 1, i32 1, i32 1>
+  store <16 x i32> %a, <16 x i32>* %p
+  br label %end
+
+else:
+  %b = sub <16 x i32> zeroinitializer, %v
+  store <16 x i32> %b, <16 x i32>* %p
+  br label %end
+
+end:
+  ret void
+}
+
+; Lane N starts at -N-1 for the first four lanes and loops until it reaches
+; zero, so the lanes drop out of the loop one by one.
+
+; DO-WHILE: run 0: p: 0 0 0 0 1 1 1 1 1 1 1 1 1 1 1 1
+; DO-WHILE-NEXT: kernel do_while: 1 run(s), simd width 16, 83 instructions, 32.2% lanes active
+; DO-WHILE: do_while/loop 4 68 28.5%
+; DO-WHILE: goto
+; DO-WHILE-NEXT: do_while/loop 4 34.4% 0.0% 25.0% 75.0%
+define void @do_while(<16 x i32> %v, <16 x i32>* %p) {
+entry:
+  br label %loop
+
+loop:
+  %x = load <16 x i32>, <16 x i32>* %p
+  %y = add <16 x i32> %x, %v
+  store <16 x i32> %y, <16 x i32>* %p
+  %c = icmp slt <16 x i32> %y, zeroinitializer
+  %any = call i1 @llvm.genx.simdcf.any.v16i1(<16 x i1> %c)
+  br i1 %any, label %loop, label %exit
+
+exit:
+  ret void
+}
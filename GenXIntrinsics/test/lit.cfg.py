@@ -29,6 +29,13 @@ config.test_exec_root = os.path.join(config.test_run_dir, 'test_output')
 
 llvm_config.use_default_substitutions()
 
+# A RUN line starting with 'not' finds it on the path.
+llvm_config.with_environment('PATH', config.llvm_tools_dir, append_path=True)
+
+# Statistics are only printed by an LLVM built with assertions.
+if lit.util.pythonize_bool(config.llvm_enable_assertions):
+    config.available_features.add('asserts')
+
 config.substitutions.append(('%PATH%', config.environment['PATH']))
 
 tool_dirs = [config.llvm_tools_dir]
@@ -37,4 +44,9 @@ tool_dirs = [config.llvm_tools_dir]
 args_load_plugin = ['-load', config.vc_intrinsics_plugin]
 tools = [ToolSubst('opt', extra_args=args_load_plugin)]
 
+# The SIMD CF simulator is only built with -DVC_INTR_ENABLE_TOOLS=ON.
+if config.simdcf_sim:
+    config.available_features.add('simdcf-sim')
+    tools.append(ToolSubst('genx-simdcf-sim', command=config.simdcf_sim))
+
 llvm_config.add_tool_substitutions(tools, tool_dirs)
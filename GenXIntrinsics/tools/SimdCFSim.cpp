@@ -0,0 +1,1294 @@
+/*===================== begin_copyright_notice ==================================
+
+ Copyright (c) 2020, Intel Corporation
+
+
+ Permission is hereby granted, free of charge, to any person obtaining a
+ copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+======================= end_copyright_notice ==================================*/
+
+//===----------------------------------------------------------------------===//
+//
+/// genx-simdcf-sim
+/// ---------------
+///
+/// Lane level simulator for SIMD control flow. It executes a kernel of
+/// lowered IR on the CPU, modelling the execution mask (EM) and resume masks
+/// with the semantics of llvm.genx.simdcf.goto, join, savemask, unmask and
+/// remask, and reports how many SIMD lanes were active: per kernel, per
+/// basic block and per goto. That measures how much SIMD efficiency is lost
+/// to divergence without running on a GPU. With -lower, the input is CM
+/// style IR that is lowered by CMSimdCFLowering first.
+///
+/// Every instruction in a block runs in all lanes, as it does on the GPU,
+/// and counts the lanes enabled in EM (up to the SIMD width) when it runs.
+/// The utilization is the average fraction of enabled lanes over executed
+/// instructions.
+///
+/// The kernel's arguments are read from the -input file, which has a line
+/// per argument giving its name (or #N for the Nth argument) and then its
+/// elements. A vector given one element is a splat, and missing elements are
+/// zero. A pointer argument points to a buffer of its pointee type, and the
+/// elements are its initial contents. A line ``---`` starts the arguments
+/// for another run of the kernel, and the statistics cover all the runs.
+/// For example:
+///
+///     v 1 -2 3 -4 5 -6 7 -8 9 -10 11 -12 13 -14 15 -16
+///     p 0
+///     ---
+///     v 1
+///     p 0
+///
+/// -profile-out writes the goto counts in the format read by
+/// -cmsimdcf-profile, so a simulation can guide the block layout of the
+/// lowering. There, all-true means that the goto's condition was true in
+/// every enabled lane, so that none left the fallthrough path.
+///
+/// Only what lowered CM kernels use is supported: integer (up to 64 bit)
+/// and float arithmetic on scalars and vectors, memory through scalar
+/// pointers, calls of defined functions and the GenX intrinsics for SIMD
+/// control flow, predicates, regions and vload/vstore. Anything else is
+/// reported as an error.
+///
+//===----------------------------------------------------------------------===//
+
+#include "llvm/GenXIntrinsics/GenXIntrinsics.h"
+#include "llvm/GenXIntrinsics/GenXIntrOpts.h"
+#include "llvm/GenXIntrinsics/GenXMetadata.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/GetElementPtrTypeIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+static cl::opt<std::string> InputIR(cl::Positional, cl::init("-"),
+                                    cl::desc("<input IR file>"));
+static cl::opt<std::string> KernelName(
+    "kernel", cl::init(""),
+    cl::desc("Function to run (default: the first kernel, or the first "
+             "function with a body)"));
+static cl::opt<std::string> InputValues("input", cl::init(""),
+                                        cl::desc("File of argument values"));
+static cl::opt<unsigned> SimdWidth(
+    "width", cl::init(0),
+    cl::desc("SIMD width (default: the widest SIMD control flow)"));
+static cl::opt<bool> Lower("lower", cl::init(false),
+                           cl::desc("Lower the SIMD control flow first"));
+static cl::opt<bool> PrintBuffers(
+    "print-buffers", cl::init(false),
+    cl::desc("Print the buffers of pointer arguments after each run"));
+static cl::opt<std::string> ProfileOut(
+    "profile-out", cl::init(""),
+    cl::desc("Write a divergence profile for -cmsimdcf-profile"));
+static cl::opt<uint64_t> MaxSteps(
+    "max-steps", cl::init(100000000),
+    cl::desc("Maximum instructions executed in one run"));
+
+// fail : report an error and exit
+[[noreturn]] static void fail(const Twine &Msg, const Value *V = nullptr) {
+  errs() << "genx-simdcf-sim: error: " << Msg;
+  if (V)
+    errs() << ": " << *V;
+  errs() << "\n";
+  exit(1);
+}
+
+namespace {
+
+// Value of an IR value in the simulation. A scalar has one lane and a vector
+// one per element, holding an integer zero extended to 64 bits, the bits of
+// a float or double, or a pointer. A struct or array has fields instead.
+struct SimValue {
+  SmallVector<uint64_t, 16> Lanes;
+  std::vector<SimValue> Fields;
+};
+
+// Execution counts of a basic block.
+struct BlockStats {
+  uint64_t Executions = 0;
+  uint64_t Insts = 0;
+  uint64_t ActiveLanes = 0;
+};
+
+// Execution counts of a goto, by how the enabled lanes went.
+struct GotoStats {
+  uint64_t Executions = 0;
+  uint64_t ActiveLanes = 0;
+  uint64_t Width = 0;
+  uint64_t AllTrue = 0;
+  uint64_t AllFalse = 0;
+  uint64_t Divergent = 0;
+};
+
+// Simulator of a module. Memory is a list of byte arrays, one per global,
+// alloca and pointer argument; a pointer has the array's number plus one in
+// its top 32 bits and the byte offset below.
+class Simulator {
+  Module &M;
+  const DataLayout &DL;
+  unsigned Width;
+  GlobalVariable *EMVar;
+  int EMObj = -1;
+  unsigned ActiveLanes;
+  uint64_t Steps = 0;
+  std::vector<std::vector<uint8_t>> Memory;
+  DenseMap<const GlobalVariable *, unsigned> GlobalObjs;
+  typedef DenseMap<const Value *, SimValue> Frame;
+
+public:
+  DenseMap<const BasicBlock *, BlockStats> Blocks;
+  MapVector<const CallInst *, GotoStats> Gotos;
+
+  Simulator(Module &M, unsigned Width);
+  unsigned getWidth() const { return Width; }
+  unsigned allocate(uint64_t Size);
+  std::vector<uint8_t> &getObject(unsigned Obj) { return Memory[Obj]; }
+  void resetRun();
+  SimValue run(Function *F, ArrayRef<SimValue> Args);
+  static uint64_t makePointer(unsigned Obj, uint64_t Offset) {
+    return (uint64_t(Obj) + 1) << 32 | Offset;
+  }
+  void encode(const SimValue &V, Type *Ty, uint8_t *Out) const;
+  SimValue decode(Type *Ty, const uint8_t *In) const;
+
+private:
+  SimValue get(Value *V, const Frame *Vals);
+  SimValue get(Value *V, const Frame &Vals) { return get(V, &Vals); }
+  SimValue evalConstant(Constant *C);
+  SimValue evalInst(Instruction *Inst, Frame &Vals);
+  SimValue evalCast(unsigned Opcode, const SimValue &V, Type *SrcTy,
+                    Type *DestTy) const;
+  SimValue evalGEP(GEPOperator *GEP, const Frame *Vals);
+  SimValue evalCall(CallInst *CI, Frame &Vals);
+  SimValue evalGenXIntrinsic(CallInst *CI, Frame &Vals);
+  uint8_t *getAddress(uint64_t Ptr, Type *Ty, const Instruction *Inst);
+  SimValue load(uint64_t Ptr, Type *Ty, const Instruction *Inst);
+  void store(const SimValue &V, uint64_t Ptr, Type *Ty,
+             const Instruction *Inst);
+  void updateActiveLanes();
+};
+
+} // namespace
+
+static unsigned getNumLanes(Type *Ty) {
+  if (auto VT = dyn_cast<VectorType>(Ty))
+    return VT->getNumElements();
+  return 1;
+}
+
+// getLaneBits : get the bits in one lane of an integer or pointer type
+static unsigned getLaneBits(Type *Ty) {
+  Type *ScalarTy = Ty->getScalarType();
+  if (ScalarTy->isPointerTy())
+    return 64;
+  unsigned Bits = ScalarTy->getPrimitiveSizeInBits();
+  if (!ScalarTy->isIntegerTy() || Bits > 64)
+    fail("unsupported type in integer operation");
+  return Bits;
+}
+
+static uint64_t truncLane(uint64_t V, unsigned Bits) {
+  return Bits >= 64 ? V : V & ((uint64_t(1) << Bits) - 1);
+}
+
+static int64_t sextLane(uint64_t V, unsigned Bits) {
+  return Bits >= 64 ? int64_t(V) : SignExtend64(V, Bits);
+}
+
+// getFP, putFP : convert a float or double lane from and to a double
+static double getFP(uint64_t V, Type *Ty) {
+  Type *ScalarTy = Ty->getScalarType();
+  if (ScalarTy->isFloatTy())
+    return BitsToFloat(uint32_t(V));
+  if (ScalarTy->isDoubleTy())
+    return BitsToDouble(V);
+  fail("unsupported floating point type");
+}
+
+static uint64_t putFP(double D, Type *Ty) {
+  if (Ty->getScalarType()->isFloatTy())
+    return FloatToBits(float(D));
+  return DoubleToBits(D);
+}
+
+// getMaskBits : get the lanes of an i1 vector (or an i32) as a bit mask
+static uint64_t getMaskBits(const SimValue &V, unsigned Lanes = 64) {
+  if (V.Lanes.size() == 1)
+    return V.Lanes[0];
+  uint64_t Bits = 0;
+  for (unsigned i = 0, e = std::min(Lanes, unsigned(V.Lanes.size())); i != e;
+       ++i)
+    Bits |= (V.Lanes[i] & 1) << i;
+  return Bits;
+}
+
+static SimValue makeMask(uint64_t Bits, unsigned Lanes) {
+  SimValue V;
+  for (unsigned i = 0; i != Lanes; ++i)
+    V.Lanes.push_back(Bits >> i & 1);
+  return V;
+}
+
+static SimValue makeScalar(uint64_t Lane) {
+  SimValue V;
+  V.Lanes.push_back(Lane);
+  return V;
+}
+
+static unsigned countLanes(uint64_t Bits, unsigned Lanes) {
+  return countPopulation(Lanes >= 64 ? Bits
+                                     : Bits & ((uint64_t(1) << Lanes) - 1));
+}
+
+Simulator::Simulator(Module &M, unsigned Width)
+    : M(M), DL(M.getDataLayout()), Width(Width),
+      EMVar(M.getGlobalVariable("EM", /*AllowInternal=*/true)),
+      ActiveLanes(Width) {}
+
+unsigned Simulator::allocate(uint64_t Size) {
+  if (Memory.size() >= UINT32_MAX || Size >= UINT32_MAX)
+    fail("out of simulated memory");
+  Memory.emplace_back(Size);
+  return Memory.size() - 1;
+}
+
+/***********************************************************************
+ * resetRun : reset the globals, including EM, for a new run
+ */
+void Simulator::resetRun() {
+  Steps = 0;
+  for (auto &Entry : GlobalObjs) {
+    auto GV = Entry.first;
+    auto &Obj = Memory[Entry.second];
+    std::fill(Obj.begin(), Obj.end(), 0);
+    if (GV->hasInitializer())
+      encode(evalConstant(const_cast<Constant *>(GV->getInitializer())),
+             GV->getValueType(), Obj.data());
+  }
+  ActiveLanes = Width;
+  if (EMVar) {
+    evalConstant(EMVar);
+    updateActiveLanes();
+  }
+}
+
+/***********************************************************************
+ * encode, decode : convert a value to and from its bytes in memory
+ *
+ * A vector of i1 is packed into bits. Everything else is little endian at
+ * the offsets given by the data layout.
+ */
+void Simulator::encode(const SimValue &V, Type *Ty, uint8_t *Out) const {
+  if (auto ST = dyn_cast<StructType>(Ty)) {
+    const StructLayout *SL = DL.getStructLayout(ST);
+    for (unsigned i = 0, e = ST->getNumElements(); i != e; ++i)
+      encode(V.Fields[i], ST->getElementType(i),
+             Out + SL->getElementOffset(i));
+    return;
+  }
+  if (auto AT = dyn_cast<ArrayType>(Ty)) {
+    uint64_t EltSize = DL.getTypeAllocSize(AT->getElementType());
+    for (unsigned i = 0, e = AT->getNumElements(); i != e; ++i)
+      encode(V.Fields[i], AT->getElementType(), Out + i * EltSize);
+    return;
+  }
+  Type *ScalarTy = Ty->getScalarType();
+  if (ScalarTy->isIntegerTy(1) && Ty->isVectorTy()) {
+    uint64_t Size = DL.getTypeStoreSize(Ty);
+    std::fill(Out, Out + Size, 0);
+    for (unsigned i = 0, e = V.Lanes.size(); i != e; ++i)
+      Out[i / 8] |= (V.Lanes[i] & 1) << (i % 8);
+    return;
+  }
+  uint64_t EltSize = DL.getTypeStoreSize(ScalarTy);
+  for (unsigned i = 0, e = V.Lanes.size(); i != e; ++i)
+    for (unsigned j = 0; j != EltSize; ++j)
+      Out[i * EltSize + j] = j < 8 ? V.Lanes[i] >> (j * 8) : 0;
+}
+
+SimValue Simulator::decode(Type *Ty, const uint8_t *In) const {
+  SimValue V;
+  if (auto ST = dyn_cast<StructType>(Ty)) {
+    const StructLayout *SL = DL.getStructLayout(ST);
+    for (unsigned i = 0, e = ST->getNumElements(); i != e; ++i)
+      V.Fields.push_back(
+          decode(ST->getElementType(i), In + SL->getElementOffset(i)));
+    return V;
+  }
+  if (auto AT = dyn_cast<ArrayType>(Ty)) {
+    uint64_t EltSize = DL.getTypeAllocSize(AT->getElementType());
+    for (unsigned i = 0, e = AT->getNumElements(); i != e; ++i)
+      V.Fields.push_back(decode(AT->getElementType(), In + i * EltSize));
+    return V;
+  }
+  Type *ScalarTy = Ty->getScalarType();
+  unsigned Lanes = getNumLanes(Ty);
+  if (ScalarTy->isIntegerTy(1) && Ty->isVectorTy()) {
+    for (unsigned i = 0; i != Lanes; ++i)
+      V.Lanes.push_back(In[i / 8] >> (i % 8) & 1);
+    return V;
+  }
+  uint64_t EltSize = DL.getTypeStoreSize(ScalarTy);
+  unsigned Bits = ScalarTy->isIntegerTy() ? getLaneBits(ScalarTy) : 64;
+  for (unsigned i = 0; i != Lanes; ++i) {
+    uint64_t Lane = 0;
+    for (unsigned j = 0; j != EltSize && j != 8; ++j)
+      Lane |= uint64_t(In[i * EltSize + j]) << (j * 8);
+    V.Lanes.push_back(truncLane(Lane, Bits));
+  }
+  return V;
+}
+
+/***********************************************************************
+ * getAddress : check a pointer for an access of a type and get its address
+ */
+uint8_t *Simulator::getAddress(uint64_t Ptr, Type *Ty,
+                               const Instruction *Inst) {
+  uint64_t Obj = (Ptr >> 32) - 1;
+  uint64_t Offset = Ptr & UINT32_MAX;
+  if (!(Ptr >> 32) || Obj >= Memory.size() ||
+      Offset + DL.getTypeStoreSize(Ty) > Memory[Obj].size())
+    fail("out of bounds memory access", Inst);
+  return Memory[Obj].data() + Offset;
+}
+
+SimValue Simulator::load(uint64_t Ptr, Type *Ty, const Instruction *Inst) {
+  return decode(Ty, getAddress(Ptr, Ty, Inst));
+}
+
+void Simulator::store(const SimValue &V, uint64_t Ptr, Type *Ty,
+                      const Instruction *Inst) {
+  encode(V, Ty, getAddress(Ptr, Ty, Inst));
+  if (EMObj >= 0 && (Ptr >> 32) == uint64_t(EMObj) + 1)
+    updateActiveLanes();
+}
+
+// updateActiveLanes : count the lanes enabled in EM after it is written
+void Simulator::updateActiveLanes() {
+  SimValue EM = decode(EMVar->getValueType(), Memory[EMObj].data());
+  ActiveLanes = countLanes(getMaskBits(EM), Width);
+}
+
+/***********************************************************************
+ * get : get the value of an operand
+ */
+SimValue Simulator::get(Value *V, const Frame *Vals) {
+  if (auto C = dyn_cast<Constant>(V))
+    return evalConstant(C);
+  auto It = Vals ? Vals->find(V) : Frame::const_iterator();
+  if (!Vals || It == Vals->end())
+    fail("use of a value that has not been computed", V);
+  return It->second;
+}
+
+/***********************************************************************
+ * evalConstant : get the value of a constant
+ *
+ * The first reference to a global variable allocates and initializes it.
+ */
+SimValue Simulator::evalConstant(Constant *C) {
+  Type *Ty = C->getType();
+  if (auto GV = dyn_cast<GlobalVariable>(C)) {
+    auto It = GlobalObjs.find(GV);
+    if (It == GlobalObjs.end()) {
+      unsigned Obj = allocate(DL.getTypeAllocSize(GV->getValueType()));
+      It = GlobalObjs.insert(std::make_pair(GV, Obj)).first;
+      if (GV->hasInitializer())
+        encode(evalConstant(GV->getInitializer()), GV->getValueType(),
+               Memory[Obj].data());
+      if (GV == EMVar) {
+        EMObj = Obj;
+        updateActiveLanes();
+      }
+    }
+    return makeScalar(makePointer(It->second, 0));
+  }
+  if (isa<GlobalValue>(C))
+    fail("unsupported reference to a function or alias", C);
+  if (auto CE = dyn_cast<ConstantExpr>(C)) {
+    if (CE->isCast())
+      return evalCast(CE->getOpcode(), evalConstant(CE->getOperand(0)),
+                      CE->getOperand(0)->getType(), Ty);
+    if (auto GEP = dyn_cast<GEPOperator>(CE))
+      return evalGEP(GEP, nullptr);
+    fail("unsupported constant expression", C);
+  }
+  SimValue V;
+  if (Ty->isStructTy() || Ty->isArrayTy()) {
+    unsigned NumFields = Ty->isStructTy() ? Ty->getStructNumElements()
+                                          : Ty->getArrayNumElements();
+    for (unsigned i = 0; i != NumFields; ++i)
+      V.Fields.push_back(evalConstant(C->getAggregateElement(i)));
+    return V;
+  }
+  if (Ty->isVectorTy()) {
+    for (unsigned i = 0, e = getNumLanes(Ty); i != e; ++i)
+      V.Lanes.push_back(evalConstant(C->getAggregateElement(i)).Lanes[0]);
+    return V;
+  }
+  if (auto CI = dyn_cast<ConstantInt>(C)) {
+    if (CI->getBitWidth() > 64)
+      fail("unsupported integer type", C);
+    return makeScalar(CI->getZExtValue());
+  }
+  if (auto CFP = dyn_cast<ConstantFP>(C))
+    return makeScalar(putFP(CFP->getValueAPF().convertToDouble(), Ty));
+  if (isa<ConstantPointerNull>(C) || isa<UndefValue>(C) || C->isNullValue())
+    return makeScalar(0);
+  fail("unsupported constant", C);
+}
+
+/***********************************************************************
+ * evalCast : convert a value
+ */
+SimValue Simulator::evalCast(unsigned Opcode, const SimValue &V, Type *SrcTy,
+                             Type *DestTy) const {
+  if (Opcode == Instruction::BitCast &&
+      (getNumLanes(SrcTy) != getNumLanes(DestTy) || SrcTy->isStructTy())) {
+    // Reinterpret the bytes.
+    std::vector<uint8_t> Bytes(DL.getTypeAllocSize(SrcTy));
+    encode(V, SrcTy, Bytes.data());
+    return decode(DestTy, Bytes.data());
+  }
+  SimValue R;
+  for (uint64_t Lane : V.Lanes) {
+    switch (Opcode) {
+    case Instruction::Trunc:
+      Lane = truncLane(Lane, getLaneBits(DestTy));
+      break;
+    case Instruction::SExt:
+      Lane = truncLane(sextLane(Lane, getLaneBits(SrcTy)),
+                       getLaneBits(DestTy));
+      break;
+    case Instruction::FPToUI:
+    case Instruction::FPToSI: {
+      double D = getFP(Lane, SrcTy);
+      if (std::isnan(D) || std::fabs(D) >= 18446744073709551616.0)
+        Lane = 0;
+      else if (Opcode == Instruction::FPToSI || D < 0)
+        Lane = truncLane(int64_t(D), getLaneBits(DestTy));
+      else
+        Lane = truncLane(uint64_t(D), getLaneBits(DestTy));
+      break;
+    }
+    case Instruction::UIToFP:
+      Lane = putFP(double(Lane), DestTy);
+      break;
+    case Instruction::SIToFP:
+      Lane = putFP(double(sextLane(Lane, getLaneBits(SrcTy))), DestTy);
+      break;
+    case Instruction::FPTrunc:
+    case Instruction::FPExt:
+      Lane = putFP(getFP(Lane, SrcTy), DestTy);
+      break;
+    case Instruction::PtrToInt:
+    case Instruction::IntToPtr:
+      Lane = truncLane(Lane, getLaneBits(DestTy));
+      break;
+    case Instruction::ZExt:
+    case Instruction::BitCast:
+    case Instruction::AddrSpaceCast:
+      break;
+    default:
+      fail("unsupported cast");
+    }
+    R.Lanes.push_back(Lane);
+  }
+  return R;
+}
+
+/***********************************************************************
+ * evalGEP : compute the address from a getelementptr
+ */
+SimValue Simulator::evalGEP(GEPOperator *GEP, const Frame *Vals) {
+  if (GEP->getType()->isVectorTy())
+    fail("unsupported vector getelementptr", GEP);
+  uint64_t Ptr = get(GEP->getPointerOperand(), Vals).Lanes[0];
+  for (auto GTI = gep_type_begin(GEP), GTE = gep_type_end(GEP); GTI != GTE;
+       ++GTI) {
+    Value *Idx = GTI.getOperand();
+    int64_t IdxVal = sextLane(get(Idx, Vals).Lanes[0],
+                              getLaneBits(Idx->getType()));
+    if (StructType *ST = GTI.getStructTypeOrNull())
+      Ptr += DL.getStructLayout(ST)->getElementOffset(IdxVal);
+    else
+      Ptr += IdxVal * int64_t(DL.getTypeAllocSize(GTI.getIndexedType()));
+  }
+  return makeScalar(Ptr);
+}
+
+// evalIntOp : evaluate an integer binary operator on one lane
+static uint64_t evalIntOp(unsigned Opcode, unsigned Bits, uint64_t A,
+                          uint64_t B) {
+  APInt X(Bits, A), Y(Bits, B);
+  switch (Opcode) {
+  case Instruction::Add: return (X + Y).getZExtValue();
+  case Instruction::Sub: return (X - Y).getZExtValue();
+  case Instruction::Mul: return (X * Y).getZExtValue();
+  case Instruction::And: return A & B;
+  case Instruction::Or: return A | B;
+  case Instruction::Xor: return A ^ B;
+  default:
+    break;
+  }
+  // Division by zero and over-wide shifts give poison; use zero.
+  if (Opcode == Instruction::Shl || Opcode == Instruction::LShr ||
+      Opcode == Instruction::AShr) {
+    if (B >= Bits)
+      return 0;
+    if (Opcode == Instruction::Shl)
+      return X.shl(B).getZExtValue();
+    if (Opcode == Instruction::LShr)
+      return X.lshr(B).getZExtValue();
+    return X.ashr(B).getZExtValue();
+  }
+  if (!B)
+    return 0;
+  switch (Opcode) {
+  case Instruction::UDiv: return X.udiv(Y).getZExtValue();
+  case Instruction::SDiv: return X.sdiv(Y).getZExtValue();
+  case Instruction::URem: return X.urem(Y).getZExtValue();
+  case Instruction::SRem: return X.srem(Y).getZExtValue();
+  default:
+    fail("unsupported binary operator");
+  }
+}
+
+// evalFPOp : evaluate a floating point binary operator on one lane
+static double evalFPOp(unsigned Opcode, double A, double B) {
+  switch (Opcode) {
+  case Instruction::FAdd: return A + B;
+  case Instruction::FSub: return A - B;
+  case Instruction::FMul: return A * B;
+  case Instruction::FDiv: return A / B;
+  case Instruction::FRem: return std::fmod(A, B);
+  default:
+    fail("unsupported binary operator");
+  }
+}
+
+// evalICmp : evaluate an integer compare on one lane
+static bool evalICmp(CmpInst::Predicate Pred, unsigned Bits, uint64_t A,
+                     uint64_t B) {
+  int64_t SA = sextLane(A, Bits), SB = sextLane(B, Bits);
+  switch (Pred) {
+  case CmpInst::ICMP_EQ: return A == B;
+  case CmpInst::ICMP_NE: return A != B;
+  case CmpInst::ICMP_UGT: return A > B;
+  case CmpInst::ICMP_UGE: return A >= B;
+  case CmpInst::ICMP_ULT: return A < B;
+  case CmpInst::ICMP_ULE: return A <= B;
+  case CmpInst::ICMP_SGT: return SA > SB;
+  case CmpInst::ICMP_SGE: return SA >= SB;
+  case CmpInst::ICMP_SLT: return SA < SB;
+  case CmpInst::ICMP_SLE: return SA <= SB;
+  default:
+    fail("unsupported compare");
+  }
+}
+
+// evalFCmp : evaluate a floating point compare on one lane
+static bool evalFCmp(CmpInst::Predicate Pred, double A, double B) {
+  bool Unordered = std::isnan(A) || std::isnan(B);
+  switch (Pred) {
+  case CmpInst::FCMP_FALSE: return false;
+  case CmpInst::FCMP_TRUE: return true;
+  case CmpInst::FCMP_ORD: return !Unordered;
+  case CmpInst::FCMP_UNO: return Unordered;
+  case CmpInst::FCMP_OEQ: return !Unordered && A == B;
+  case CmpInst::FCMP_OGT: return !Unordered && A > B;
+  case CmpInst::FCMP_OGE: return !Unordered && A >= B;
+  case CmpInst::FCMP_OLT: return !Unordered && A < B;
+  case CmpInst::FCMP_OLE: return !Unordered && A <= B;
+  case CmpInst::FCMP_ONE: return !Unordered && A != B;
+  case CmpInst::FCMP_UEQ: return Unordered || A == B;
+  case CmpInst::FCMP_UGT: return Unordered || A > B;
+  case CmpInst::FCMP_UGE: return Unordered || A >= B;
+  case CmpInst::FCMP_ULT: return Unordered || A < B;
+  case CmpInst::FCMP_ULE: return Unordered || A <= B;
+  case CmpInst::FCMP_UNE: return Unordered || A != B;
+  default:
+    fail("unsupported compare");
+  }
+}
+
+/***********************************************************************
+ * run : run a function
+ *
+ * Return:  the returned value (no lanes for void)
+ */
+SimValue Simulator::run(Function *F, ArrayRef<SimValue> Args) {
+  Frame Vals;
+  unsigned ArgNo = 0;
+  for (auto ai = F->arg_begin(), ae = F->arg_end(); ai != ae; ++ai)
+    Vals[&*ai] = Args[ArgNo++];
+  BasicBlock *BB = &F->front();
+  BasicBlock *Pred = nullptr;
+  for (;;) {
+    // The phis take their values at the same time.
+    SmallVector<std::pair<PHINode *, SimValue>, 4> PhiVals;
+    for (auto bi = BB->begin(); auto Phi = dyn_cast<PHINode>(&*bi); ++bi)
+      PhiVals.push_back(
+          std::make_pair(Phi, get(Phi->getIncomingValueForBlock(Pred), Vals)));
+    for (auto &Entry : PhiVals)
+      Vals[Entry.first] = std::move(Entry.second);
+    // The counts are added to the block's at the end, as a call can add
+    // blocks to the map.
+    uint64_t NumInsts = 0, NumActiveLanes = 0;
+    auto addStats = [&]() {
+      BlockStats &Stats = Blocks[BB];
+      ++Stats.Executions;
+      Stats.Insts += NumInsts;
+      Stats.ActiveLanes += NumActiveLanes;
+    };
+    for (auto bi = BB->getFirstNonPHI()->getIterator();; ++bi) {
+      Instruction *Inst = &*bi;
+      if (isa<DbgInfoIntrinsic>(Inst))
+        continue;
+      if (++Steps > MaxSteps)
+        fail("more than -max-steps instructions executed in " + F->getName());
+      ++NumInsts;
+      NumActiveLanes += ActiveLanes;
+      if (Inst->isTerminator())
+        addStats();
+      if (auto Br = dyn_cast<BranchInst>(Inst)) {
+        Pred = BB;
+        BB = Br->getSuccessor(0);
+        if (Br->isConditional() && !get(Br->getCondition(), Vals).Lanes[0])
+          BB = Br->getSuccessor(1);
+        break;
+      }
+      if (auto Switch = dyn_cast<SwitchInst>(Inst)) {
+        uint64_t Val = get(Switch->getCondition(), Vals).Lanes[0];
+        Pred = BB;
+        BB = Switch->getDefaultDest();
+        for (auto Case : Switch->cases())
+          if (Case.getCaseValue()->getZExtValue() == Val)
+            BB = Case.getCaseSuccessor();
+        break;
+      }
+      if (auto Ret = dyn_cast<ReturnInst>(Inst))
+        return Ret->getReturnValue() ? get(Ret->getReturnValue(), Vals)
+                                     : SimValue();
+      if (Inst->isTerminator())
+        fail("unsupported terminator", Inst);
+      SimValue V = evalInst(Inst, Vals);
+      if (!Inst->getType()->isVoidTy())
+        Vals[Inst] = std::move(V);
+    }
+  }
+}
+
+/***********************************************************************
+ * evalInst : execute a non-terminator instruction
+ */
+SimValue Simulator::evalInst(Instruction *Inst, Frame &Vals) {
+  Type *Ty = Inst->getType();
+  if (auto BO = dyn_cast<BinaryOperator>(Inst)) {
+    SimValue A = get(BO->getOperand(0), Vals);
+    SimValue B = get(BO->getOperand(1), Vals);
+    unsigned Opcode = BO->getOpcode();
+    bool IsFP = Ty->isFPOrFPVectorTy();
+    for (unsigned i = 0, e = A.Lanes.size(); i != e; ++i)
+      A.Lanes[i] = IsFP ? putFP(evalFPOp(Opcode, getFP(A.Lanes[i], Ty),
+                                         getFP(B.Lanes[i], Ty)), Ty)
+                        : evalIntOp(Opcode, getLaneBits(Ty), A.Lanes[i],
+                                    B.Lanes[i]);
+    return A;
+  }
+#if VC_INTR_LLVM_VERSION_MAJOR >= 8
+  if (Inst->getOpcode() == Instruction::FNeg) {
+    SimValue A = get(Inst->getOperand(0), Vals);
+    for (uint64_t &Lane : A.Lanes)
+      Lane = putFP(-getFP(Lane, Ty), Ty);
+    return A;
+  }
+#endif
+  if (auto Cmp = dyn_cast<CmpInst>(Inst)) {
+    Type *OpTy = Cmp->getOperand(0)->getType();
+    SimValue A = get(Cmp->getOperand(0), Vals);
+    SimValue B = get(Cmp->getOperand(1), Vals);
+    for (unsigned i = 0, e = A.Lanes.size(); i != e; ++i)
+      A.Lanes[i] = isa<FCmpInst>(Cmp)
+          ? evalFCmp(Cmp->getPredicate(), getFP(A.Lanes[i], OpTy),
+                     getFP(B.Lanes[i], OpTy))
+          : evalICmp(Cmp->getPredicate(), getLaneBits(OpTy), A.Lanes[i],
+                     B.Lanes[i]);
+    return A;
+  }
+  if (auto Cast = dyn_cast<CastInst>(Inst))
+    return evalCast(Cast->getOpcode(), get(Cast->getOperand(0), Vals),
+                    Cast->getSrcTy(), Ty);
+  if (auto Sel = dyn_cast<SelectInst>(Inst)) {
+    SimValue Cond = get(Sel->getCondition(), Vals);
+    SimValue T = get(Sel->getTrueValue(), Vals);
+    SimValue F = get(Sel->getFalseValue(), Vals);
+    if (Cond.Lanes.size() == 1)
+      return Cond.Lanes[0] ? T : F;
+    for (unsigned i = 0, e = T.Lanes.size(); i != e; ++i)
+      if (!Cond.Lanes[i])
+        T.Lanes[i] = F.Lanes[i];
+    return T;
+  }
+  if (auto EE = dyn_cast<ExtractElementInst>(Inst)) {
+    SimValue Vec = get(EE->getVectorOperand(), Vals);
+    uint64_t Idx = get(EE->getIndexOperand(), Vals).Lanes[0];
+    return makeScalar(Idx < Vec.Lanes.size() ? Vec.Lanes[Idx] : 0);
+  }
+  if (auto IE = dyn_cast<InsertElementInst>(Inst)) {
+    SimValue Vec = get(IE->getOperand(0), Vals);
+    uint64_t Idx = get(IE->getOperand(2), Vals).Lanes[0];
+    if (Idx < Vec.Lanes.size())
+      Vec.Lanes[Idx] = get(IE->getOperand(1), Vals).Lanes[0];
+    return Vec;
+  }
+  if (auto SV = dyn_cast<ShuffleVectorInst>(Inst)) {
+    SimValue A = get(SV->getOperand(0), Vals);
+    SimValue B = get(SV->getOperand(1), Vals);
+    SmallVector<int, 16> Mask;
+    SV->getShuffleMask(Mask);
+    SimValue R;
+    for (int Idx : Mask) {
+      if (Idx < 0)
+        R.Lanes.push_back(0);
+      else if (unsigned(Idx) < A.Lanes.size())
+        R.Lanes.push_back(A.Lanes[Idx]);
+      else
+        R.Lanes.push_back(B.Lanes[Idx - A.Lanes.size()]);
+    }
+    return R;
+  }
+  if (auto EV = dyn_cast<ExtractValueInst>(Inst)) {
+    SimValue V = get(EV->getAggregateOperand(), Vals);
+    for (unsigned Idx : EV->indices()) {
+      SimValue Field = std::move(V.Fields[Idx]);
+      V = std::move(Field);
+    }
+    return V;
+  }
+  if (auto IV = dyn_cast<InsertValueInst>(Inst)) {
+    SimValue V = get(IV->getAggregateOperand(), Vals);
+    SimValue *Field = &V;
+    for (unsigned Idx : IV->indices())
+      Field = &Field->Fields[Idx];
+    *Field = get(IV->getInsertedValueOperand(), Vals);
+    return V;
+  }
+  if (auto AI = dyn_cast<AllocaInst>(Inst)) {
+    uint64_t Count = get(AI->getArraySize(), Vals).Lanes[0];
+    return makeScalar(makePointer(
+        allocate(DL.getTypeAllocSize(AI->getAllocatedType()) * Count), 0));
+  }
+  if (auto LI = dyn_cast<LoadInst>(Inst))
+    return load(get(LI->getPointerOperand(), Vals).Lanes[0], Ty, LI);
+  if (auto SI = dyn_cast<StoreInst>(Inst)) {
+    Value *V = SI->getValueOperand();
+    store(get(V, Vals), get(SI->getPointerOperand(), Vals).Lanes[0],
+          V->getType(), SI);
+    return SimValue();
+  }
+  if (auto GEP = dyn_cast<GetElementPtrInst>(Inst))
+    return evalGEP(cast<GEPOperator>(GEP), &Vals);
+  if (auto CI = dyn_cast<CallInst>(Inst))
+    return evalCall(CI, Vals);
+  fail("unsupported instruction", Inst);
+}
+
+/***********************************************************************
+ * evalCall : execute a call
+ */
+SimValue Simulator::evalCall(CallInst *CI, Frame &Vals) {
+  Function *Callee = CI->getCalledFunction();
+  if (!Callee)
+    fail("unsupported indirect call", CI);
+  if (GenXIntrinsic::isGenXIntrinsic(Callee))
+    return evalGenXIntrinsic(CI, Vals);
+  switch (Callee->getIntrinsicID()) {
+  case Intrinsic::lifetime_start:
+  case Intrinsic::lifetime_end:
+  case Intrinsic::assume:
+    return SimValue();
+  case Intrinsic::not_intrinsic:
+    break;
+  default:
+    fail("unsupported intrinsic", CI);
+  }
+  if (Callee->isDeclaration())
+    fail("call of a function with no body", CI);
+  SmallVector<SimValue, 8> Args;
+  for (unsigned i = 0, e = CI->getNumArgOperands(); i != e; ++i)
+    Args.push_back(get(CI->getArgOperand(i), Vals));
+  return run(Callee, Args);
+}
+
+/***********************************************************************
+ * evalGenXIntrinsic : execute a GenX intrinsic call
+ *
+ * A goto also records how the lanes enabled in its width went.
+ */
+SimValue Simulator::evalGenXIntrinsic(CallInst *CI, Frame &Vals) {
+  auto getArg = [&](unsigned i) { return get(CI->getArgOperand(i), Vals); };
+  auto getConstArg = [&](unsigned i) {
+    auto C = dyn_cast<ConstantInt>(CI->getArgOperand(i));
+    if (!C)
+      fail("unsupported variable region parameter", CI);
+    return C->getZExtValue();
+  };
+  Type *Ty = CI->getType();
+  switch (GenXIntrinsic::getGenXIntrinsicID(CI)) {
+  case GenXIntrinsic::genx_simdcf_goto: {
+    SimValue OldEM = getArg(0), RM = getArg(1), Cond = getArg(2);
+    unsigned N = Cond.Lanes.size();
+    uint64_t EMBits = getMaskBits(OldEM, N), CondBits = getMaskBits(Cond, N);
+    unsigned Active = countLanes(EMBits, N);
+    unsigned Stay = countLanes(EMBits & CondBits, N);
+    GotoStats &Stats = Gotos[CI];
+    ++Stats.Executions;
+    Stats.ActiveLanes += Active;
+    Stats.Width = N;
+    if (!Stay)
+      ++Stats.AllFalse;
+    else if (Stay == Active)
+      ++Stats.AllTrue;
+    else
+      ++Stats.Divergent;
+    bool AnyLeft = false;
+    for (unsigned i = 0; i != N; ++i) {
+      RM.Lanes[i] |= OldEM.Lanes[i] & ~Cond.Lanes[i] & 1;
+      OldEM.Lanes[i] &= Cond.Lanes[i];
+      AnyLeft |= OldEM.Lanes[i];
+    }
+    SimValue R;
+    R.Fields.push_back(std::move(OldEM));
+    R.Fields.push_back(std::move(RM));
+    R.Fields.push_back(makeScalar(!AnyLeft));
+    return R;
+  }
+  case GenXIntrinsic::genx_simdcf_join: {
+    SimValue EM = getArg(0), RM = getArg(1);
+    bool AnyLeft = false;
+    for (unsigned i = 0, e = RM.Lanes.size(); i != e; ++i) {
+      EM.Lanes[i] |= RM.Lanes[i];
+      AnyLeft |= EM.Lanes[i];
+    }
+    SimValue R;
+    R.Fields.push_back(std::move(EM));
+    R.Fields.push_back(makeScalar(!AnyLeft));
+    return R;
+  }
+  case GenXIntrinsic::genx_simdcf_savemask:
+    return makeScalar(truncLane(getMaskBits(getArg(0)), 32));
+  case GenXIntrinsic::genx_simdcf_unmask:
+    return makeMask(getArg(1).Lanes[0], getNumLanes(Ty));
+  case GenXIntrinsic::genx_simdcf_remask:
+    return makeMask(getArg(1).Lanes[0], getNumLanes(Ty));
+  case GenXIntrinsic::genx_simdcf_get_em:
+    return getArg(0);
+  case GenXIntrinsic::genx_any:
+  case GenXIntrinsic::genx_simdcf_any: {
+    SimValue In = getArg(0);
+    return makeScalar(countLanes(getMaskBits(In), In.Lanes.size()) != 0);
+  }
+  case GenXIntrinsic::genx_all: {
+    SimValue In = getArg(0);
+    return makeScalar(countLanes(getMaskBits(In), In.Lanes.size()) ==
+                      In.Lanes.size());
+  }
+  case GenXIntrinsic::genx_rdpredregion: {
+    SimValue In = getArg(0);
+    uint64_t Offset = getConstArg(1);
+    SimValue R;
+    for (unsigned i = 0, e = getNumLanes(Ty); i != e; ++i)
+      R.Lanes.push_back(In.Lanes[Offset + i]);
+    return R;
+  }
+  case GenXIntrinsic::genx_wrpredregion:
+  case GenXIntrinsic::genx_wrpredpredregion: {
+    SimValue Old = getArg(0), New = getArg(1);
+    uint64_t Offset = getConstArg(2);
+    bool IsPredicated = GenXIntrinsic::getGenXIntrinsicID(CI) ==
+                        GenXIntrinsic::genx_wrpredpredregion;
+    SimValue Pred = IsPredicated ? getArg(3) : SimValue();
+    for (unsigned i = 0, e = New.Lanes.size(); i != e; ++i)
+      if (!IsPredicated || Pred.Lanes[Offset + i])
+        Old.Lanes[Offset + i] = New.Lanes[i];
+    return Old;
+  }
+  case GenXIntrinsic::genx_rdregioni:
+  case GenXIntrinsic::genx_rdregionf: {
+    namespace R = GenXIntrinsic::GenXRegion;
+    Value *In = CI->getArgOperand(R::OldValueOperandNum);
+    SimValue InVal = get(In, Vals);
+    uint64_t VStride = getConstArg(R::RdVStrideOperandNum);
+    uint64_t RegionWidth =
+        std::max<uint64_t>(getConstArg(R::RdWidthOperandNum), 1);
+    uint64_t Stride = getConstArg(R::RdStrideOperandNum);
+    uint64_t Start = getConstArg(R::RdIndexOperandNum) /
+                     DL.getTypeStoreSize(In->getType()->getScalarType());
+    SimValue Res;
+    for (unsigned i = 0, e = getNumLanes(Ty); i != e; ++i) {
+      uint64_t Idx =
+          Start + i / RegionWidth * VStride + i % RegionWidth * Stride;
+      if (Idx >= InVal.Lanes.size())
+        fail("region out of bounds", CI);
+      Res.Lanes.push_back(InVal.Lanes[Idx]);
+    }
+    return Res;
+  }
+  case GenXIntrinsic::genx_wrregioni:
+  case GenXIntrinsic::genx_wrregionf: {
+    namespace R = GenXIntrinsic::GenXRegion;
+    SimValue Old = getArg(R::OldValueOperandNum);
+    SimValue New = getArg(R::NewValueOperandNum);
+    SimValue Mask = getArg(R::PredicateOperandNum);
+    uint64_t VStride = getConstArg(R::WrVStrideOperandNum);
+    uint64_t RegionWidth =
+        std::max<uint64_t>(getConstArg(R::WrWidthOperandNum), 1);
+    uint64_t Stride = getConstArg(R::WrStrideOperandNum);
+    uint64_t Start = getConstArg(R::WrIndexOperandNum) /
+                     DL.getTypeStoreSize(Ty->getScalarType());
+    for (unsigned i = 0, e = New.Lanes.size(); i != e; ++i) {
+      if (!Mask.Lanes[Mask.Lanes.size() == 1 ? 0 : i])
+        continue;
+      uint64_t Idx =
+          Start + i / RegionWidth * VStride + i % RegionWidth * Stride;
+      if (Idx >= Old.Lanes.size())
+        fail("region out of bounds", CI);
+      Old.Lanes[Idx] = New.Lanes[i];
+    }
+    return Old;
+  }
+  case GenXIntrinsic::genx_vload:
+    return load(getArg(0).Lanes[0], Ty, CI);
+  case GenXIntrinsic::genx_vstore: {
+    Value *V = CI->getArgOperand(0);
+    store(get(V, Vals), getArg(1).Lanes[0], V->getType(), CI);
+    return SimValue();
+  }
+  default:
+    break;
+  }
+  fail("unsupported GenX intrinsic", CI);
+}
+
+// getSimdWidth : get the widest SIMD control flow in a module
+static unsigned getSimdWidth(Module &M) {
+  unsigned Width = 0;
+  for (Function &F : M)
+    for (User *U : F.users())
+      if (auto CI = dyn_cast<CallInst>(U))
+        if (GenXIntrinsic::getGenXIntrinsicID(CI) ==
+                GenXIntrinsic::genx_simdcf_goto ||
+            GenXIntrinsic::getGenXIntrinsicID(CI) ==
+                GenXIntrinsic::genx_simdcf_join)
+          Width = std::max(Width,
+                           getNumLanes(CI->getArgOperand(1)->getType()));
+  return Width;
+}
+
+// getKernel : get the function to run
+static Function *getKernel(Module &M) {
+  if (!KernelName.empty()) {
+    Function *F = M.getFunction(KernelName);
+    if (!F || F->isDeclaration())
+      fail("no function " + KernelName + " with a body");
+    return F;
+  }
+  Function *First = nullptr;
+  for (Function &F : M) {
+    if (F.isDeclaration())
+      continue;
+    if (F.hasFnAttribute(genx::FunctionMD::CMGenXMain))
+      return &F;
+    if (!First)
+      First = &F;
+  }
+  if (!First)
+    fail("no function with a body");
+  return First;
+}
+
+/***********************************************************************
+ * parseLane : parse one element of an argument
+ */
+static uint64_t parseLane(StringRef Str, Type *Ty) {
+  if (Ty->isFloatingPointTy()) {
+    double D;
+    if (Str.getAsDouble(D))
+      fail("bad floating point value " + Str);
+    return putFP(D, Ty);
+  }
+  int64_t I;
+  if (Str.getAsInteger(0, I)) {
+    uint64_t U;
+    if (Str.getAsInteger(0, U))
+      fail("bad integer value " + Str);
+    I = U;
+  }
+  return truncLane(I, getLaneBits(Ty));
+}
+
+// makeArg : make a value of a type from a list of elements
+static SimValue makeArg(Type *Ty, ArrayRef<StringRef> Elts) {
+  if (!Ty->isIntOrIntVectorTy() && !Ty->isFPOrFPVectorTy())
+    fail("unsupported argument type");
+  SimValue V;
+  Type *ScalarTy = Ty->getScalarType();
+  for (unsigned i = 0, e = getNumLanes(Ty); i != e; ++i) {
+    if (Elts.size() == 1)
+      V.Lanes.push_back(parseLane(Elts[0], ScalarTy));
+    else
+      V.Lanes.push_back(i < Elts.size() ? parseLane(Elts[i], ScalarTy) : 0);
+  }
+  return V;
+}
+
+// readInputs : read the argument values of each run
+static std::vector<StringMap<SmallVector<StringRef, 16>>>
+readInputs(const MemoryBuffer &Buf) {
+  std::vector<StringMap<SmallVector<StringRef, 16>>> Runs(1);
+  for (line_iterator li(Buf, /*SkipBlanks=*/true, '#'); !li.is_at_end();
+       ++li) {
+    SmallVector<StringRef, 16> Fields;
+    SplitString(*li, Fields);
+    if (Fields.empty())
+      continue;
+    if (Fields[0] == "---") {
+      Runs.emplace_back();
+      continue;
+    }
+    Runs.back()[Fields[0]].assign(Fields.begin() + 1, Fields.end());
+  }
+  return Runs;
+}
+
+// printBuffer : print the contents of a buffer
+static void printBuffer(raw_ostream &OS, const SimValue &V, Type *Ty) {
+  if (V.Lanes.empty()) {
+    for (const SimValue &Field : V.Fields)
+      printBuffer(OS, Field, Ty->isStructTy() ? nullptr :
+                  Ty->getArrayElementType());
+    return;
+  }
+  for (uint64_t Lane : V.Lanes) {
+    if (Ty && Ty->isFPOrFPVectorTy())
+      OS << " " << format("%g", getFP(Lane, Ty));
+    else if (Ty)
+      OS << " " << sextLane(Lane, getLaneBits(Ty));
+  }
+}
+
+static std::string getName(const Value *V) {
+  return V->hasName() ? V->getName().str() : "<unnamed>";
+}
+
+static std::string getLocation(const Instruction *Inst) {
+  const DebugLoc &Loc = Inst->getDebugLoc();
+  if (!Loc)
+    return "";
+  return (Loc->getFilename() + ":" + Twine(Loc.getLine()) + ":" +
+          Twine(Loc.getCol())).str();
+}
+
+static std::string getPercent(uint64_t Num, uint64_t Denom) {
+  if (!Denom)
+    return "-";
+  std::string Str;
+  raw_string_ostream(Str) << format("%.1f%%", 100.0 * Num / Denom);
+  return Str;
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "SIMD control flow lane simulator\n");
+
+  LLVMContext Ctx;
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M = parseIRFile(InputIR, Err, Ctx);
+  if (!M) {
+    Err.print(argv[0], errs());
+    return 1;
+  }
+  if (Lower) {
+    legacy::PassManager PM;
+    PM.add(createCMSimdCFLoweringPass());
+    PM.run(*M);
+  }
+  if (verifyModule(*M, &errs()))
+    return 1;
+
+  Function *Kernel = getKernel(*M);
+  unsigned Width = SimdWidth ? unsigned(SimdWidth) : getSimdWidth(*M);
+  if (!Width)
+    Width = 1;
+  if (Width > 64)
+    fail("simd width must be at most 64");
+
+  std::vector<StringMap<SmallVector<StringRef, 16>>> Runs(1);
+  std::unique_ptr<MemoryBuffer> InputBuf;
+  if (!InputValues.empty()) {
+    auto Buf = MemoryBuffer::getFile(InputValues);
+    if (!Buf)
+      fail("cannot read " + InputValues);
+    InputBuf = std::move(*Buf);
+    Runs = readInputs(*InputBuf);
+  }
+
+  Simulator Sim(*M, Width);
+  for (unsigned RunNo = 0; RunNo != Runs.size(); ++RunNo) {
+    auto &Inputs = Runs[RunNo];
+    SmallVector<SimValue, 8> Args;
+    SmallVector<std::pair<Argument *, unsigned>, 4> Buffers;
+    for (auto ai = Kernel->arg_begin(), ae = Kernel->arg_end(); ai != ae;
+         ++ai) {
+      Argument *Arg = &*ai;
+      auto It = Inputs.find(Arg->getName());
+      if (!Arg->hasName() || It == Inputs.end())
+        It = Inputs.find(("#" + Twine(Arg->getArgNo())).str());
+      ArrayRef<StringRef> Elts;
+      if (It != Inputs.end())
+        Elts = It->second;
+      Type *Ty = Arg->getType();
+      if (auto PT = dyn_cast<PointerType>(Ty)) {
+        Type *ElTy = PT->getPointerElementType();
+        unsigned Obj = Sim.allocate(
+            M->getDataLayout().getTypeAllocSize(ElTy));
+        if (!Elts.empty())
+          Sim.encode(makeArg(ElTy, Elts), ElTy, Sim.getObject(Obj).data());
+        Buffers.push_back(std::make_pair(Arg, Obj));
+        Args.push_back(makeScalar(Simulator::makePointer(Obj, 0)));
+      }
+      else {
+        StringRef Zero = "0";
+        Args.push_back(makeArg(Ty, Elts.empty() ? makeArrayRef(Zero) : Elts));
+      }
+    }
+    Sim.resetRun();
+    Sim.run(Kernel, Args);
+    if (PrintBuffers) {
+      for (auto &Entry : Buffers) {
+        Type *ElTy = Entry.first->getType()->getPointerElementType();
+        outs() << "run " << RunNo << ": " << getName(Entry.first) << ":";
+        printBuffer(outs(),
+                    Sim.decode(ElTy, Sim.getObject(Entry.second).data()),
+                    ElTy);
+        outs() << "\n";
+      }
+    }
+  }
+
+  // Report the kernel, then each block executed and each goto.
+  uint64_t Insts = 0, ActiveLanes = 0;
+  for (auto &Entry : Sim.Blocks) {
+    Insts += Entry.second.Insts;
+    ActiveLanes += Entry.second.ActiveLanes;
+  }
+  outs() << "kernel " << Kernel->getName() << ": " << Runs.size()
+         << " run(s), simd width " << Width << ", " << Insts
+         << " instructions, "
+         << getPercent(ActiveLanes, Insts * Width) << " lanes active\n";
+  outs() << "\nblock                          executions  instructions"
+            "  active\n";
+  for (Function &F : *M)
+    for (BasicBlock &BB : F) {
+      auto It = Sim.Blocks.find(&BB);
+      if (It == Sim.Blocks.end())
+        continue;
+      const BlockStats &Stats = It->second;
+      outs() << format("%-30s %10llu %13llu  %6s\n",
+                       (F.getName() + "/" + getName(&BB)).str().c_str(),
+                       (unsigned long long)Stats.Executions,
+                       (unsigned long long)Stats.Insts,
+                       getPercent(Stats.ActiveLanes,
+                                  Stats.Insts * Width).c_str());
+    }
+  outs() << "\ngoto                           executions  active"
+            "  all-true  all-false  divergent\n";
+  for (auto &Entry : Sim.Gotos) {
+    const CallInst *CI = Entry.first;
+    const GotoStats &Stats = Entry.second;
+    std::string Name = (CI->getFunction()->getName() + "/" +
+                        getName(CI->getParent())).str();
+    std::string Loc = getLocation(CI);
+    if (!Loc.empty())
+      Name += " (" + Loc + ")";
+    outs() << format("%-30s %10llu  %6s  %8s  %9s  %9s\n", Name.c_str(),
+                     (unsigned long long)Stats.Executions,
+                     getPercent(Stats.ActiveLanes,
+                                Stats.Executions * Stats.Width).c_str(),
+                     getPercent(Stats.AllTrue, Stats.Executions).c_str(),
+                     getPercent(Stats.AllFalse, Stats.Executions).c_str(),
+                     getPercent(Stats.Divergent, Stats.Executions).c_str());
+  }
+
+  if (!ProfileOut.empty()) {
+    // Gotos are keyed by their debug location, and ones without are left
+    // out.
+    std::map<std::string, GotoStats> Profile;
+    for (auto &Entry : Sim.Gotos) {
+      std::string Loc = getLocation(Entry.first);
+      if (Loc.empty())
+        continue;
+      GotoStats &P = Profile[Loc];
+      P.AllTrue += Entry.second.AllTrue;
+      P.AllFalse += Entry.second.AllFalse;
+      P.Divergent += Entry.second.Divergent;
+    }
+    std::error_code EC;
+#if VC_INTR_LLVM_VERSION_MAJOR >= 8
+    raw_fd_ostream OS(ProfileOut, EC, sys::fs::OF_Text);
+#else
+    raw_fd_ostream OS(ProfileOut, EC, sys::fs::F_Text);
+#endif
+    if (EC)
+      fail("cannot write " + ProfileOut + ": " + EC.message());
+    OS << "# file:line:column all-true all-false divergent\n";
+    for (auto &Entry : Profile)
+      OS << Entry.first << " " << Entry.second.AllTrue << " "
+         << Entry.second.AllFalse << " " << Entry.second.Divergent << "\n";
+  }
+  return 0;
+}